@@ -0,0 +1,73 @@
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+
+#include "arena.h"
+
+using namespace std;
+
+frameArena::frameArena(size_t blockSize)
+    :current(0),used(0),blockSize(blockSize){}
+
+frameArena::~frameArena(){
+    for (block &b : blocks)
+        free(b.data);
+}
+
+void *frameArena::allocate(size_t bytes, size_t align){
+    if (bytes == 0)
+        bytes = 1;
+
+    //the rest of the current block, then the first later one it fits in
+    for (size_t i = current; i < blocks.size(); i++){
+        uintptr_t base = (uintptr_t)blocks[i].data;
+        size_t offset = i == current ? used : 0;
+        size_t start = (size_t)(((base + offset + align - 1) & ~(uintptr_t)(align - 1)) - base);
+        if (start + bytes <= blocks[i].size){
+            current = i;
+            used = start + bytes;
+            return blocks[i].data + start;
+        }
+    }
+
+    //none is big enough, each new block is at least as big as all the ones before it together
+    //so a frame that keeps growing settles on a handful of them
+    size_t size = blockSize;
+    for (const block &b : blocks)
+        size += b.size;
+    if (size < bytes + align)
+        size = bytes + align;
+
+    block b = { (char *)malloc(size), size };
+    if (!b.data)
+        throw bad_alloc();
+    blocks.push_back(b);
+
+    uintptr_t base = (uintptr_t)b.data;
+    size_t start = (size_t)(((base + align - 1) & ~(uintptr_t)(align - 1)) - base);
+    current = blocks.size() - 1;
+    used = start + bytes;
+    return b.data + start;
+}
+
+frameArena::mark frameArena::position() const {
+    mark m = { current, used };
+    return m;
+}
+
+void frameArena::rewind(mark m){
+    current = m.block;
+    used = m.used;
+}
+
+size_t frameArena::reservedBytes() const {
+    size_t total = 0;
+    for (const block &b : blocks)
+        total += b.size;
+    return total;
+}
+
+frameArena &threadArena(){
+    static thread_local frameArena arena;
+    return arena;
+}
@@ -0,0 +1,88 @@
+
+#pragma once
+#include <vector>
+#include <cstddef>
+
+using namespace std;
+
+/*
+    monotonic allocator for the scratch data of a frame (ray queues, hit buffers, sort keys)
+    allocating is a pointer bump and nothing is freed on its own, everything allocated
+    after a mark goes at once when the arena is rewound to it
+    the blocks are kept when it is rewound, so after the first frame a frame of the same
+    size allocates nothing from the heap
+    not thread-safe, every thread has its own (threadArena)
+*/
+class frameArena{
+public:
+    struct mark{
+        size_t block, used;
+    };
+
+    explicit frameArena(size_t blockSize = 1 << 20);
+    ~frameArena();
+
+    void *allocate(size_t bytes, size_t align);
+
+    mark position() const;
+    void rewind(mark m);
+
+    //heap memory held, used or not
+    size_t reservedBytes() const;
+
+private:
+    frameArena(const frameArena &);
+    frameArena &operator=(const frameArena &);
+
+    struct block{
+        char *data;
+        size_t size;
+    };
+
+    vector<block> blocks;
+    size_t current, used;       //block being bumped through and how far into it
+    size_t blockSize;
+};
+
+//the calling thread's arena
+frameArena &threadArena();
+
+//rewinds an arena to where it was when the scope was entered
+class arenaScope{
+public:
+    explicit arenaScope(frameArena &arena = threadArena()):arena(arena),start(arena.position()){}
+    ~arenaScope(){ arena.rewind(start); }
+
+private:
+    arenaScope(const arenaScope &);
+    arenaScope &operator=(const arenaScope &);
+
+    frameArena &arena;
+    frameArena::mark start;
+};
+
+/*
+    standard allocator drawing from an arena (by default the thread's), freeing is left to the
+    arena being rewound
+    containers using it must be done with before the arenaScope they were filled in ends,
+    and grow only inside it
+*/
+template <class T>
+struct arenaAllocator{
+    typedef T value_type;
+
+    arenaAllocator():arena(&threadArena()){}
+    explicit arenaAllocator(frameArena &arena):arena(&arena){}
+    template <class U> arenaAllocator(const arenaAllocator<U> &other):arena(other.arena){}
+
+    T *allocate(size_t n){ return (T *)arena->allocate(n * sizeof(T), alignof(T)); }
+    void deallocate(T *, size_t){}
+
+    template <class U> bool operator==(const arenaAllocator<U> &other) const { return arena == other.arena; }
+    template <class U> bool operator!=(const arenaAllocator<U> &other) const { return arena != other.arena; }
+
+    frameArena *arena;
+};
+
+template <class T>
+using arenaVector = vector<T, arenaAllocator<T> >;
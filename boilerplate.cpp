@@ -22,20 +22,31 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <sys/stat.h>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include "imagebuffer.h"
 #include "parser.h"
+#include "raytracer.h"
+#include "geometrypages.h"
+#include "bvh.h"
+#include "resultcache.h"
+#include "renderer.h"
+#include "regression.h"
+#include "texturecache.h"
+#include "microbench.h"
+#include "uploadtest.h"
 
 #include <math.h>
 
-#define PI 3.14
 using namespace std;
 using namespace glm;
-// --------------------
-const vec3 origin = vec3(0,0,0);
-const float delimitor = 9999.f;
 
 
 // --------------------------------------------------------------------------
@@ -191,240 +202,234 @@ void RenderScene(Geometry *geometry, GLuint program)
 }
 
 
-vector<vec3> generateRay(float viewAngle, float displaySizeX, float displaySizeY){
-	
-	vector<vec3> rays;
-	
-	viewAngle *= (PI/180.f);
-
-	//finding the z value and setting up the base vector 
-	float z = displaySizeX/(2* tan(viewAngle/2));
-	vec3 tl = vec3 ((-displaySizeX/2)+0.5f, 
-					(-displaySizeY/2)+0.5f,
-					-z
-				);
-
-
-	//calculate for the rays the goes through each pixel
-	for (int i = 0; i < displaySizeX;i++){
-		for (int j = 0; j< displaySizeY; j++){
-			vec3 rayDirection =  tl + vec3(i,j,0);
-			rayDirection = normalize(rayDirection);
-			rays.push_back(rayDirection);
-		}
-	}
-
-
-	return rays;
-}
-
-/*
-triangle contains a, b, and c where u = b-a and v = c-a 
-returns r,s,t value for 
-		a + ru + sv = p + dt
-in that order 
-*/
-vec3 intersectTriangle(vec3 d, vec3 p, triangle t){
-	vec3 u = t.b-t.a;
-	vec3 v = t.c-t.a;
-	
-    mat3 duv = mat3(d, -u, -v);
-    duv = inverse(duv);
-
-    vec3 ap = t.a - p;
+// --------------------------------------------------------------------------
+// Live editing support
 
-    return duv*ap;  
+// returns when a file was last written, or 0 if it can't be found
+time_t ModificationTime(const char *filename)
+{
+	struct stat info;
+	if (stat(filename, &info) != 0)
+		return 0;
+	return info.st_mtime;
 }
 
-float intersectSphere(vec3 direction, vec3 center, vec3 oPoint, float radius){
-	
-	float a = dot(direction, direction);
-	float b = 2* dot(oPoint - center, direction);
-	float c = dot (oPoint - center, oPoint - center);
-	c -= pow(radius,2);
-
-	if (pow(b,2) - (4*a*c) < 0 || a == 0)
-		return delimitor;
-
-	float t = (-b - sqrt(pow(b,2) - (4*a*c))) / (2*a);
+// re-renders after an edit on this thread (--recursive keeps no paths to update),
+// and makes the edited scene the current one
+void UpdateRender(ImageBuffer &iBuff, parser &scene, const parser &edited, const vector<vec3> &rays,
+	int width, int height)
+{
+	auto start = chrono::steady_clock::now();
+	generateScene(iBuff, edited, rays, width, height, false);
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	cout << "Scene edited: rendered again in " << ms << " ms" << endl;
 
-	return t;
+	scene = edited;
 }
 
-float intersectPlane(vec3 d, vec3 q, vec3 oPoint, vec3 n){
-	
-	//if (dot(d,n) > 0)
-	//	return delimitor;
-
-	float t = dot(q-oPoint, n);
-	t /= dot(d,n);
-
-	return t;
-
+// shows the render stored under key if the result cache has one, with the paths later
+// edits are re-rendered from, and makes it the current cache
+bool ShowCachedRender(ImageBuffer &iBuff, resultCache *results, uint64_t key, renderCache &cache)
+{
+	if (!results)
+		return false;
+	auto start = chrono::steady_clock::now();
+	shared_ptr<const renderCache> cached = results->find(key);
+	if (!cached || cached->pathStart.empty())
+		return false;
+	cache = *cached;
+	writeTiles(iBuff, cache.colours, cache.width, cache.height);
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	cout << "Render found in the result cache in " << ms << " ms" << endl;
+	return true;
 }
 
+// --------------------------------------------------------------------------
+// Rendering in the background
 
-bool shadow(vec3 dt, parser p){
-	lightSource light = p.lightSources[0];
-	float t = delimitor;
-	float x = light.pos.x - dt.x, y = light.pos.y - dt.y, z = light.pos.z - dt.z;
-	float maxT = sqrt(pow(x,2)+pow(y,2)+pow(z,2));
+// a band of columns as the renderer hands it over
+struct finishedBand
+{
+	int x0;
+	int sample;		// samples of the band shown before this one, which it is added to
+	vector<vec3> colours;
+};
 
-	
-	vec3 ray = normalize(light.pos - dt);
-
-	for (triangle tri : p.triangles){	
-		vec3 v = intersectTriangle(ray, dt ,tri);
-		if (v[0] < t && v[0] > 0 && v[1] >= 0 && v[2] >= 0 && (v[1]+v[2] <= 1)){
-			t = v[0];
-			if(t < maxT)
-				return true;
-		}
-				
-	}
+// the columns of a render that are traced but not shown yet, added to by the
+// renderer's workers and taken by the main loop
+struct finishedColumns
+{
+	mutex lock;
+	vector<finishedBand> bands;
+	int columnsDone = 0;		// counted once for every sample pass
+	int columnsTotal = 0;
+};
 
-	for (sphere sph : p.spheres){
-		float f = intersectSphere(ray, sph.center, dt, sph.radius);
-		if (f < t && f > 0){
-			t = f;
-			if(t < maxT)
-				return true;
-		}
-			
-	}
+// a render going on while the main loop carries on, shown as its columns come in,
+// or an update after an edit, shown once it is done
+struct backgroundRender
+{
+	bool running = false;
+	renderTicket ticket;
+	shared_ptr<finishedColumns> finished;
+	chrono::steady_clock::time_point start;
 
-	for (plane pln : p.planes){
-		float f = intersectPlane(ray, pln.q, dt, pln.n);
-		if (f < t && f > 0){
-			t = f;
-			if(t < maxT)
-				return true;
-		}	
-	}
+	// for an update, the scene the render in the cache (which it starts from) was made of
+	shared_ptr<const parser> from;
+};
 
-	return false;
+// stops the render, waiting only for the columns being traced right now
+void CancelRender(backgroundRender &render)
+{
+	if (!render.running)
+		return;
+	render.ticket.cancel();
+	render.ticket.get();
+	render.running = false;
 }
 
+// starts rendering scene in the background in place of whatever was being rendered,
+// keeping the paths so edits can be re-rendered incrementally once it is done
+void StartRender(Renderer &renderer, backgroundRender &render, const parser &scene, renderCamera camera,
+	int width, int height)
+{
+	CancelRender(render);
+
+	// a render that was cancelled may still hand over a last band, but only to its own list
+	shared_ptr<finishedColumns> finished = make_shared<finishedColumns>();
+	renderOptions options;
+	options.keepPaths = true;
+	finished->columnsTotal = width * (camera.lens.pinhole() ? 1 : samplePasses(camera.lens));
+	options.onBand = [finished](int x0, int x1, int sample, const vector<vec3> &colours)
+	{
+		finishedBand band = { x0, sample, colours };
+		lock_guard<mutex> guard(finished->lock);
+		finished->bands.push_back(move(band));
+		finished->columnsDone += x1 - x0;
+	};
+
+	render.running = true;
+	render.finished = finished;
+	render.start = chrono::steady_clock::now();
+	render.from.reset();
+	render.ticket = renderer.Submit(make_shared<parser>(scene), camera, width, height, options);
+}
 
+// starts bringing cache, a finished render of from, up to date with scene on the renderer's
+// workers in place of whatever was being rendered; what is shown stays as it is until it is done
+void StartUpdate(Renderer &renderer, backgroundRender &render, shared_ptr<const parser> from, const parser &scene,
+	const renderCache &cache, renderCamera camera, uint64_t sceneHash)
+{
+	CancelRender(render);
+
+	// only counted, a half done update would show a mix of the old and the new scene
+	shared_ptr<finishedColumns> finished = make_shared<finishedColumns>();
+	finished->columnsTotal = cache.width;
+	renderOptions options;
+	options.keepPaths = true;
+	options.sceneHash = sceneHash;
+	options.onBand = [finished](int x0, int x1, int, const vector<vec3> &)
+	{
+		lock_guard<mutex> guard(finished->lock);
+		finished->columnsDone += x1 - x0;
+	};
+
+	render.running = true;
+	render.finished = finished;
+	render.start = chrono::steady_clock::now();
+	render.from = from;
+	render.ticket = renderer.SubmitUpdate(from, make_shared<parser>(scene), make_shared<renderCache>(cache), camera,
+		options);
+}
 
- /*
-	check in a ray intersects with anything in the scene
-	return the color at the intersection
-	if there is no intersection, default to black 
- */
-vec3  intersect(vec3 ray, parser p, vec3 oPoint){
-
-	float t = delimitor;
-	vec3 resultColor = vec3(0,0,0);
-	lightSource light = p.lightSources[0];
-
-	for (triangle tri : p.triangles){
-		vec3 v = intersectTriangle(ray, oPoint ,tri);
-		if (v[0] < t && v[0] > 0 && v[1] >= 0 && v[2] >= 0 && (v[1]+v[2] <= 1)){
-			
-			t = v[0];
-
-			vec3 l = normalize(light.pos - (ray*t));
-			vec3 h = -ray + l ;
-			h = h/ ((float)h.length());
-			h = normalize(h);
-			vec3 normal = normalize(cross(tri.b-tri.a, tri.c-tri.a));
-
-			float max = dot(normal, l);
-			if (max < 0)
-				max = 0;
-
+// shows the columns the render has finished since the last call, without waiting for any,
+// adding each sample pass after the first to what is shown so the picture refines as they come,
+// and once all are done makes the render (with its paths) the current cache
+// returns the share of the columns done, 1 when there is no render going on
+float PollRender(ImageBuffer &iBuff, backgroundRender &render, renderCache &cache, int width, int height)
+{
+	if (!render.running)
+		return 1.f;
 
-			if(!shadow(ray*t + (normal * 0.0001f), p))
-				resultColor = (tri.Cr * (light.Ca + (light.Cl*  max ))) 
-							+ (light.Cl * tri.Cp * pow(dot(h, normal),tri.phong));
-			else
-				resultColor = tri.Cr * light.Ca;
-			
-		}
-			
+	vector<finishedBand> bands;
+	int columnsDone, columnsTotal;
+	{
+		lock_guard<mutex> guard(render.finished->lock);
+		bands.swap(render.finished->bands);
+		columnsDone = render.finished->columnsDone;
+		columnsTotal = render.finished->columnsTotal;
 	}
+	for (const finishedBand &band : bands)
+		writeColumns(iBuff, band.colours, band.x0, band.x0 + (int)band.colours.size() / height, height,
+			band.sample > 0);
 
-	for (sphere sph : p.spheres){
-		float f = intersectSphere(ray, sph.center, oPoint, sph.radius);
-		if (f < t && f > 0){
-			t = f; 
-
-			vec3 l = normalize(light.pos - (ray*t));
-			vec3 h = -ray + l ;
-			h = h/ ((float)h.length());
-			h = normalize(h);
-			vec3 normal = normalize(  (ray*t) - sph.center);
-			
-			float max = dot(normal, l);
-			if (max < 0)
-				max = 0;
-
-
-			//reflection
-			vec3 reflectedRay = ray - (2*(dot(ray, normal))*normal);
-
-			//angle between d and l / 2 = angle between n and l 
-			//vec3 temp = d*l / 2.f;
-			//printf("sph: (%f,%f,%f) || (%f, %f, %f) \n", sph.Cr.x, sph.Cr.y, sph.Cr.y, sph.Cp.x, sph.Cp.y, sph.Cp.z);
-			if(!shadow(ray*t + (normal * 0.0001f), p))
-				resultColor = (sph.Cr * (light.Ca + (light.Cl*  max ))) 
-							+ (light.Cl * sph.Cp * pow(dot(h, normal),sph.phong));
-			else 
-				resultColor = sph.Cr * light.Ca;
-			
-			resultColor *= intersect(reflectedRay, p, ray*t +(normal * 0.0001f));
-		}	
-	}
+	if (render.ticket.future().wait_for(chrono::seconds(0)) != future_status::ready)
+		return (float)columnsDone / columnsTotal;
 
-	for (plane pln : p.planes){
-		float f = intersectPlane(ray, pln.q, oPoint, pln.n);
-		if (f < t && f > 0){
-			t = f;
-
-			vec3 l = normalize(light.pos - (ray*t));
-			vec3 h = -ray + l ;
-			h = h/ ((float)h.length());
-			h = normalize(h);
-			vec3 normal = normalize(pln.n);
-			
-			float max = dot(normal, l);
-			if (max < 0)
-				max = 0;
-
-			if(!shadow(ray*t +(normal * 0.0001f), p))
-				resultColor = (pln.Cr * (light.Ca + (light.Cl*  max ))) 
-							+ (light.Cl * pln.Cp * pow(dot(h, normal),pln.phong));
-			else
-				resultColor = pln.Cr*light.Ca;
-			
-		
-		}
+	render.running = false;
+	const renderResult &result = render.ticket.get();
+	if (result.status != RENDER_DONE)
+	{
+		cout << "Render failed" << endl;
+		return 1.f;
 	}
-
-
-	return resultColor;
-
+	cache = *result.image;
+	if (result.cached || render.from)
+		writeTiles(iBuff, cache.colours, width, height);
+	double renderNs = chrono::duration<double, nano>(chrono::steady_clock::now() - render.start).count();
+	if (render.from && !result.cached)
+	{
+		render.from.reset();
+		cout << "Scene edited: retraced " << result.retraced << " and reshaded " << result.reshaded
+			<< " pixels in " << renderNs / 1e6 << " ms" << endl;
+		return 1.f;
+	}
+	render.from.reset();
+	cout << (result.cached ? "Render found in the result cache in " : "Rendered in ") << renderNs / 1e6
+		<< " ms (" << renderNs / (width * height) << " ns/pixel)" << endl;
+	return 1.f;
 }
 
+// moves a scene's triangles out to a page file next to the scene and maps them back in
+// from there, keeping no more than budget bytes of them in memory
+bool PageTriangles(parser &scene, geometryPages &pages, const string &filename, size_t budget)
+{
+	if (!geometryPages::build(scene.triangles, filename.c_str()) || !pages.open(filename.c_str(), budget))
+		return false;
+	scene.triangles.clear();
+	scene.bvh.reset();
+	scene.trianglePages = &pages;
+	return true;
+}
 
-
-
-
-
-void generateScene(ImageBuffer &iBuff, parser p, vector<vec3> rays,  int wnd_width, int wnd_height){
-
-	int index = 0;
-	for (int w = 0; w < wnd_width; w++){
-		for(int h = 0; h < wnd_height; h++){
-			//vec3 v = vec3(1,1,1)*(float)(h/(512.f));
-			iBuff.SetPixel(w,h, intersect(rays[index], p, origin));
-			index++;
-		}
+// builds each acceleration structure layout over the scene's triangles and times
+// the visibility pass of the primary rays with it
+void ReportBVH(parser scene, const vector<vec3> &rays)
+{
+	struct { const char *name; bvhLayout layout; bool quantizedVertices; } layouts[] = {
+		{ "binary", BVH_BINARY, false },
+		{ "binary16", BVH_BINARY, true },
+		{ "wide", BVH_WIDE, false },
+		{ "wide16", BVH_WIDE, true },
+	};
+
+	int numTriangles = std::max((int)scene.triangles.size(), 1);
+	for (const auto &l : layouts)
+	{
+		buildBVH(scene, l.layout, l.quantizedVertices);
+		size_t nodeBytes = scene.bvh ? scene.bvh->nodeBytes() : 0;
+		size_t vertexBytes = scene.bvh ? scene.bvh->vertexBytes() : 0;
+
+		auto start = chrono::steady_clock::now();
+		int hits = 0;
+		for (const vec3 &ray : rays)
+			hits += closestHit(ray, scene, origin).type != HIT_NONE;
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		cout << "bvh " << l.name << ": " << (double)nodeBytes / numTriangles << " node bytes/triangle, "
+			<< (double)vertexBytes / numTriangles << " vertex bytes/triangle, "
+			<< rays.size() / seconds / 1e6 << " Mrays/s (" << hits << " hits)" << endl;
 	}
-
-	
-
 }
 
 // --------------------------------------------------------------------------
@@ -437,11 +442,20 @@ void ErrorCallback(int error, const char* description)
 	cout << description << endl;
 }
 
-// handles keyboard input events
+// handles keyboard input events, + and - zoom the camera (whose field of view is the
+// window's user pointer) in and out
 void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
 	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, GL_TRUE);
+
+	float *viewAngle = (float *)glfwGetWindowUserPointer(window);
+	if (!viewAngle || action == GLFW_RELEASE)
+		return;
+	if (key == GLFW_KEY_EQUAL || key == GLFW_KEY_KP_ADD)
+		*viewAngle = std::max(*viewAngle - 5.f, 5.f);
+	else if (key == GLFW_KEY_MINUS || key == GLFW_KEY_KP_SUBTRACT)
+		*viewAngle = std::min(*viewAngle + 5.f, 150.f);
 }
 
 // ==========================================================================
@@ -449,6 +463,38 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 
 int main(int argc, char *argv[])
 {
+	//--regress <corpus> renders and checks the scenes listed in it without a window and exits with
+	//the number that failed (regression/corpus.txt is the one kept with the sources, its golden images
+	//are at the default size), --update-golden writes their golden images instead,
+	//--regress-size <pixels> and --regress-threads <n> set the image size (256) and threads (1),
+	//--microbench <file.json> times the intersection and shading kernels on their own and writes the
+	//results there as JSON ("-" prints them instead),
+	//--test-upload checks the image upload on a hidden window and exits with 1 if any pixel came out
+	//wrong (LIBGL_ALWAYS_SOFTWARE=1 xvfb-run runs it on Mesa's llvmpipe where there is no GPU)
+	string corpus, microbenchFile;
+	bool updateGolden = false, testUpload = false;
+	int regressSize = 256, regressThreads = 1;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--regress" && i + 1 < argc)
+			corpus = argv[++i];
+		else if (arg == "--update-golden")
+			updateGolden = true;
+		else if (arg == "--regress-size" && i + 1 < argc)
+			regressSize = max(1, atoi(argv[++i]));
+		else if (arg == "--regress-threads" && i + 1 < argc)
+			regressThreads = max(1, atoi(argv[++i]));
+		else if (arg == "--microbench" && i + 1 < argc)
+			microbenchFile = argv[++i];
+		else if (arg == "--test-upload")
+			testUpload = true;
+	}
+	if (!microbenchFile.empty())
+		return runMicrobenchmarks(microbenchFile);
+	if (!corpus.empty())
+		return min(runRegression(corpus, regressSize, regressSize, regressThreads, 3, updateGolden), 125);
+
 	// initialize the GLFW windowing system
 	if (!glfwInit()) {
 		cout << "ERROR: GLFW failed to initialize, TERMINATING" << endl;
@@ -462,6 +508,8 @@ int main(int argc, char *argv[])
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	if (testUpload)
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
 	int width = 512, height = 512;
 	window = glfwCreateWindow(width, height, "CPSC 453 OpenGL Boilerplate", 0, 0);
 	if (!window) {
@@ -484,6 +532,15 @@ int main(int argc, char *argv[])
 	// query and print out information about our OpenGL environment
 	QueryGLVersion();
 
+	// an odd size, so the edge tiles hang over the image
+	if (testUpload)
+	{
+		int failed = runUploadTest(253, 131);
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return failed ? 1 : 0;
+	}
+
 	// call function to load and compile shader programs
 	GLuint program = InitializeShaders();
 	if (program == 0) {
@@ -503,11 +560,99 @@ int main(int argc, char *argv[])
 */
 
 
-	vector <vec3> rays = generateRay(55.f, 512.f, 512.f); 
+	//pass --recursive to trace reflections depth first instead of a bounce at a time, for comparison
+	//and --page-budget <MB> to keep the triangles out of core, paged in under that budget
+	//--bvh <binary|binary16> picks the triangle acceleration structure layout, --bvh-report times them
+	//and the wide ones on the scene first, --self-hits counts secondary rays hitting where they start
+	//(--regress checks every corpus scene for them),
+	//--kernel-report compares the kernels specialized for what the scene holds with the generic one,
+	//--result-cache <dir> keeps finished renders there (and in memory) so repeats aren't traced again,
+	//--scaling-report times the threaded renderer from one cpu up to all of them, pinned and not,
+	//--tonemap <clamp|reinhard|filmic> and --exposure <stops> set how colours brighter than white are shown,
+	//--shadow-samples <n> is the most shadow rays a point lit by an area light gets,
+	//--aperture <radius>, --focus <distance>, --shutter <time> and --samples <n> render through a thin
+	//lens, with motion blur and that many samples per pixel (not with --recursive),
+	//--texture-budget <MB> is how much texture stays in memory (the rest is read from its mip files as needed),
+	//--sort-bounces sorts each bounce's rays by where they leave from and which way before tracing them
+	bool wavefront = true, bvhReport = false, selfHits = false, kernels = false, scaling = false, sortBounces = false;
+	string bvhName = "binary", resultDirectory, toneMapName = "clamp";
+	double pageBudget = 0, exposure = 0, textureBudget = 256;
+	int shadowSamples = 0;
+	lensCamera lens;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--recursive")
+			wavefront = false;
+		else if (arg == "--page-budget" && i + 1 < argc)
+			pageBudget = atof(argv[++i]);
+		else if (arg == "--bvh" && i + 1 < argc)
+			bvhName = argv[++i];
+		else if (arg == "--bvh-report")
+			bvhReport = true;
+		else if (arg == "--self-hits")
+			selfHits = true;
+		else if (arg == "--kernel-report")
+			kernels = true;
+		else if (arg == "--result-cache" && i + 1 < argc)
+			resultDirectory = argv[++i];
+		else if (arg == "--scaling-report")
+			scaling = true;
+		else if (arg == "--tonemap" && i + 1 < argc)
+			toneMapName = argv[++i];
+		else if (arg == "--exposure" && i + 1 < argc)
+			exposure = atof(argv[++i]);
+		else if (arg == "--shadow-samples" && i + 1 < argc)
+			shadowSamples = atoi(argv[++i]);
+		else if (arg == "--aperture" && i + 1 < argc)
+			lens.aperture = (float)atof(argv[++i]);
+		else if (arg == "--focus" && i + 1 < argc)
+			lens.focusDistance = (float)atof(argv[++i]);
+		else if (arg == "--shutter" && i + 1 < argc)
+			lens.shutter = (float)atof(argv[++i]);
+		else if (arg == "--samples" && i + 1 < argc)
+			lens.samples = atoi(argv[++i]);
+		else if (arg == "--texture-budget" && i + 1 < argc)
+			textureBudget = atof(argv[++i]);
+		else if (arg == "--sort-bounces")
+			sortBounces = true;
+	}
+
+	float viewAngle = 55.f;
+	vector <vec3> rays = generateRay(viewAngle, 512.f, 512.f); 
 	ImageBuffer iBuff1; 
 	iBuff1.Initialize();	
+	iBuff1.SetToneMapping(toneMapName == "reinhard" ? ImageBuffer::TONEMAP_REINHARD
+						  : toneMapName == "filmic" ? ImageBuffer::TONEMAP_FILMIC : ImageBuffer::TONEMAP_CLAMP,
+						  (float)exposure);
+	const char *sceneFile = "scenes/scene1.txt";
 	parser scene1;
-	scene1.extractShapes("scenes/scene1.txt");
+	scene1.extractShapes(sceneFile);
+	if (shadowSamples > 0)
+		scene1.shadowSamples = shadowSamples;
+	scene1.sortBounces = sortBounces;
+	scene1.compile();
+	scene1.printStats();
+	textureCache textures((size_t)(std::max(textureBudget, 1.0) * 1024 * 1024));
+	scene1.pixelAngle = texturePixelAngle(viewAngle, width);
+	attachTextures(scene1, textures);
+	//compile already builds the default layout, only the quantized one needs building again
+	bool quantizedVertices = bvhName == "binary16";
+	if (bvhReport)
+		ReportBVH(scene1, rays);
+	if (selfHits)
+		selfHitReport(scene1, rays);
+	if (kernels)
+		kernelReport(scene1, rays);
+	if (quantizedVertices)
+		buildBVH(scene1, BVH_BINARY, true);
+	if (scaling)
+		scalingReport(make_shared<parser>(scene1), 512, 512);
+
+	string pageFile = string(sceneFile).substr(0, string(sceneFile).rfind('.')) + ".pages";
+	geometryPages pages;
+	bool paged = pageBudget > 0
+		&& PageTriangles(scene1, pages, pageFile, (size_t)(pageBudget * 1024 * 1024));
 	
 	/*
 	int index = 0;
@@ -522,14 +667,125 @@ int main(int argc, char *argv[])
 	}
 	*/
 
-	generateScene(iBuff1, scene1, rays,  width, height);
+	//only the wavefront path keeps the hits that cached renders are stored with
+	unique_ptr<resultCache> results;
+	if (!resultDirectory.empty() && wavefront)
+		results.reset(new resultCache(256 << 20, resultDirectory, (size_t)1 << 30));
+
+	//the wavefront path renders on worker threads, leaving this one to keep the window responsive,
+	//and keeps every pixel's hits so edits can be re-rendered incrementally
+	//--recursive renders here, holding up the window, for comparison
+	Renderer renderer(std::max(1, (int)thread::hardware_concurrency() - 1), results.get());
+	backgroundRender render;
+	renderCache cache;
+	uint64_t key = results ? renderKey(sceneHash(scene1), viewAngle, width, height, lens) : 0;
+	if (!ShowCachedRender(iBuff1, results.get(), key, cache))
+	{
+		if (wavefront)
+			StartRender(renderer, render, scene1, renderCamera(viewAngle, lens), width, height);
+		else
+		{
+			auto renderStart = chrono::steady_clock::now();
+			generateScene(iBuff1, scene1, rays,  width, height, false);
+			double renderNs = chrono::duration<double, nano>(chrono::steady_clock::now() - renderStart).count();
+			cout << "Rendered in " << renderNs / 1e6 << " ms ("
+				<< renderNs / (width * height) << " ns/pixel)" << endl;
+		}
+	}
 	//iBuff1 = generateScene(iBuff1, scene1, rays, width, height);
 	
 
 
+	time_t sceneTime = ModificationTime(sceneFile);
+	float renderedAngle = viewAngle;
+	glfwSetWindowUserPointer(window, &viewAngle);
+	bool reportPages = paged;
+	int shownPercent = -1;
+
 	// run an event-triggered main loop
 	while (!glfwWindowShouldClose(window))
 	{
+		// live edit: whenever the scene file is saved, bring the image up to date
+		time_t modified = ModificationTime(sceneFile);
+		if (modified != sceneTime)
+		{
+			sceneTime = modified;
+			parser edited;
+			edited.extractShapes(sceneFile);
+			if (shadowSamples > 0)
+				edited.shadowSamples = shadowSamples;
+			edited.sortBounces = sortBounces;
+			edited.compile();
+			edited.pixelAngle = texturePixelAngle(viewAngle, width);
+			attachTextures(edited, textures);
+			if (quantizedVertices)
+				buildBVH(edited, BVH_BINARY, true);
+			//most likely saved half way through, keep showing the last good version
+			if (edited.stats.addedLight)
+				cout << "Scene has no light, ignoring edit" << endl;
+			else
+			{
+				//the pages are rewritten, and an unfinished render has no paths to update anyway
+				bool updating = render.running && render.from;
+				bool unfinished = render.running && !render.from;
+				CancelRender(render);
+				if (paged)
+					PageTriangles(edited, pages, pageFile, (size_t)(pageBudget * 1024 * 1024));
+				uint64_t hash = results ? sceneHash(edited) : 0;
+				key = results ? renderKey(hash, viewAngle, width, height, lens) : 0;
+				if (ShowCachedRender(iBuff1, results.get(), key, cache))
+					scene1 = edited;
+				else if (wavefront && (unfinished || cache.pathStart.empty()))
+				{
+					scene1 = edited;
+					StartRender(renderer, render, scene1, renderCamera(viewAngle, lens), width, height);
+				}
+				else if (wavefront)
+				{
+					//an unfinished update leaves the render it started from in the cache, so this
+					//one starts from there too
+					shared_ptr<const parser> from = updating ? render.from : make_shared<parser>(move(scene1));
+					scene1 = edited;
+					StartUpdate(renderer, render, from, scene1, cache, renderCamera(viewAngle, lens), hash);
+				}
+				else
+					UpdateRender(iBuff1, scene1, edited, rays, width, height);
+			}
+		}
+
+		// zooming throws away whatever was rendered from the old camera and starts again
+		if (viewAngle != renderedAngle)
+		{
+			renderedAngle = viewAngle;
+			rays = generateRay(viewAngle, (float)width, (float)height);
+			scene1.pixelAngle = texturePixelAngle(viewAngle, width);
+			cache = renderCache();
+			key = results ? renderKey(sceneHash(scene1), viewAngle, width, height, lens) : 0;
+			if (ShowCachedRender(iBuff1, results.get(), key, cache))
+				CancelRender(render);
+			else if (wavefront)
+				StartRender(renderer, render, scene1, renderCamera(viewAngle, lens), width, height);
+			else
+				generateScene(iBuff1, scene1, rays, width, height, false);
+		}
+
+		// show whatever the workers have finished since the last frame, and how far along they are
+		int percent = (int)(100 * PollRender(iBuff1, render, cache, width, height));
+		if (percent != shownPercent)
+		{
+			shownPercent = percent;
+			string title = "CPSC 453 OpenGL Boilerplate";
+			if (percent < 100)
+				title += " - rendering " + to_string(percent) + "%";
+			glfwSetWindowTitle(window, title.c_str());
+		}
+		if (reportPages && !render.running)
+		{
+			reportPages = false;
+			cout << pages.triangleCount() << " triangles in " << pages.pageCount() << " pages: "
+				<< pages.pageLoads() << " page loads, " << pages.residentBytes() / 1024 << " KB resident" << endl;
+		}
+
 		// call function to draw our scene
 		iBuff1.Render();
 		
@@ -541,6 +797,7 @@ int main(int argc, char *argv[])
 	}
 
 	// clean up allocated resources before exit
+	CancelRender(render);
 	//DestroyGeometry(&geometry);
 	glUseProgram(0);
 	glDeleteProgram(program);
@@ -0,0 +1,60 @@
+
+#pragma once
+#include <algorithm>
+#include <glm/glm.hpp>
+
+using namespace glm;
+
+//axis aligned bounding box, starts out empty so the first grow sets it
+struct bounds{
+    bounds():lo(vec3(1e30f)),hi(vec3(-1e30f)){}
+    vec3 lo, hi;
+
+    void grow(vec3 p){ lo = min(lo, p); hi = max(hi, p); }
+    void grow(const bounds &b){ lo = min(lo, b.lo); hi = max(hi, b.hi); }
+    bool empty() const { return lo.x > hi.x; }
+    float area() const { vec3 d = hi - lo; return empty() ? 0.f : 2.f * (d.x*d.y + d.y*d.z + d.z*d.x); }
+};
+
+/*
+    slab test: the distance along the ray at which it enters the box,
+    or -1 if it misses it (a ray starting inside enters at 0)
+    invRay is 1 / the ray direction, so it can be worked out once per ray
+*/
+inline float slabEntry(const bounds &b, vec3 invRay, vec3 oPoint, float maxT){
+    float tNear = 0, tFar = maxT;
+    for (int axis = 0; axis < 3; axis++){
+        float inv = invRay[axis];
+        float t0 = (b.lo[axis] - oPoint[axis]) * inv;
+        float t1 = (b.hi[axis] - oPoint[axis]) * inv;
+        if (t0 > t1)
+            std::swap(t0, t1);
+        tNear = std::max(tNear, t0);
+        tFar = std::min(tFar, t1);
+        if (tNear > tFar)
+            return -1;
+    }
+    return tNear;
+}
+
+inline float boxEntry(const bounds &b, vec3 ray, vec3 oPoint, float maxT){
+    return slabEntry(b, vec3(1.f / ray.x, 1.f / ray.y, 1.f / ray.z), oPoint, maxT);
+}
+
+//spreads the low 10 bits of v out so there are two zero bits between each of them
+inline unsigned int expandBits(unsigned int v){
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+//30 bit morton code of a point on a 1024^3 grid spanning the box
+inline unsigned int mortonCode(vec3 p, const bounds &b){
+    vec3 extent = max(b.hi - b.lo, vec3(1e-6f));
+    vec3 cell = clamp((p - b.lo) / extent * 1023.f, 0.f, 1023.f);
+    return (expandBits((unsigned int)cell.x) << 2)
+         | (expandBits((unsigned int)cell.y) << 1)
+         |  expandBits((unsigned int)cell.z);
+}
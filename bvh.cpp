@@ -0,0 +1,455 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "bvh.h"
+#include "raytracer.h"
+
+using namespace std;
+
+//past this depth splits stop looking for the best plane and just halve, bounding the depth
+static const int maxSahDepth = 32;
+
+static const int sahBins = 16;
+
+const int triangleBVH::maxLeafSize;
+const int triangleBVH::stackSize;
+
+//2^e, built from its bits rather than by ldexp, for the exponents (well inside the normal range) wide nodes use
+static inline float powerOfTwo(int e){
+    uint32_t bits = (uint32_t)(e + 127) << 23;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+//a triangle's box padded so rounding in the slab test can't cull a triangle lying on its face
+static bounds padded(bounds b){
+    vec3 pad = (b.hi - b.lo) * 1e-4f + vec3(1e-5f);
+    b.lo -= pad;
+    b.hi += pad;
+    return b;
+}
+
+static bounds triangleBounds(const triangle &tri){
+    bounds b;
+    b.grow(tri.a);
+    b.grow(tri.b);
+    b.grow(tri.c);
+    return padded(b);
+}
+
+triangleBVH::triangleBVH(const vector<triangle> &triangles, bvhLayout layout, bool quantizedVertices)
+    :nodeLayout(layout){
+    int n = (int)triangles.size();
+    if (n == 0)
+        return;
+
+    vector<bounds> boxes(n);
+    vector<vec3> centroids(n);
+    order.resize(n);
+    for (int i = 0; i < n; i++){
+        boxes[i] = triangleBounds(triangles[i]);
+        centroids[i] = (triangles[i].a + triangles[i].b + triangles[i].c) / 3.f;
+        order[i] = i;
+    }
+
+    binary.reserve(2 * n);
+    buildBinary(order, boxes, centroids, 0, n, 0);
+
+    if (layout == BVH_WIDE){
+        //collapse the binary tree, the leaves get laid out again in wide order
+        vector<int> binaryOrder;
+        binaryOrder.swap(order);
+        order.reserve(n);
+        wide.push_back(wideNode());
+        buildWide(0, 0, binaryOrder);
+        vector<binaryNode>().swap(binary);
+    }
+
+    if (!quantizedVertices)
+        return;
+
+    quantized.resize(9 * order.size());
+    if (layout == BVH_WIDE){
+        for (const wideNode &node : wide)
+            for (int slot = 0; slot < 8; slot++)
+                if (!(node.innerMask & (1 << slot)) && node.meta[slot])
+                    quantizeLeaf(childBounds(node, slot), node.triangleBase + (node.meta[slot] & 31),
+                                 node.meta[slot] >> 5, triangles);
+    }
+    else {
+        for (const binaryNode &node : binary)
+            if (node.count > 0)
+                quantizeLeaf(node.box, node.first, node.count, triangles);
+    }
+}
+
+//binned surface area heuristic build, returns the index of the node covering refs[begin, end)
+int triangleBVH::buildBinary(vector<int> &refs, vector<bounds> &boxes, vector<vec3> &centroids, int begin, int end, int depth){
+    int index = (int)binary.size();
+    binary.push_back(binaryNode());
+
+    bounds box, centroidBox;
+    for (int i = begin; i < end; i++){
+        box.grow(boxes[refs[i]]);
+        centroidBox.grow(centroids[refs[i]]);
+    }
+    binary[index].box = box;
+
+    int count = end - begin;
+    if (count <= maxLeafSize){
+        binary[index].first = begin;
+        binary[index].count = count;
+        return index;
+    }
+
+    int axis = 0;
+    vec3 extent = centroidBox.hi - centroidBox.lo;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+
+    int mid = begin;
+    if (extent[axis] > 0 && depth < maxSahDepth){
+        bounds binBoxes[sahBins];
+        int binCounts[sahBins] = { 0 };
+        float binScale = sahBins / extent[axis];
+        for (int i = begin; i < end; i++){
+            int bin = std::min(sahBins - 1, (int)((centroids[refs[i]][axis] - centroidBox.lo[axis]) * binScale));
+            binBoxes[bin].grow(boxes[refs[i]]);
+            binCounts[bin]++;
+        }
+
+        //sweep from the right to get the cost of every split plane
+        float rightCost[sahBins];
+        bounds right;
+        int rightCount = 0;
+        for (int b = sahBins - 1; b > 0; b--){
+            right.grow(binBoxes[b]);
+            rightCount += binCounts[b];
+            rightCost[b] = right.area() * rightCount;
+        }
+
+        bounds left;
+        int leftCount = 0, bestSplit = -1;
+        float bestCost = 1e30f;
+        for (int b = 1; b < sahBins; b++){
+            left.grow(binBoxes[b - 1]);
+            leftCount += binCounts[b - 1];
+            float cost = left.area() * leftCount + rightCost[b];
+            if (leftCount > 0 && leftCount < count && cost < bestCost){
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        if (bestSplit > 0){
+            int *split = partition(&refs[begin], &refs[begin] + count, [&](int ref){
+                return std::min(sahBins - 1, (int)((centroids[ref][axis] - centroidBox.lo[axis]) * binScale)) < bestSplit;
+            });
+            mid = (int)(split - &refs[0]);
+        }
+    }
+
+    //nothing to split on (or too deep): halve by centroid instead
+    if (mid == begin || mid == end){
+        mid = begin + count / 2;
+        nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end, [&](int a, int b){
+            return centroids[a][axis] < centroids[b][axis];
+        });
+    }
+
+    buildBinary(refs, boxes, centroids, begin, mid, depth + 1);
+    int second = buildBinary(refs, boxes, centroids, mid, end, depth + 1);
+    binary[index].first = second;
+    binary[index].count = 0;
+    return index;
+}
+
+//fills in wide node w from binary node b, pulling up grandchildren until it has 8 children
+void triangleBVH::buildWide(int b, int w, vector<int> &binaryOrder){
+    int kids[8];
+    int numKids = 0;
+    if (binary[b].count > 0)
+        kids[numKids++] = b;
+    else {
+        kids[numKids++] = b + 1;
+        kids[numKids++] = binary[b].first;
+    }
+
+    //open up the biggest inner child each time, it is the one most worth testing separately
+    while (numKids < 8){
+        int best = -1;
+        for (int k = 0; k < numKids; k++)
+            if (binary[kids[k]].count == 0 && (best < 0 || binary[kids[k]].box.area() > binary[kids[best]].box.area()))
+                best = k;
+        if (best < 0)
+            break;
+        int opened = kids[best];
+        kids[best] = opened + 1;
+        kids[numKids++] = binary[opened].first;
+    }
+
+    wideNode node = wideNode();
+    bounds box;
+    for (int k = 0; k < numKids; k++)
+        box.grow(binary[kids[k]].box);
+    node.origin = box.lo;
+
+    //smallest power of two step that spans the node in 255 steps
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++){
+        float extent = box.hi[axis] - box.lo[axis];
+        int e = extent > 0 ? (int)ceil(log2(extent / 255.f)) : -100;
+        e = std::max(e, -100);
+        while (e < 100 && ldexp(255.f, e) + node.origin[axis] < box.hi[axis])
+            e++;
+        node.exponent[axis] = (int8_t)e;
+        scale[axis] = ldexp(1.f, e);
+    }
+
+    int numInner = 0;
+    node.triangleBase = (uint32_t)order.size();
+    for (int k = 0; k < numKids; k++){
+        const binaryNode &kid = binary[kids[k]];
+
+        //round outwards, checking the decoded values so float rounding can't shrink the box
+        for (int axis = 0; axis < 3; axis++){
+            int lo = (int)floor((kid.box.lo[axis] - node.origin[axis]) / scale[axis]);
+            int hi = (int)ceil((kid.box.hi[axis] - node.origin[axis]) / scale[axis]);
+            lo = std::max(0, std::min(255, lo));
+            hi = std::max(0, std::min(255, hi));
+            while (lo > 0 && node.origin[axis] + lo * scale[axis] > kid.box.lo[axis])
+                lo--;
+            while (hi < 255 && node.origin[axis] + hi * scale[axis] < kid.box.hi[axis])
+                hi++;
+            node.qlo[axis][k] = (uint8_t)lo;
+            node.qhi[axis][k] = (uint8_t)hi;
+        }
+
+        if (kid.count == 0){
+            node.innerMask |= (uint8_t)(1 << k);
+            numInner++;
+        }
+        else {
+            node.meta[k] = (uint8_t)((kid.count << 5) | (order.size() - node.triangleBase));
+            order.insert(order.end(), binaryOrder.begin() + kid.first, binaryOrder.begin() + kid.first + kid.count);
+        }
+    }
+
+    //inner children sit next to each other so one index finds them all
+    node.childBase = (uint32_t)wide.size();
+    wide.resize(wide.size() + numInner);
+    wide[w] = node;
+
+    int child = node.childBase;
+    for (int k = 0; k < numKids; k++)
+        if (binary[kids[k]].count == 0)
+            buildWide(kids[k], child++, binaryOrder);
+}
+
+bounds triangleBVH::childBounds(const wideNode &node, int slot) const {
+    bounds b;
+    for (int axis = 0; axis < 3; axis++){
+        float scale = powerOfTwo(node.exponent[axis]);
+        b.lo[axis] = node.origin[axis] + node.qlo[axis][slot] * scale;
+        b.hi[axis] = node.origin[axis] + node.qhi[axis][slot] * scale;
+    }
+    return b;
+}
+
+//16 bit vertices for order[first, first + count), rounded down onto a grid over the leaf box
+void triangleBVH::quantizeLeaf(const bounds &box, int first, int count, const vector<triangle> &triangles){
+    vec3 scale = 65535.f / (box.hi - box.lo);
+    for (int k = first; k < first + count; k++){
+        const triangle &tri = triangles[order[k]];
+        const vec3 *verts[3] = { &tri.a, &tri.b, &tri.c };
+        for (int v = 0; v < 3; v++){
+            vec3 q = clamp(floor((*verts[v] - box.lo) * scale), 0.f, 65535.f);
+            for (int axis = 0; axis < 3; axis++)
+                quantized[9*k + 3*v + axis] = (uint16_t)q[axis];
+        }
+    }
+}
+
+/*
+    conservative test against a quantized triangle: the box of its 16 bit vertices,
+    grown by a grid step either side to cover the rounding, has to be crossed before maxT
+    it is padded like every other triangle box too, a grid step across a flat leaf is far
+    too small to survive the slab test's rounding
+ */
+bool triangleBVH::leafRejects(vec3 ray, vec3 oPoint, float maxT, const bounds &box, int index) const {
+    const uint16_t *q = &quantized[9 * index];
+    vec3 step = (box.hi - box.lo) / 65535.f;
+    bounds tri;
+    for (int axis = 0; axis < 3; axis++){
+        uint16_t lo = std::min(q[axis], std::min(q[3 + axis], q[6 + axis]));
+        uint16_t hi = std::max(q[axis], std::max(q[3 + axis], q[6 + axis]));
+        tri.lo[axis] = box.lo[axis] + (lo - 1.f) * step[axis];
+        tri.hi[axis] = box.lo[axis] + (hi + 2.f) * step[axis];
+    }
+    return boxEntry(padded(tri), ray, oPoint, maxT) < 0;
+}
+
+/*
+    walks the leaves under node root whose boxes the ray enters before maxT, nearest first
+    visit(first, count, box) gets each leaf's range of order and returns true to stop
+    maxT is re-read as the walk goes so visit can shorten it
+ */
+template <class Visit>
+void triangleBVH::traverse(vec3 ray, vec3 oPoint, const float &maxT, int root, Visit visit) const {
+    struct entry{
+        int node;
+        int slot;   //a leaf of wide node `node`, -1 for the node itself
+        float t;
+    };
+    entry stack[stackSize];
+    int top = 0;
+    vec3 invRay = vec3(1.f / ray.x, 1.f / ray.y, 1.f / ray.z);
+
+    if (nodeLayout == BVH_BINARY){
+        if (binary.empty())
+            return;
+        float t = slabEntry(binary[root].box, invRay, oPoint, maxT);
+        if (t >= 0){
+            entry first = { root, -1, t };
+            stack[top++] = first;
+        }
+
+        while (top > 0){
+            entry e = stack[--top];
+            if (e.t > maxT)
+                continue;
+            const binaryNode &node = binary[e.node];
+            if (node.count > 0){
+                if (visit(node.first, node.count, node.box))
+                    return;
+                continue;
+            }
+
+            entry a = { e.node + 1, -1, slabEntry(binary[e.node + 1].box, invRay, oPoint, maxT) };
+            entry b = { node.first, -1, slabEntry(binary[node.first].box, invRay, oPoint, maxT) };
+            if (a.t > b.t)
+                std::swap(a, b);
+            if (b.t >= 0)
+                stack[top++] = b;
+            if (a.t >= 0)
+                stack[top++] = a;
+        }
+        return;
+    }
+
+    if (wide.empty())
+        return;
+    entry first = { root, -1, 0.f };
+    stack[top++] = first;
+
+    while (top > 0){
+        entry e = stack[--top];
+        if (e.t > maxT)
+            continue;
+        const wideNode &node = wide[e.node];
+        if (e.slot >= 0){
+            uint8_t meta = node.meta[e.slot];
+            if (visit(node.triangleBase + (meta & 31), meta >> 5, childBounds(node, e.slot)))
+                return;
+            continue;
+        }
+
+        //all 8 child boxes are decoded and slab tested together, a lane each, so the loops vectorize;
+        //it is slabEntry's arithmetic, so a box is entered exactly where slabEntry says
+        float tNear[8], tFar[8];
+        for (int slot = 0; slot < 8; slot++){
+            tNear[slot] = 0;
+            tFar[slot] = maxT;
+        }
+        for (int axis = 0; axis < 3; axis++){
+            float scale = powerOfTwo(node.exponent[axis]), lo = node.origin[axis];
+            float from = oPoint[axis], inv = invRay[axis];
+            for (int slot = 0; slot < 8; slot++){
+                float t0 = (lo + node.qlo[axis][slot] * scale - from) * inv;
+                float t1 = (lo + node.qhi[axis][slot] * scale - from) * inv;
+                float near = t0 > t1 ? t1 : t0, far = t0 > t1 ? t0 : t1;
+                tNear[slot] = tNear[slot] < near ? near : tNear[slot];
+                tFar[slot] = far < tFar[slot] ? far : tFar[slot];
+            }
+        }
+
+        //push the children the ray enters far to near so the nearest comes off first
+        entry hits[8];
+        int numHits = 0, child = node.childBase;
+        for (int slot = 0; slot < 8; slot++){
+            bool inner = (node.innerMask & (1 << slot)) != 0;
+            if (!inner && !node.meta[slot])
+                continue;
+            float t = tNear[slot] > tFar[slot] ? -1 : tNear[slot];
+            if (t >= 0){
+                entry h = { inner ? child : e.node, inner ? -1 : slot, t };
+                int k = numHits++;
+                for (; k > 0 && hits[k - 1].t < t; k--)
+                    hits[k] = hits[k - 1];
+                hits[k] = h;
+            }
+            if (inner)
+                child++;
+        }
+        for (int k = 0; k < numHits; k++)
+            stack[top++] = hits[k];
+    }
+}
+
+void triangleBVH::closestHit(vec3 ray, vec3 oPoint, const vector<triangle> &triangles, hitRecord &hit, int exclude, int root) const {
+    traverse(ray, oPoint, hit.t, root, [&](int first, int count, const bounds &box){
+        for (int k = first; k < first + count; k++){
+            if (!quantized.empty() && leafRejects(ray, oPoint, hit.t, box, k))
+                continue;
+
+            //equal distances go to the lower id, as they would testing the triangles in order
+            int id = order[k];
+            if (id == exclude)
+                continue;
+            vec3 v = intersectTriangle(ray, oPoint, triangles[id]);
+            if (v[0] > 0 && v[1] >= 0 && v[2] >= 0 && (v[1]+v[2] <= 1)
+                && (v[0] < hit.t || (v[0] == hit.t && hit.type == HIT_TRIANGLE && id < hit.id))){
+                hit.type = HIT_TRIANGLE;
+                hit.id = id;
+                hit.t = v[0];
+                hit.u = v[1];
+                hit.v = v[2];
+            }
+        }
+        return false;
+    });
+}
+
+bool triangleBVH::occluded(vec3 ray, vec3 oPoint, float maxT, const vector<triangle> &triangles, int exclude) const {
+    bool blocked = false;
+    traverse(ray, oPoint, maxT, 0, [&](int first, int count, const bounds &box){
+        for (int k = first; k < first + count; k++){
+            if (order[k] == exclude || (!quantized.empty() && leafRejects(ray, oPoint, maxT, box, k)))
+                continue;
+            vec3 v = intersectTriangle(ray, oPoint, triangles[order[k]]);
+            if (v[0] < maxT && v[0] > 0 && v[1] >= 0 && v[2] >= 0 && (v[1]+v[2] <= 1)){
+                blocked = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return blocked;
+}
+
+int triangleBVH::nodeCount() const {
+    return nodeLayout == BVH_WIDE ? (int)wide.size() : (int)binary.size();
+}
+
+size_t triangleBVH::nodeBytes() const {
+    return nodeLayout == BVH_WIDE ? wide.size() * sizeof(wideNode) : binary.size() * sizeof(binaryNode);
+}
+
+void buildBVH(parser &p, bvhLayout layout, bool quantizedVertices){
+    if (p.triangles.empty())
+        p.bvh.reset();
+    else
+        p.bvh = make_shared<const triangleBVH>(p.triangles, layout, quantizedVertices);
+}
@@ -0,0 +1,115 @@
+
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "parser.h"
+#include "bounds.h"
+
+using namespace std;
+
+struct hitRecord;
+
+//node layouts the hierarchy can be built in, binary is the full precision reference
+enum bvhLayout { BVH_BINARY, BVH_WIDE };
+
+/*
+    bounding volume hierarchy over a scene's triangles
+
+    the wide layout has 8 children per node with their boxes quantized to 8 bits per
+    plane relative to the node, 80 bytes a node instead of 32 bytes for every binary one
+    it is an experiment for --bvh-report only: though it tests a node's 8 child boxes
+    together, in scalar code it still traces 1.1 to 1.4 times slower than the binary
+    layout (primary and shadow rays, 6k and 200k triangle scenes), so nothing renders with it
+    with quantizedVertices the leaves also keep 16 bit copies of their triangles'
+    vertices relative to the leaf box, which rule out most triangles before the
+    full precision triangle is ever read
+
+    boxes are rounded outwards and leaf tests only reject, so it always finds
+    the same closest hit as testing every triangle would
+*/
+class triangleBVH{
+public:
+    static const int maxLeafSize = 4;
+
+    //deep enough for any hierarchy the build can produce
+    static const int stackSize = 512;
+
+    triangleBVH(const vector<triangle> &triangles, bvhLayout layout, bool quantizedVertices);
+
+    //tests the triangles against the ray, keeping hit if it is still the closest
+    //the triangle with id exclude (the one the ray leaves from, or -1) is skipped
+    //only the triangles under node root are tested, which subtrees hands out (0 is all of them)
+    void closestHit(vec3 ray, vec3 oPoint, const vector<triangle> &triangles, hitRecord &hit, int exclude, int root = 0) const;
+
+    //whether any of the triangles blocks the ray between oPoint and maxT
+    bool occluded(vec3 ray, vec3 oPoint, float maxT, const vector<triangle> &triangles, int exclude) const;
+
+    /*
+        walks the binary layout's nodes top down, visit(node, box, leaf) returns whether to go on into
+        the node's children, so the hierarchy can be cut into subtrees closestHit can start from
+     */
+    template <class Visit>
+    void subtrees(Visit visit) const;
+
+    bvhLayout layout() const { return nodeLayout; }
+    int nodeCount() const;
+    size_t nodeBytes() const;
+    size_t vertexBytes() const { return quantized.size() * sizeof(uint16_t); }
+    size_t memoryBytes() const { return nodeBytes() + vertexBytes() + order.size() * sizeof(int); }
+
+private:
+    //full precision binary node, a leaf when count > 0
+    struct binaryNode{
+        bounds box;
+        int first;          //first index into order for a leaf, the second child otherwise
+        int count;
+    };
+
+    //8 wide node with the child boxes stored as 8 bit offsets from origin in steps of 2^exponent
+    struct wideNode{
+        vec3 origin;
+        int8_t exponent[3];
+        uint8_t innerMask;      //children that are nodes rather than leaves
+        uint32_t childBase;     //node index of the first inner child, the rest follow in slot order
+        uint32_t triangleBase;  //index into order of the first leaf triangle
+        uint8_t meta[8];        //leaves: count << 5 | offset from triangleBase, 0 for an empty slot
+        uint8_t qlo[3][8], qhi[3][8];
+    };
+
+    int buildBinary(vector<int> &refs, vector<bounds> &boxes, vector<vec3> &centroids, int begin, int end, int depth);
+    void buildWide(int binary, int wide, vector<int> &binaryOrder);
+    bounds childBounds(const wideNode &node, int slot) const;
+    void quantizeLeaf(const bounds &box, int first, int count, const vector<triangle> &triangles);
+    bool leafRejects(vec3 ray, vec3 oPoint, float maxT, const bounds &box, int index) const;
+
+    template <class Visit>
+    void traverse(vec3 ray, vec3 oPoint, const float &maxT, int root, Visit visit) const;
+
+    bvhLayout nodeLayout;
+    vector<binaryNode> binary;
+    vector<wideNode> wide;
+    vector<int> order;          //triangle ids in leaf order
+    vector<uint16_t> quantized; //9 per entry of order when the vertices are quantized
+};
+
+//(re)builds the hierarchy over a parser's triangles, parser::compile builds the default one
+void buildBVH(parser &p, bvhLayout layout, bool quantizedVertices);
+
+template <class Visit>
+void triangleBVH::subtrees(Visit visit) const {
+    if (nodeLayout != BVH_BINARY || binary.empty())
+        return;
+    int stack[stackSize];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0){
+        int index = stack[--top];
+        const binaryNode &node = binary[index];
+        if (visit(index, node.box, node.count > 0) && node.count == 0){
+            stack[top++] = node.first;
+            stack[top++] = index + 1;
+        }
+    }
+}
@@ -0,0 +1,330 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "geometrypages.h"
+
+using namespace std;
+
+/*
+    page file layout, all little endian as written by the machine that built it:
+        header      "TPG1", uint32 page count, uint32 triangle count
+        directory   per page: uint64 offset, float bounds lo[3], hi[3]
+        pages       uint32 vertex, material and triangle counts,
+                    float vertices[3 * vertex count],
+                    float materials[7 * material count] (Cr, Cp, phong),
+                    uint16 triangles[4 * triangle count] (a, b, c, material)
+    triangles in a page share vertices and materials, which is where the space goes
+*/
+static const char pageMagic[4] = { 'T', 'P', 'G', '1' };
+
+struct pageHeader{
+    uint32_t vertices, materials, triangles;
+};
+
+struct directoryEntry{
+    uint64_t offset;
+    float lo[3], hi[3];
+};
+
+//strict ordering of vectors so they can key a map
+struct vecLess{
+    bool operator()(const vec3 &a, const vec3 &b) const {
+        if (a.x != b.x) return a.x < b.x;
+        if (a.y != b.y) return a.y < b.y;
+        return a.z < b.z;
+    }
+};
+
+struct materialLess{
+    bool operator()(const triangle &a, const triangle &b) const {
+        vecLess less;
+        if (a.Cr != b.Cr) return less(a.Cr, b.Cr);
+        if (a.Cp != b.Cp) return less(a.Cp, b.Cp);
+        return a.phong < b.phong;
+    }
+};
+
+//returns the index of v in table, adding it if it isn't there yet
+template <class T, class Less>
+static uint16_t lookup(map<T, uint16_t, Less> &index, vector<T> &table, const T &v){
+    typename map<T, uint16_t, Less>::iterator it = index.find(v);
+    if (it != index.end())
+        return it->second;
+    uint16_t i = (uint16_t)table.size();
+    index.insert(make_pair(v, i));
+    table.push_back(v);
+    return i;
+}
+
+// --------------------------------------------------------------------------
+
+const int geometryPages::trianglesPerPage;
+
+geometryPages::geometryPages()
+    :budget(0),resident(0),numTriangles(0),loads(0),data(0),dataSize(0){}
+
+geometryPages::~geometryPages(){
+    close();
+}
+
+bool geometryPages::build(const vector<triangle> &triangles, const char *filename){
+    FILE *f = fopen(filename, "wb");
+    if (!f){
+        printf("Could not write page file %s\n", filename);
+        return false;
+    }
+
+    //order the triangles along a morton curve through their centroids
+    bounds centroids;
+    for (const triangle &tri : triangles)
+        centroids.grow((tri.a + tri.b + tri.c) / 3.f);
+
+    vector<pair<unsigned int, int> > order(triangles.size());
+    for (int i = 0; i < (int)triangles.size(); i++){
+        const triangle &tri = triangles[i];
+        order[i] = make_pair(mortonCode((tri.a + tri.b + tri.c) / 3.f, centroids), i);
+    }
+    sort(order.begin(), order.end());
+
+    uint32_t numPages = (uint32_t)((triangles.size() + trianglesPerPage - 1) / trianglesPerPage);
+    uint32_t count = (uint32_t)triangles.size();
+    fwrite(pageMagic, 1, 4, f);
+    fwrite(&numPages, sizeof(numPages), 1, f);
+    fwrite(&count, sizeof(count), 1, f);
+
+    //the directory is filled in once the page offsets are known
+    vector<directoryEntry> entries(numPages);
+    long directoryStart = ftell(f);
+    fwrite(entries.data(), sizeof(directoryEntry), numPages, f);
+
+    for (uint32_t pg = 0; pg < numPages; pg++){
+        vector<vec3> vertices;
+        vector<triangle> materials;
+        map<vec3, uint16_t, vecLess> vertexIndex;
+        map<triangle, uint16_t, materialLess> materialIndex;
+        vector<uint16_t> indices;
+        bounds box;
+
+        size_t first = (size_t)pg * trianglesPerPage;
+        size_t last = min(first + trianglesPerPage, triangles.size());
+        for (size_t i = first; i < last; i++){
+            const triangle &tri = triangles[order[i].second];
+            indices.push_back(lookup(vertexIndex, vertices, tri.a));
+            indices.push_back(lookup(vertexIndex, vertices, tri.b));
+            indices.push_back(lookup(vertexIndex, vertices, tri.c));
+            indices.push_back(lookup(materialIndex, materials, tri));
+            box.grow(tri.a);
+            box.grow(tri.b);
+            box.grow(tri.c);
+        }
+
+        //pad the box a little so rounding in the slab test can't cull a triangle lying on its face
+        vec3 pad = (box.hi - box.lo) * 1e-4f + vec3(1e-5f);
+        box.lo -= pad;
+        box.hi += pad;
+
+        entries[pg].offset = (uint64_t)ftell(f);
+        for (int axis = 0; axis < 3; axis++){
+            entries[pg].lo[axis] = box.lo[axis];
+            entries[pg].hi[axis] = box.hi[axis];
+        }
+
+        pageHeader header = { (uint32_t)vertices.size(), (uint32_t)materials.size(), (uint32_t)(last - first) };
+        fwrite(&header, sizeof(header), 1, f);
+        for (const vec3 &v : vertices)
+            fwrite(&v[0], sizeof(float), 3, f);
+        for (const triangle &m : materials){
+            float material[7] = { m.Cr.x, m.Cr.y, m.Cr.z, m.Cp.x, m.Cp.y, m.Cp.z, m.phong };
+            fwrite(material, sizeof(float), 7, f);
+        }
+        fwrite(indices.data(), sizeof(uint16_t), indices.size(), f);
+    }
+
+    fseek(f, directoryStart, SEEK_SET);
+    fwrite(entries.data(), sizeof(directoryEntry), numPages, f);
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+bool geometryPages::open(const char *filename, size_t budgetBytes){
+    close();
+    budget = budgetBytes;
+
+#ifndef _WIN32
+    int fd = ::open(filename, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0){
+        printf("Could not open page file %s\n", filename);
+        if (fd >= 0)
+            ::close(fd);
+        return false;
+    }
+    dataSize = (size_t)info.st_size;
+    void *mapped = mmap(0, dataSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED){
+        printf("Could not map page file %s\n", filename);
+        dataSize = 0;
+        return false;
+    }
+    data = (const unsigned char *)mapped;
+#else
+    //no mmap here, read the (compressed) file into memory instead
+    FILE *f = fopen(filename, "rb");
+    if (!f){
+        printf("Could not open page file %s\n", filename);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    fallback.resize((size_t)ftell(f));
+    fseek(f, 0, SEEK_SET);
+    dataSize = fread(fallback.data(), 1, fallback.size(), f);
+    fclose(f);
+    data = fallback.data();
+#endif
+
+    uint32_t numPages, count;
+    if (dataSize < 12 || memcmp(data, pageMagic, 4) != 0){
+        printf("%s is not a page file\n", filename);
+        close();
+        return false;
+    }
+    memcpy(&numPages, data + 4, 4);
+    memcpy(&count, data + 8, 4);
+    numTriangles = (int)count;
+
+    directory.resize(numPages);
+    for (uint32_t pg = 0; pg < numPages; pg++){
+        directoryEntry entry;
+        memcpy(&entry, data + 12 + pg * sizeof(directoryEntry), sizeof(entry));
+        directory[pg].offset = (size_t)entry.offset;
+        directory[pg].box.lo = vec3(entry.lo[0], entry.lo[1], entry.lo[2]);
+        directory[pg].box.hi = vec3(entry.hi[0], entry.hi[1], entry.hi[2]);
+        directory[pg].bytes = 0;
+    }
+
+    vector<int> pages(numPages);
+    for (uint32_t pg = 0; pg < numPages; pg++)
+        pages[pg] = (int)pg;
+    if (numPages > 0)
+        buildTree(pages, 0, (int)numPages);
+    return true;
+}
+
+//builds the hierarchy over pages[begin, end) by halving along the widest spread of their centres
+int geometryPages::buildTree(vector<int> &pages, int begin, int end){
+    int index = (int)tree.size();
+    tree.push_back(pageNode());
+
+    bounds box, centres;
+    for (int i = begin; i < end; i++){
+        const bounds &b = directory[pages[i]].box;
+        box.grow(b);
+        centres.grow((b.lo + b.hi) * 0.5f);
+    }
+    tree[index].box = box;
+    if (end - begin == 1){
+        tree[index].page = pages[begin];
+        tree[index].second = -1;
+        return index;
+    }
+
+    int axis = 0;
+    vec3 extent = centres.hi - centres.lo;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+    int mid = begin + (end - begin) / 2;
+    nth_element(pages.begin() + begin, pages.begin() + mid, pages.begin() + end, [&](int a, int b){
+        return directory[a].box.lo[axis] + directory[a].box.hi[axis] < directory[b].box.lo[axis] + directory[b].box.hi[axis];
+    });
+
+    buildTree(pages, begin, mid);
+    int second = buildTree(pages, mid, end);
+    tree[index].page = -1;
+    tree[index].second = second;
+    return index;
+}
+
+void geometryPages::close(){
+#ifndef _WIN32
+    if (data)
+        munmap((void *)data, dataSize);
+#endif
+    fallback.clear();
+    data = 0;
+    dataSize = 0;
+    directory.clear();
+    tree.clear();
+    lru.clear();
+    resident = 0;
+    numTriangles = 0;
+    loads = 0;
+}
+
+void geometryPages::evict(int pg){
+    pageEntry &entry = directory[pg];
+    resident -= entry.bytes;
+    entry.bytes = 0;
+    vector<triangle>().swap(entry.triangles);
+    entry.bvh.reset();
+    lru.erase(entry.lru);
+}
+
+const vector<triangle> &geometryPages::page(int pg){
+    pageEntry &entry = directory[pg];
+
+    if (!entry.triangles.empty()){
+        lru.splice(lru.begin(), lru, entry.lru);
+        return entry.triangles;
+    }
+
+    //decompress the page, rebuilding what parser::compile would have set up
+    const unsigned char *src = data + entry.offset;
+    pageHeader header;
+    memcpy(&header, src, sizeof(header));
+    const float *vertices = (const float *)(src + sizeof(header));
+    const float *materials = vertices + 3 * header.vertices;
+    const uint16_t *indices = (const uint16_t *)(materials + 7 * header.materials);
+
+    entry.triangles.reserve(header.triangles);
+    for (uint32_t i = 0; i < header.triangles; i++){
+        const uint16_t *t = indices + 4 * i;
+        const float *m = materials + 7 * t[3];
+        triangle tri(vec3(vertices[3*t[0]], vertices[3*t[0]+1], vertices[3*t[0]+2]),
+                     vec3(vertices[3*t[1]], vertices[3*t[1]+1], vertices[3*t[1]+2]),
+                     vec3(vertices[3*t[2]], vertices[3*t[2]+1], vertices[3*t[2]+2]),
+                     vec3(m[0], m[1], m[2]), vec3(m[3], m[4], m[5]), m[6]);
+        tri.n = normalize(cross(tri.b - tri.a, tri.c - tri.a));
+        tri.phongExp = phongExponent(tri.phong);
+        entry.triangles.push_back(tri);
+    }
+
+    entry.bvh = make_shared<const triangleBVH>(entry.triangles, BVH_BINARY, false);
+    entry.bytes = entry.triangles.capacity() * sizeof(triangle) + entry.bvh->memoryBytes();
+    resident += entry.bytes;
+    loads++;
+    lru.push_front(pg);
+    entry.lru = lru.begin();
+
+    //keep under budget, but never evict the page being handed out
+    while (resident > budget && lru.size() > 1)
+        evict(lru.back());
+
+    return entry.triangles;
+}
+
+const triangleBVH &geometryPages::pageHierarchy(int pg){
+    page(pg);
+    return *directory[pg].bvh;
+}
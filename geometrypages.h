@@ -0,0 +1,140 @@
+
+#pragma once
+#include <vector>
+#include <list>
+#include <string>
+#include <cstddef>
+#include <memory>
+
+#include "parser.h"
+#include "bounds.h"
+#include "bvh.h"
+
+using namespace std;
+
+/*
+    out of core triangle storage: the triangles are sorted so that each page holds
+    nearby ones, the pages are written compressed to a file which is memory mapped,
+    and only as many decompressed pages as fit in the memory budget are kept around
+
+    rays find their pages through a small hierarchy over the page bounds, always in memory, and
+    their triangles through a hierarchy of each page's own, built when the page is decompressed
+*/
+class geometryPages{
+public:
+    static const int trianglesPerPage = 1024;
+
+    geometryPages();
+    ~geometryPages();
+
+    //writes the triangles out as a page file, they are reordered by position along the way
+    static bool build(const vector<triangle> &triangles, const char *filename);
+
+    //maps a page file written by build, keeping at most budgetBytes of triangles (and their
+    //hierarchies) decompressed
+    bool open(const char *filename, size_t budgetBytes);
+    void close();
+
+    int pageCount() const { return (int)directory.size(); }
+    int triangleCount() const { return numTriangles; }
+    const bounds &pageBounds(int page) const { return directory[page].box; }
+
+    /*
+        the triangles of a page, decompressing it if it isn't resident
+        the reference is only good until the next call, which may evict the page
+    */
+    const vector<triangle> &page(int page);
+
+    /*
+        the hierarchy over a page's triangles (with ids counted from the page's first), loading
+        the page like page does; asking for the page and its hierarchy one after the other
+        never evicts either, both stay good until a call for another page
+    */
+    const triangleBVH &pageHierarchy(int page);
+
+    /*
+        calls visit(page) for each page whose bounds the ray enters before maxT, nearer ones
+        first, maxT is read again before every box so visit can shorten it; visit returns true
+        to stop there
+    */
+    template <class Visit>
+    void pagesAlong(vec3 ray, vec3 oPoint, const float &maxT, Visit visit) const;
+
+    //a triangle by its index in the file (page * trianglesPerPage + slot)
+    triangle get(int id) { return page(id / trianglesPerPage)[id % trianglesPerPage]; }
+
+    //how many pages have been decompressed, and how much memory they use right now
+    int pageLoads() const { return loads; }
+    size_t residentBytes() const { return resident; }
+
+private:
+    struct pageEntry{
+        size_t offset;              //where the compressed page starts in the file
+        bounds box;
+        vector<triangle> triangles; //empty unless resident
+        shared_ptr<const triangleBVH> bvh;
+        size_t bytes;               //of the two, while resident
+        list<int>::iterator lru;
+    };
+
+    //node of the hierarchy over the pages, a leaf holds one page
+    struct pageNode{
+        bounds box;
+        int page;                   //-1 for an inner node
+        int second;                 //inner nodes: the second child, the first follows the node
+    };
+
+    void evict(int page);
+    int buildTree(vector<int> &pages, int begin, int end);
+
+    vector<pageEntry> directory;
+    vector<pageNode> tree;
+    list<int> lru;                  //resident pages, most recently used first
+    size_t budget, resident;
+    int numTriangles, loads;
+
+    const unsigned char *data;      //the mapped file
+    size_t dataSize;
+    vector<unsigned char> fallback; //file contents when it can't be mapped
+};
+
+template <class Visit>
+void geometryPages::pagesAlong(vec3 ray, vec3 oPoint, const float &maxT, Visit visit) const {
+    if (tree.empty())
+        return;
+
+    //a median split keeps the depth to log2 of the page count
+    struct entry{
+        int node;
+        float t;
+    };
+    entry stack[64];
+    int top = 0;
+    vec3 invRay = vec3(1.f / ray.x, 1.f / ray.y, 1.f / ray.z);
+    float t = slabEntry(tree[0].box, invRay, oPoint, maxT);
+    if (t >= 0){
+        entry root = { 0, t };
+        stack[top++] = root;
+    }
+
+    while (top > 0){
+        entry e = stack[--top];
+        if (e.t > maxT)
+            continue;
+        const pageNode &node = tree[e.node];
+        if (node.page >= 0){
+            if (visit(node.page))
+                return;
+            continue;
+        }
+
+        entry a = { e.node + 1, slabEntry(tree[e.node + 1].box, invRay, oPoint, maxT) };
+        entry b = { node.second, slabEntry(tree[node.second].box, invRay, oPoint, maxT) };
+        if (a.t > b.t)
+            std::swap(a, b);
+        if (b.t >= 0)
+            stack[top++] = b;
+        if (a.t >= 0)
+            stack[top++] = a;
+    }
+}
@@ -17,6 +17,7 @@
 // ==========================================================================
 
 #include <iostream>
+#include <cmath>
 #include <glm/common.hpp>
 
 #include "imagebuffer.h"
@@ -45,10 +46,19 @@ using namespace glm;
 
 // --------------------------------------------------------------------------
 
+const int ImageBuffer::TileSize;
+const int ImageBuffer::TilePixels;
+
 ImageBuffer::ImageBuffer()
-    : m_textureName(0), m_framebufferObject(0),
-      m_width(0), m_height(0), m_modified(false)
+    : m_textureName(0), m_framebufferObject(0), m_nextPixelBuffer(0),
+      m_width(0), m_height(0), m_tilesX(0), m_tilesY(0), m_tiles(0),
+      m_toneMap(TONEMAP_CLAMP), m_exposureScale(1.f), m_modified(false)
 {
+    for (int i = 0; i < 2; ++i) {
+        m_pixelBuffers[i] = 0;
+        m_uploadFences[i] = 0;
+        m_mappedPixels[i] = 0;
+    }
 }
 
 ImageBuffer::~ImageBuffer()
@@ -63,6 +73,77 @@ void ImageBuffer::ResetModified()
     m_modifiedUpper = 0;
 }
 
+void ImageBuffer::MarkModified(int lower, int upper)
+{
+    m_modified = true;
+    m_modifiedLower = std::min(m_modifiedLower, lower);
+    m_modifiedUpper = std::max(m_modifiedUpper, upper);
+}
+
+// brings one channel of a pixel's mean, already scaled by the exposure, into
+// [0,1]; the curve is picked at compile time so the loops calling it are
+// straight line arithmetic the compiler can vectorize
+template <ImageBuffer::ToneMap toneMap>
+static inline float ToneMapChannel(float c)
+{
+    if (toneMap == ImageBuffer::TONEMAP_REINHARD)
+    {
+        c = std::max(c, 0.f);
+        c = c / (1.f + c);
+    }
+    else if (toneMap == ImageBuffer::TONEMAP_FILMIC)
+    {
+        c = std::max(c, 0.f);
+        c = (c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f);
+    }
+    return std::min(std::max(c, 0.f), 1.f);
+}
+
+// converts the sums and sample counts of up to a tile row of pixels into the
+// RGBA8 staging format, tone mapping them on the way
+template <ImageBuffer::ToneMap toneMap>
+static void PackRGBA8(const vec3 *sums, const float *counts, float exposureScale,
+                      unsigned char *dest, int count)
+{
+    float mapped[3 * ImageBuffer::TileSize];
+    for (int i = 0; i < count; ++i)
+    {
+        float scale = exposureScale / std::max(counts[i], 1.f);
+        mapped[3 * i]     = ToneMapChannel<toneMap>(sums[i].r * scale) * 255.f + 0.5f;
+        mapped[3 * i + 1] = ToneMapChannel<toneMap>(sums[i].g * scale) * 255.f + 0.5f;
+        mapped[3 * i + 2] = ToneMapChannel<toneMap>(sums[i].b * scale) * 255.f + 0.5f;
+    }
+    for (int i = 0; i < count; ++i, dest += 4)
+    {
+        dest[0] = (unsigned char) mapped[3 * i];
+        dest[1] = (unsigned char) mapped[3 * i + 1];
+        dest[2] = (unsigned char) mapped[3 * i + 2];
+        dest[3] = 255;
+    }
+}
+
+typedef void (*PackFunction)(const vec3 *, const float *, float, unsigned char *, int);
+
+static PackFunction PackerFor(ImageBuffer::ToneMap toneMap)
+{
+    switch (toneMap)
+    {
+    case ImageBuffer::TONEMAP_REINHARD: return PackRGBA8<ImageBuffer::TONEMAP_REINHARD>;
+    case ImageBuffer::TONEMAP_FILMIC:   return PackRGBA8<ImageBuffer::TONEMAP_FILMIC>;
+    default:                            return PackRGBA8<ImageBuffer::TONEMAP_CLAMP>;
+    }
+}
+
+// blocks until the GPU has finished reading from a pixel buffer
+static void WaitForUpload(GLsync &fence)
+{
+    if (!fence) return;
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+        ;
+    glDeleteSync(fence);
+    fence = 0;
+}
+
 // --------------------------------------------------------------------------
 
 bool ImageBuffer::Initialize()
@@ -73,24 +154,63 @@ bool ImageBuffer::Initialize()
     m_width = viewport[2];
     m_height = viewport[3];
 
-    // allocate image data
-    m_imageData.resize(m_width * m_height);
-    for (int i = 0, k = 0; i < m_height; ++i)
-        for (int j = 0; j < m_width; ++j, ++k)
+    // allocate image data in whole tiles; a tile is 12 cache lines long, so
+    // lining the first one up with a cache line lines up all of them
+    m_tilesX = (m_width + TileSize - 1) / TileSize;
+    m_tilesY = (m_height + TileSize - 1) / TileSize;
+    const int cacheLine = 64;
+    m_imageData.assign(m_tilesX * m_tilesY * TilePixels + cacheLine / 4, vec3(0.f));
+    m_tiles = &m_imageData[0];
+    while (reinterpret_cast<size_t>(m_tiles) % cacheLine)
+        ++m_tiles;
+    m_sampleCounts.assign(m_tilesX * m_tilesY * TilePixels, 1.f);
+
+    for (int i = 0; i < m_height; ++i)
+        for (int j = 0; j < m_width; ++j)
         {
             int p = (i >> 4) + (j >> 4);
             float c = 0.2 + ((p & 1) ? 0.1f : 0.0f);
-            m_imageData[k] = vec3(c);
+            *PixelAddress(j, i) = vec3(c);
         }
 
-    // allocate texture object
+    // allocate texture object, its contents are streamed in on the first Render
     if (!m_textureName)
         glGenTextures(1, &m_textureName);
     glBindTexture(GL_TEXTURE_RECTANGLE, m_textureName);
-    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGB, m_width, m_height, 0, GL_RGB,
-                 GL_FLOAT, &m_imageData[0]);
+    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, m_width, m_height, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, 0);
     glBindTexture(GL_TEXTURE_RECTANGLE, 0);
     ResetModified();
+    MarkModified(0, m_height);
+
+    // allocate the staging buffers, persistently mapped when the context
+    // supports immutable buffer storage (OpenGL 4.4) and mapped per upload
+    // otherwise; immutable storage can't be resized so always start fresh
+    DestroyPixelBuffers();
+    glGenBuffers(2, m_pixelBuffers);
+    GLsizeiptr stagingSize = GLsizeiptr(m_width) * m_height * 4;
+
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    bool persistent = major > 4 || (major == 4 && minor >= 4);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffers[i]);
+#ifdef GL_MAP_PERSISTENT_BIT
+        if (persistent)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, stagingSize, 0, flags);
+            m_mappedPixels[i] = (unsigned char *) glMapBufferRange(
+                GL_PIXEL_UNPACK_BUFFER, 0, stagingSize, flags);
+        }
+        else
+#endif
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, stagingSize, 0, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
     // allocate framebuffer object
     if (!m_framebufferObject)
@@ -108,8 +228,27 @@ bool ImageBuffer::Initialize()
     return status == GL_FRAMEBUFFER_COMPLETE;
 }
 
+void ImageBuffer::DestroyPixelBuffers()
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        if (m_uploadFences[i]) {
+            glDeleteSync(m_uploadFences[i]);
+            m_uploadFences[i] = 0;
+        }
+        m_mappedPixels[i] = 0;
+    }
+    if (m_pixelBuffers[0]) {
+        // deleting a buffer also releases any persistent mapping of it
+        glDeleteBuffers(2, m_pixelBuffers);
+        m_pixelBuffers[0] = m_pixelBuffers[1] = 0;
+    }
+    m_nextPixelBuffer = 0;
+}
+
 void ImageBuffer::Destroy()
 {
+    DestroyPixelBuffers();
     if (m_framebufferObject) {
         glDeleteFramebuffers(1, &m_framebufferObject);
         m_framebufferObject = 0;
@@ -124,13 +263,80 @@ void ImageBuffer::Destroy()
 
 void ImageBuffer::SetPixel(int x, int y, vec3 colour)
 {
-    int index = y * m_width + x;
-    m_imageData[index] = colour;
+    int i = PixelIndex(x, y);
+    m_tiles[i] = colour;
+    m_sampleCounts[i] = 1.f;
 
     // mark that something was changed
-    m_modified = true;
-    m_modifiedLower = std::min(m_modifiedLower, y);
-    m_modifiedUpper = std::max(m_modifiedUpper, y+1);
+    MarkModified(y, y+1);
+}
+
+void ImageBuffer::SetTile(int tileX, int tileY, const vec3 *colours)
+{
+    int first = (tileY * m_tilesX + tileX) * TilePixels;
+    std::copy(colours, colours + TilePixels, m_tiles + first);
+    std::fill(&m_sampleCounts[first], &m_sampleCounts[first] + TilePixels, 1.f);
+
+    int lower = tileY * TileSize;
+    MarkModified(lower, std::min(lower + TileSize, m_height));
+}
+
+void ImageBuffer::AccumulatePixel(int x, int y, vec3 colour)
+{
+    int i = PixelIndex(x, y);
+    m_tiles[i] += colour;
+    m_sampleCounts[i] += 1.f;
+
+    MarkModified(y, y+1);
+}
+
+void ImageBuffer::AccumulateTile(int tileX, int tileY, const vec3 *colours)
+{
+    int first = (tileY * m_tilesX + tileX) * TilePixels;
+    vec3 *tile = m_tiles + first;
+    float *counts = &m_sampleCounts[first];
+    for (int i = 0; i < TilePixels; ++i)
+    {
+        tile[i] += colours[i];
+        counts[i] += 1.f;
+    }
+
+    int lower = tileY * TileSize;
+    MarkModified(lower, std::min(lower + TileSize, m_height));
+}
+
+void ImageBuffer::ClearSamples()
+{
+    std::fill(m_tiles, m_tiles + m_tilesX * m_tilesY * TilePixels, vec3(0.f));
+    std::fill(m_sampleCounts.begin(), m_sampleCounts.end(), 0.f);
+    MarkModified(0, m_height);
+}
+
+// --------------------------------------------------------------------------
+
+void ImageBuffer::SetToneMapping(ToneMap toneMap, float exposureStops)
+{
+    m_toneMap = toneMap;
+    m_exposureScale = std::pow(2.f, exposureStops);
+
+    // every pixel looks different now, though none of them has changed
+    MarkModified(0, m_height);
+}
+
+vec3 ImageBuffer::DisplayColour(int x, int y) const
+{
+    int i = PixelIndex(x, y);
+    vec3 c = m_tiles[i] * (m_exposureScale / std::max(m_sampleCounts[i], 1.f));
+    for (int k = 0; k < 3; ++k)
+    {
+        switch (m_toneMap)
+        {
+        case TONEMAP_REINHARD: c[k] = ToneMapChannel<TONEMAP_REINHARD>(c[k]); break;
+        case TONEMAP_FILMIC:   c[k] = ToneMapChannel<TONEMAP_FILMIC>(c[k]); break;
+        default:               c[k] = ToneMapChannel<TONEMAP_CLAMP>(c[k]); break;
+        }
+    }
+    return c;
 }
 
 // --------------------------------------------------------------------------
@@ -144,12 +350,42 @@ void ImageBuffer::Render()
     {
         int sizeY = m_modifiedUpper - m_modifiedLower;
         int index = m_modifiedLower * m_width;
-
-        // bind texture and copy only the rows that have been changed
+        GLintptr offset = GLintptr(index) * 4;
+        GLsizeiptr length = GLsizeiptr(sizeY) * m_width * 4;
+
+        // take the staging buffer that was used two uploads ago, which the
+        // GPU has almost certainly finished reading from by now
+        int slot = m_nextPixelBuffer;
+        m_nextPixelBuffer ^= 1;
+        WaitForUpload(m_uploadFences[slot]);
+
+        // convert only the rows that have been changed into the staging
+        // buffer, gathering each row from the tiles it crosses
+        PackFunction pack = PackerFor(m_toneMap);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffers[slot]);
+        unsigned char *staging = m_mappedPixels[slot];
+        if (staging)
+            staging += offset;
+        else
+            staging = (unsigned char *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, length,
+                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        for (int y = m_modifiedLower; y < m_modifiedUpper; ++y, staging += 4 * m_width)
+            for (int x = 0; x < m_width; x += TileSize)
+            {
+                int i = PixelIndex(x, y);
+                pack(m_tiles + i, &m_sampleCounts[i], m_exposureScale, staging + 4 * x,
+                     std::min(TileSize, m_width - x));
+            }
+        if (!m_mappedPixels[slot])
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        // bind texture and start the asynchronous copy out of the buffer
         glBindTexture(GL_TEXTURE_RECTANGLE, m_textureName);
         glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, m_modifiedLower, m_width,
-                        sizeY, GL_RGB, GL_FLOAT, &m_imageData[index]);
+                        sizeY, GL_RGBA, GL_UNSIGNED_BYTE, (const void *) offset);
         glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        m_uploadFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
         // mark that we've updated the texture
         ResetModified();
@@ -163,6 +399,18 @@ void ImageBuffer::Render()
     glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
 }
 
+bool ImageBuffer::ReadTexture(vector<unsigned char> &rgba)
+{
+    if (!m_framebufferObject) return false;
+
+    rgba.resize(size_t(m_width) * m_height * 4);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, m_framebufferObject);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, &rgba[0]);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    return glGetError() == GL_NO_ERROR;
+}
+
 // --------------------------------------------------------------------------
 
 bool ImageBuffer::SaveToFile(const string &imageFileName)
@@ -181,13 +429,13 @@ bool ImageBuffer::SaveToFile(const string &imageFileName)
     for (int y = 0; y < m_height; ++y)
         for (int x = 0; x < m_width; ++x)
         {
-            glm::vec3& color = m_imageData[y * m_width + x];
+            glm::vec3 color = DisplayColour(x, y);
             int i = (m_height - 1 - y) * m_width + x;
             i *= numComponents;
 
-            pixels[i]     = (unsigned char) (255 * clamp(color.r, 0.f, 1.f));	// red
-            pixels[i + 1] = (unsigned char) (255 * clamp(color.g, 0.f, 1.f));	// green
-            pixels[i + 2] = (unsigned char) (255 * clamp(color.b, 0.f, 1.f));	// blue
+            pixels[i]     = (unsigned char) (255 * color.r);	// red
+            pixels[i + 1] = (unsigned char) (255 * color.g);	// green
+            pixels[i + 2] = (unsigned char) (255 * color.b);	// blue
         }
 
     // Save the image to disk
@@ -212,12 +460,11 @@ bool ImageBuffer::SaveToFile(const string &imageFileName)
     Image myImage(Geometry(m_width, m_height), "black");
 
     // copy the image data from our memory buffer into the Magick++ one.
-    int index = 0;
     for (int i = m_height-1; i >= 0; --i)
         for (int j = 0; j < m_width; ++j)
         {
-            vec3 v = m_imageData[index++];
-            vec3 c = clamp(v, 0.f, 1.f) * float(MaxRGB);
+            vec3 v = DisplayColour(j, m_height-1 - i);
+            vec3 c = v * float(MaxRGB);
             Color colour(c.r, c.g, c.b);
             myImage.pixelColor(j, i, colour);
         }
@@ -244,12 +491,11 @@ bool ImageBuffer::SaveToFile(const string &imageFileName)
         return false;
     }
     RGBQUAD colour;
-    int index = 0;
     for (int i = 0; i < m_height; ++i)
         for (int j = 0; j < m_width; ++j)
         {
-            vec3 v = m_imageData[index++];
-            vec3 c = clamp(v, 0.f, 1.f) * 255.0f;
+            vec3 v = DisplayColour(j, i);
+            vec3 c = v * 255.0f;
             colour.rgbRed = (BYTE)c.r;
             colour.rgbGreen = (BYTE)c.g;
             colour.rgbBlue = (BYTE)c.b;
@@ -31,28 +31,81 @@
 
 class ImageBuffer
 {
+public:
+    // the image is stored as square tiles of TileSize x TileSize pixels, each
+    // one contiguous (row by row) and starting on its own cache line
+    static const int TileSize = 8;
+    static const int TilePixels = TileSize * TileSize;
+
+    // how pixel values, scaled by the exposure, are brought into [0,1] when
+    // they are displayed or saved; the stored values are never changed
+    enum ToneMap
+    {
+        TONEMAP_CLAMP,      // cut off at 1, as if there were no tone mapping
+        TONEMAP_REINHARD,   // c / (1 + c), never quite reaches white
+        TONEMAP_FILMIC      // fitted ACES curve with a toe and a shoulder
+    };
+
+private:
     // OpenGL texture corresponding to our image, and an FBO to render it
     GLuint  m_textureName;
     GLuint  m_framebufferObject;
 
-    // dimensions of our image, and the pixel colour data array
+    // pair of pixel buffer objects the texture is streamed from in RGBA8,
+    // alternated so that filling one never waits on the upload from the other
+    GLuint  m_pixelBuffers[2];
+    GLsync  m_uploadFences[2];
+    unsigned char *m_mappedPixels[2];   // persistent mappings, if supported
+    int     m_nextPixelBuffer;
+
+    // dimensions of our image in pixels and tiles, and the pixel colour data
+    // array, over-allocated so that m_tiles can start on a cache line
+    // each pixel holds the running sum of its samples, with the number of
+    // samples at the same index in m_sampleCounts; a pixel's colour is the mean
     int     m_width, m_height;
+    int     m_tilesX, m_tilesY;
     std::vector<glm::vec3> m_imageData;
+    glm::vec3 *m_tiles;
+    std::vector<float> m_sampleCounts;
+
+    // display transform, applied only when converting to 8 bits
+    ToneMap m_toneMap;
+    float   m_exposureScale;
 
     // state variables to keep track of modified region
     bool    m_modified;
     int     m_modifiedLower, m_modifiedUpper;
 
     void ResetModified();
+    void DestroyPixelBuffers();
+    void MarkModified(int lower, int upper);
+
+    // index of pixel (x,y) in the tiled pixel colour data
+    int PixelIndex(int x, int y) const
+    {
+        int tile = (y / TileSize) * m_tilesX + (x / TileSize);
+        return tile * TilePixels + (y % TileSize) * TileSize + (x % TileSize);
+    }
+    glm::vec3 *PixelAddress(int x, int y) const { return m_tiles + PixelIndex(x, y); }
 
 public:
     ImageBuffer();
     ~ImageBuffer();
 
+    // the buffer owns its OpenGL objects and m_tiles points into its own
+    // storage, so a copy would share or outlive them
+    ImageBuffer(const ImageBuffer &) = delete;
+    ImageBuffer &operator=(const ImageBuffer &) = delete;
+
     // returns the width or height of the currently allocated image
     int Width() const  { return m_width; }
     int Height() const { return m_height; }
 
+    // returns the number of tiles across or up the image, edge tiles may hang
+    // over the right and top of the image
+    int TilesX() const { return m_tilesX; }
+    int TilesY() const { return m_tilesY; }
+
     // call this after your OpenGL context is all set up to create an image
     // buffer that matches the size of your viewport
     bool Initialize();
@@ -60,14 +113,50 @@ public:
     // call this if you need to delete the framebuffer object and texture
     void Destroy();
 
-    // set a pixel in this image buffer to a specified colour:
+    // set a pixel in this image buffer to a specified colour, replacing any
+    // samples accumulated in it:
     //  - (0,0) is the bottom-left pixel of the image
-    //  - colour is RGB given as floating point numbers in the range [0,1]
+    //  - colour is linear RGB given as floating point numbers, 1 is white
+    //    before exposure and anything brighter is left to the tone mapping
     void SetPixel(int x, int y, glm::vec3 colour);
 
+    // set a whole tile at once from TilePixels colours, given row by row from
+    // the tile's bottom-left pixel (TileSize*tileX, TileSize*tileY); colours
+    // that fall outside the image are stored but never displayed or saved
+    void SetTile(int tileX, int tileY, const glm::vec3 *colours);
+
+    // add one more sample to a pixel or a whole tile, with the same
+    // conventions as SetPixel and SetTile; the pixel shows the mean of them
+    void AccumulatePixel(int x, int y, glm::vec3 colour);
+    void AccumulateTile(int tileX, int tileY, const glm::vec3 *colours);
+
+    // drops every sample, leaving the image black until more are added
+    void ClearSamples();
+
+    // returns the colour of a pixel (the mean of its samples) before any
+    // exposure or tone mapping, with the same conventions as SetPixel
+    glm::vec3 GetPixel(int x, int y) const
+    {
+        int i = PixelIndex(x, y);
+        float count = m_sampleCounts[i];
+        return count > 0.f ? m_tiles[i] / count : m_tiles[i];
+    }
+    int SampleCount(int x, int y) const { return (int)m_sampleCounts[PixelIndex(x, y)]; }
+
+    // exposure in stops (each one doubles the brightness) and the tone
+    // mapping used by Render and SaveToFile
+    void SetToneMapping(ToneMap toneMap, float exposureStops = 0.f);
+
+    // a pixel's colour as it is displayed and saved, in the range [0,1]
+    glm::vec3 DisplayColour(int x, int y) const;
+
     // call this in your render function to copy this image onto your screen
     void Render();
 
+    // reads the texture back as the last Render left it, RGBA8 row by row
+    // from the bottom-left, so the upload can be checked against GetPixel
+    bool ReadTexture(std::vector<unsigned char> &rgba);
+
     // call this at the end of your render to save the image to file
     bool SaveToFile(const std::string &imageFileName);
 };
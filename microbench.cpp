@@ -0,0 +1,420 @@
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <functional>
+
+#include "microbench.h"
+#include "parser.h"
+#include "raytracer.h"
+#include "renderer.h"
+
+//what the build was compiled with, for the JSON, since the code can't find out for itself
+#ifndef RAYTRACER_BUILD_FLAGS
+#define RAYTRACER_BUILD_FLAGS "unknown"
+#endif
+
+using namespace std;
+using namespace glm;
+
+static const int batchSize = 4096;      //rays a kernel is timed over, few enough to stay in cache
+static const float hitRates[] = { 0.f, 0.25f, 0.5f, 0.75f, 1.f };
+
+struct benchRay{
+    vec3 origin, direction;
+};
+
+//the primitives the kernels are tested against, around the origin and about two units across
+static const vec3 sphereCenter(0.f, 0.f, 0.f);
+static const float sphereRadius = 1.f;
+static const vec3 planeNormal(0.f, 1.f, 0.f), planePoint(0.f, -1.f, 0.f);
+
+static triangle benchTriangle(){
+    return triangle(vec3(-1.5f, -1.f, 0.f), vec3(1.5f, -1.f, 0.f), vec3(0.f, 1.5f, 0.f), vec3(0.7f), vec3(0.2f), 4.f);
+}
+
+//the sphere resting on the plane with the triangle behind it, lit from above
+static parser shadingScene(){
+    parser p;
+    p.spheres.push_back(sphere(sphereCenter, sphereRadius, vec3(0.8f, 0.3f, 0.3f), vec3(0.5f), 16.f));
+    p.triangles.push_back(triangle(vec3(-3.f, -1.f, -2.f), vec3(3.f, -1.f, -2.f), vec3(0.f, 3.f, -2.f),
+                                   vec3(0.3f, 0.8f, 0.3f), vec3(0.2f), 8.f));
+    p.planes.push_back(plane(planeNormal, planePoint, vec3(0.7f), vec3(0.1f), 4.f));
+    p.lightSources.push_back(lightSource(vec3(1.f, 4.f, 3.f), vec3(0.7f), vec3(0.25f)));
+    p.compile();
+    return p;
+}
+
+// --------------------------------------------------------------------------
+// Rays at a chosen hit rate
+
+/*
+    candidate rays: coherent ones leave one point and sweep a grid across a window around the
+    origin a row at a time, random ones leave anywhere on a sphere around it for anywhere near it
+    the later the round the more there are, in case too few of them hit or too few miss
+*/
+static vector<benchRay> candidateRays(rayDistribution rays, int round, mt19937 &random){
+    vector<benchRay> candidates;
+    if (rays == RAYS_COHERENT){
+        vec3 origin(0.2f, 0.5f, 6.f);
+        int side = (int)ceil(sqrt((float)batchSize)) << round;
+        for (int y = 0; y < side; y++)
+            for (int x = 0; x < side; x++){
+                vec3 target(-3.f + 6.f * (x + 0.5f) / side, 3.f - 6.f * (y + 0.5f) / side, 0.f);
+                benchRay r = { origin, normalize(target - origin) };
+                candidates.push_back(r);
+            }
+    }
+    else {
+        uniform_real_distribution<float> unit(-1.f, 1.f);
+        for (int i = 0; i < batchSize << round; i++){
+            vec3 o;
+            do
+                o = vec3(unit(random), unit(random), unit(random));
+            while (dot(o, o) > 1.f || dot(o, o) < 1e-4f);
+            o = 6.f * normalize(o);
+            vec3 target = 2.f * vec3(unit(random), unit(random), unit(random));
+            benchRay r = { o, normalize(target - o) };
+            candidates.push_back(r);
+        }
+    }
+    return candidates;
+}
+
+/*
+    batchSize rays of which hitRate hit, as hits tells them apart, empty if not enough of either
+    could be found; coherent rays stay in sweep order with the hits and the misses each thinned
+    out evenly, random ones are shuffled
+*/
+static vector<benchRay> raysAtHitRate(rayDistribution rays, float hitRate, const function<bool(const benchRay &)> &hits){
+    mt19937 random(453);
+    long long wantHits = lround(hitRate * batchSize), wantMisses = batchSize - wantHits;
+    for (int round = 0; round < 6; round++){
+        vector<benchRay> candidates = candidateRays(rays, round, random);
+        vector<char> hit(candidates.size());
+        long long numHits = 0;
+        for (size_t i = 0; i < candidates.size(); i++)
+            numHits += hit[i] = hits(candidates[i]);
+        long long numMisses = (long long)candidates.size() - numHits;
+        if (numHits < wantHits || numMisses < wantMisses)
+            continue;
+
+        //the k-th of n is taken when k * want / n moves on to the next whole number
+        vector<benchRay> batch;
+        long long hitsSeen = 0, missesSeen = 0;
+        for (size_t i = 0; i < candidates.size(); i++){
+            long long &seen = hit[i] ? hitsSeen : missesSeen;
+            long long want = hit[i] ? wantHits : wantMisses, n = hit[i] ? numHits : numMisses;
+            if ((seen + 1) * want / n != seen * want / n)
+                batch.push_back(candidates[i]);
+            seen++;
+        }
+        if (rays == RAYS_RANDOM)
+            shuffle(batch.begin(), batch.end(), random);
+        return batch;
+    }
+    return vector<benchRay>();
+}
+
+// --------------------------------------------------------------------------
+// Timing
+
+static volatile long long sink;
+
+/*
+    times test over the batch, repeated until one pass takes long enough to measure, best of 5 passes
+    test(ray, index) returns whether the ray hit, which also keeps its work from being optimized away
+*/
+template <class Test>
+static kernelBenchmark timeKernel(const char *kernel, rayDistribution rays, float hitRate,
+                                  const vector<benchRay> &batch, Test test){
+    long long repeats = 1, hits = 0;
+    double best = 1e30;
+    for (int pass = 0; pass < 5; ){
+        auto start = chrono::steady_clock::now();
+        hits = 0;
+        for (long long r = 0; r < repeats; r++)
+            for (int i = 0; i < (int)batch.size(); i++)
+                hits += test(batch[i], i);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (seconds < 0.02){
+            repeats *= 2;
+            continue;
+        }
+        best = std::min(best, seconds);
+        pass++;
+    }
+    sink = sink + hits;
+
+    kernelBenchmark b;
+    b.kernel = kernel;
+    b.rays = rays;
+    b.hitRate = hitRate;
+    b.tests = repeats * (long long)batch.size();
+    b.measuredHitRate = (float)((double)hits / b.tests);
+    b.nsPerTest = best * 1e9 / b.tests;
+    b.testsPerSecond = b.tests / best;
+    return b;
+}
+
+//the hit tests the way closestHit makes them
+static bool sphereHit(const benchRay &r){
+    float t = intersectSphere(r.direction, sphereCenter, r.origin, sphereRadius);
+    return t > 0 && t < delimitor;
+}
+
+static bool triangleHit(const benchRay &r, const triangle &tri){
+    vec3 v = intersectTriangle(r.direction, r.origin, tri);
+    return v[0] > 0 && v[0] < delimitor && v[1] >= 0 && v[2] >= 0 && v[1] + v[2] <= 1;
+}
+
+static bool planeHit(const benchRay &r){
+    float t = intersectPlane(r.direction, planePoint, r.origin, planeNormal);
+    return t > 0 && t < delimitor;
+}
+
+vector<kernelBenchmark> runKernelBenchmarks(){
+    vector<kernelBenchmark> results;
+    triangle tri = benchTriangle();
+    tri.n = normalize(cross(tri.b - tri.a, tri.c - tri.a));
+    parser scene = shadingScene();
+
+    const char *kernels[] = { "intersectSphere", "intersectTriangle", "intersectPlane", "shadeHit" };
+    rayDistribution distributions[] = { RAYS_COHERENT, RAYS_RANDOM };
+    for (int k = 0; k < 4; k++)
+        for (rayDistribution rays : distributions)
+            for (float hitRate : hitRates){
+                function<bool(const benchRay &)> hits;
+                switch (k){
+                case 0: hits = sphereHit; break;
+                case 1: hits = [&tri](const benchRay &r){ return triangleHit(r, tri); }; break;
+                case 2: hits = planeHit; break;
+                default:
+                    hits = [&scene](const benchRay &r){ return closestHit(r.direction, scene, r.origin).type != HIT_NONE; };
+                }
+
+                vector<benchRay> batch = raysAtHitRate(rays, hitRate, hits);
+                if (batch.empty()){
+                    fprintf(stderr, "%s: can't make %s rays with %g%% hits, skipped\n", kernels[k],
+                            rays == RAYS_COHERENT ? "coherent" : "random", 100 * hitRate);
+                    continue;
+                }
+
+                switch (k){
+                case 0:
+                    results.push_back(timeKernel(kernels[k], rays, hitRate, batch,
+                                                 [](const benchRay &r, int){ return sphereHit(r); }));
+                    break;
+                case 1:
+                    results.push_back(timeKernel(kernels[k], rays, hitRate, batch,
+                                                 [&tri](const benchRay &r, int){ return triangleHit(r, tri); }));
+                    break;
+                case 2:
+                    results.push_back(timeKernel(kernels[k], rays, hitRate, batch,
+                                                 [](const benchRay &r, int){ return planeHit(r); }));
+                    break;
+                default: {
+                    //the hits are found beforehand, only the shading is timed
+                    vector<hitRecord> found;
+                    for (const benchRay &r : batch)
+                        found.push_back(closestHit(r.direction, scene, r.origin));
+                    results.push_back(timeKernel(kernels[k], rays, hitRate, batch,
+                        [&scene, &found](const benchRay &r, int i){
+                            vec3 c = shadeHit(found[i], r.direction, r.origin, scene, vec2(0.f));
+                            return found[i].type != HIT_NONE && c.r + c.g + c.b >= 0;
+                        }));
+                }
+                }
+            }
+    return results;
+}
+
+// --------------------------------------------------------------------------
+// Coherence
+
+static const int coherenceSide = 256;       //pixels across the image the wavefront benchmark traces
+static const int wallCells = 120;           //quads across each wall, two triangles each
+
+/*
+    a box open towards the camera, its floor, back and side walls finely tessellated with a little
+    relief, holding a grid of mirror spheres: reflections go every way through a hierarchy far
+    larger than the cache, which is what sorting the bounces is meant to help with
+*/
+static parser coherenceScene(){
+    parser p;
+    mt19937 random(977);
+    uniform_real_distribution<float> relief(-0.05f, 0.05f);
+
+    //each wall spans corner + [0,1] * u + [0,1] * v
+    const vec3 corners[] = { vec3(-4.f, -2.f, -2.f), vec3(-4.f, -2.f, -14.f), vec3(-4.f, -2.f, -2.f), vec3(4.f, -2.f, -2.f) };
+    const vec3 us[] = { vec3(8.f, 0.f, 0.f), vec3(8.f, 0.f, 0.f), vec3(0.f, 0.f, -12.f), vec3(0.f, 0.f, -12.f) };
+    const vec3 vs[] = { vec3(0.f, 0.f, -12.f), vec3(0.f, 6.f, 0.f), vec3(0.f, 6.f, 0.f), vec3(0.f, 6.f, 0.f) };
+    for (int wall = 0; wall < 4; wall++){
+        vec3 n = normalize(cross(us[wall], vs[wall]));
+        vector<vec3> grid;
+        for (int j = 0; j <= wallCells; j++)
+            for (int i = 0; i <= wallCells; i++)
+                grid.push_back(corners[wall] + us[wall] * ((float)i / wallCells) + vs[wall] * ((float)j / wallCells)
+                               + n * relief(random));
+        vec3 colour(0.3f + 0.15f * wall, 0.6f, 0.9f - 0.15f * wall);
+        for (int j = 0; j < wallCells; j++)
+            for (int i = 0; i < wallCells; i++){
+                vec3 a = grid[j * (wallCells + 1) + i], b = grid[j * (wallCells + 1) + i + 1];
+                vec3 c = grid[(j + 1) * (wallCells + 1) + i + 1], d = grid[(j + 1) * (wallCells + 1) + i];
+                p.triangles.push_back(triangle(a, b, c, colour, vec3(0.1f), 4.f));
+                p.triangles.push_back(triangle(a, c, d, colour, vec3(0.1f), 4.f));
+            }
+    }
+
+    for (int y = 0; y < 3; y++)
+        for (int x = 0; x < 5; x++)
+            p.spheres.push_back(sphere(vec3(-2.8f + 1.4f * x, -1.2f + 1.3f * y, -7.f - 1.5f * ((x + y) % 3)), 0.6f,
+                                       vec3(0.7f), vec3(0.5f), 16.f));
+    p.lightSources.push_back(lightSource(vec3(0.f, 3.5f, -6.f), vec3(0.7f), vec3(0.25f)));
+    p.compile();
+    return p;
+}
+
+coherenceBenchmarkResult runCoherenceBenchmark(){
+    parser scene = coherenceScene();
+    coherenceBenchmarkResult r;
+    r.triangles = (int)scene.triangles.size();
+    r.spheres = (int)scene.spheres.size();
+    r.width = r.height = coherenceSide;
+    r.timing = coherenceBenchmark(scene, generateRay(55.f, (float)r.width, (float)r.height), r.height,
+                                  Renderer::BandWidth);
+    return r;
+}
+
+// --------------------------------------------------------------------------
+// Reporting
+
+static string compilerName(){
+#if defined(__clang__)
+    return string("clang ") + __clang_version__;
+#elif defined(__GNUC__)
+    return string("gcc ") + __VERSION__;
+#elif defined(_MSC_VER)
+    return "msvc " + to_string(_MSC_FULL_VER);
+#else
+    return "unknown";
+#endif
+}
+
+//the vector instruction sets the compiler was allowed to use
+static vector<string> instructionSets(){
+    vector<string> sets;
+#if defined(__SSE2__) || defined(_M_X64)
+    sets.push_back("sse2");
+#endif
+#ifdef __SSE4_2__
+    sets.push_back("sse4.2");
+#endif
+#ifdef __AVX__
+    sets.push_back("avx");
+#endif
+#ifdef __AVX2__
+    sets.push_back("avx2");
+#endif
+#ifdef __FMA__
+    sets.push_back("fma");
+#endif
+#ifdef __AVX512F__
+    sets.push_back("avx512f");
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    sets.push_back("neon");
+#endif
+    return sets;
+}
+
+static string quoted(const string &s){
+    string q = "\"";
+    for (char c : s){
+        if (c == '"' || c == '\\')
+            q += '\\';
+        q += c;
+    }
+    return q + "\"";
+}
+
+static string number(double v){
+    char text[32];
+    snprintf(text, sizeof(text), "%.6g", v);
+    return text;
+}
+
+string kernelBenchmarkJSON(const vector<kernelBenchmark> &results, const coherenceBenchmarkResult &coherence){
+    bool optimized = false;
+#if defined(__OPTIMIZE__) || (defined(_MSC_VER) && defined(NDEBUG))
+    optimized = true;
+#endif
+
+    string json = "{\n  \"build\": {\n";
+    json += "    \"compiler\": " + quoted(compilerName()) + ",\n";
+    json += "    \"flags\": " + quoted(RAYTRACER_BUILD_FLAGS) + ",\n";
+    json += string("    \"optimized\": ") + (optimized ? "true" : "false") + ",\n";
+    json += "    \"instructionSets\": [";
+    vector<string> sets = instructionSets();
+    for (size_t i = 0; i < sets.size(); i++)
+        json += (i ? ", " : "") + quoted(sets[i]);
+    json += "]\n  },\n";
+    json += "  \"batchRays\": " + to_string(batchSize) + ",\n";
+    json += "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++){
+        const kernelBenchmark &b = results[i];
+        json += i ? ",\n    {" : "\n    {";
+        json += "\"kernel\": " + quoted(b.kernel);
+        json += ", \"rays\": " + quoted(b.rays == RAYS_COHERENT ? "coherent" : "random");
+        json += ", \"hitRate\": " + number(b.hitRate);
+        json += ", \"measuredHitRate\": " + number(b.measuredHitRate);
+        json += ", \"tests\": " + to_string(b.tests);
+        json += ", \"nsPerTest\": " + number(b.nsPerTest);
+        json += ", \"testsPerSecond\": " + number(b.testsPerSecond) + "}";
+    }
+    json += "\n  ],\n";
+    json += "  \"coherence\": {\"triangles\": " + to_string(coherence.triangles);
+    json += ", \"spheres\": " + to_string(coherence.spheres);
+    json += ", \"width\": " + to_string(coherence.width) + ", \"height\": " + to_string(coherence.height);
+    json += ", \"sortedMs\": " + number(coherence.timing.sortedMs);
+    json += ", \"unsortedMs\": " + number(coherence.timing.unsortedMs);
+    json += ", \"materialSortMs\": " + number(coherence.timing.materialSortMs) + "}\n}\n";
+    return json;
+}
+
+int runMicrobenchmarks(const string &jsonFile){
+    bool table = jsonFile != "-";
+    if (table)
+        printf("kernel microbenchmarks, %s, flags %s\n", compilerName().c_str(), RAYTRACER_BUILD_FLAGS);
+
+    vector<kernelBenchmark> results = runKernelBenchmarks();
+    if (table)
+        for (const kernelBenchmark &b : results)
+            printf("%-18s %-9s %3.0f%% hits (%5.1f%% measured) %8.2f ns/test %9.2f Mtests/s\n", b.kernel.c_str(),
+                   b.rays == RAYS_COHERENT ? "coherent" : "random", 100 * b.hitRate, 100 * b.measuredHitRate,
+                   b.nsPerTest, b.testsPerSecond / 1e6);
+
+    coherenceBenchmarkResult coherence = runCoherenceBenchmark();
+    if (table)
+        printf("wavefront, %d triangles and %d mirror spheres at %dx%d: %.1f ms sorted, %.1f ms unsorted (%.2fx), "
+               "material sort %.3f ms in bands\n", coherence.triangles, coherence.spheres, coherence.width, coherence.height,
+               coherence.timing.sortedMs, coherence.timing.unsortedMs,
+               coherence.timing.unsortedMs / coherence.timing.sortedMs, coherence.timing.materialSortMs);
+
+    string json = kernelBenchmarkJSON(results, coherence);
+    if (!table){
+        fputs(json.c_str(), stdout);
+        return 0;
+    }
+    FILE *f = fopen(jsonFile.c_str(), "w");
+    bool written = f && fwrite(json.data(), 1, json.size(), f) == json.size();
+    if (f)
+        written = fclose(f) == 0 && written;
+    if (!written){
+        printf("can't write %s\n", jsonFile.c_str());
+        return 1;
+    }
+    printf("results written to %s\n", jsonFile.c_str());
+    return 0;
+}
@@ -0,0 +1,62 @@
+
+#pragma once
+#include <string>
+#include <vector>
+
+#include "raytracer.h"
+
+using namespace std;
+
+/*
+    microbenchmarks of the ray tracer's innermost kernels on their own, away from whole frames:
+    intersectSphere, intersectTriangle and intersectPlane against a single primitive, and shadeHit
+    (the shading half of intersect) on hits in a small lit scene
+
+    every kernel runs on coherent rays (one origin, swept across the primitive a row at a time, so
+    hits and misses come in runs) and on random ones (origins and directions all over), each at a
+    range of hit rates picked exactly from a larger set of candidate rays, so a change to a kernel
+    can be weighed on its hits and its misses separately
+
+    the wavefront tracer is also timed whole on a reflective scene, with and without sorting its
+    bounces for coherence, along with the material sort of its shading pass
+
+    a run only measures the build it is part of, the flags it was compiled with (name them with
+    -DRAYTRACER_BUILD_FLAGS="\"-O3 -march=native\"") and the instruction sets they allowed are
+    written with the results, so runs of differently built binaries can be put side by side
+*/
+
+enum rayDistribution{
+    RAYS_COHERENT,
+    RAYS_RANDOM
+};
+
+//one kernel at one hit rate over one kind of rays
+struct kernelBenchmark{
+    string kernel;
+    rayDistribution rays;
+    float hitRate;              //asked for
+    float measuredHitRate;      //what the kernel reported while it was timed
+    long long tests;            //in the fastest run
+    double nsPerTest, testsPerSecond;
+};
+
+//runs them all, each for a few tenths of a second
+vector<kernelBenchmark> runKernelBenchmarks();
+
+//coherenceBenchmark on a fixed scene of about 115,000 triangles and 15 mirror spheres
+struct coherenceBenchmarkResult{
+    int triangles, spheres;
+    int width, height;
+    coherenceTiming timing;
+};
+
+coherenceBenchmarkResult runCoherenceBenchmark();
+
+//the results as JSON, with the compiler and flags of this build
+string kernelBenchmarkJSON(const vector<kernelBenchmark> &results, const coherenceBenchmarkResult &coherence);
+
+/*
+    runs the benchmarks, prints a table of them and writes the JSON to jsonFile ("-" writes it to
+    standard output instead of the table), returns 0 or 1 if the file couldn't be written
+*/
+int runMicrobenchmarks(const string &jsonFile);
@@ -0,0 +1,100 @@
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <algorithm>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include "numa.h"
+
+using namespace std;
+
+#ifdef __linux__
+//reads a cpu list like "0-3,8-11" out of a sysfs file
+static vector<int> readCpuList(const char *filename){
+    vector<int> cpus;
+    FILE *f = fopen(filename, "r");
+    if (!f)
+        return cpus;
+
+    int lo, hi;
+    while (fscanf(f, "%d", &lo) == 1){
+        hi = lo;
+        int c = fgetc(f);
+        if (c == '-'){
+            if (fscanf(f, "%d", &hi) != 1)
+                break;
+            c = fgetc(f);
+        }
+        for (int cpu = lo; cpu <= hi; cpu++)
+            cpus.push_back(cpu);
+        if (c != ',')
+            break;
+    }
+    fclose(f);
+    return cpus;
+}
+#endif
+
+vector<numaNode> numaNodes(){
+    vector<numaNode> nodes;
+
+#ifdef __linux__
+    cpu_set_t allowed;
+    bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    if (DIR *dir = opendir("/sys/devices/system/node")){
+        while (dirent *d = readdir(dir)){
+            int id;
+            char extra;
+            if (sscanf(d->d_name, "node%d%c", &id, &extra) != 1)
+                continue;
+
+            char filename[96];
+            snprintf(filename, sizeof(filename), "/sys/devices/system/node/node%d/cpulist", id);
+            numaNode node;
+            node.id = id;
+            for (int cpu : readCpuList(filename))
+                if (!restricted || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+                    node.cpus.push_back(cpu);
+            if (!node.cpus.empty())
+                nodes.push_back(node);
+        }
+        closedir(dir);
+    }
+    sort(nodes.begin(), nodes.end(), [](const numaNode &a, const numaNode &b){ return a.id < b.id; });
+#endif
+
+    if (nodes.empty()){
+        numaNode all;
+        all.id = 0;
+        for (int cpu = 0; cpu < max(1, (int)thread::hardware_concurrency()); cpu++)
+            all.cpus.push_back(cpu);
+        nodes.push_back(all);
+    }
+    return nodes;
+}
+
+bool pinThread(int cpu){
+#ifdef __linux__
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    if (cpu < 0 || cpu >= 64)
+        return false;
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+    return false;
+#endif
+}
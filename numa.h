@@ -0,0 +1,20 @@
+
+#pragma once
+#include <vector>
+
+using namespace std;
+
+//a NUMA node and the logical cpus on it this process may run on
+struct numaNode{
+    int id;
+    vector<int> cpus;
+};
+
+/*
+    the machine's NUMA nodes that have cpus this process may use, in id order
+    where the system doesn't say (or isn't NUMA) it is a single node holding every cpu
+*/
+vector<numaNode> numaNodes();
+
+//keeps the calling thread on one logical cpu, false if it can't be done here
+bool pinThread(int cpu);
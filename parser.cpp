@@ -1,129 +1,404 @@
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <algorithm>
 #include <cstdio>
+#include <cmath>
 
 #include "parser.h"
+#include "bvh.h"
 
 using namespace std;
 
 //defining the constructor for the constructors
-lightSource::lightSource(vec3 pos, vec3 Cl, vec3 Ca):pos(pos),Cl(Cl),Ca(Ca){}
-sphere::sphere(vec3 center, float radius, vec3 Cr, vec3 Cp,float phong):center(center),radius(radius),Cr(Cr),Cp(Cp),phong(phong){}
-triangle::triangle(vec3 a, vec3 b, vec3 c, vec3 Cr, vec3 Cp, float phong):a(a),b(b),c(c),Cr(Cr),Cp(Cp),phong(phong){}
-plane::plane(vec3 n, vec3 q, vec3 Cr, vec3 Cp, float phong):n(n),q(q),Cr(Cr),Cp(Cp),phong(phong){}
+lightSource::lightSource(vec3 pos, vec3 Cl, vec3 Ca):pos(pos),Cl(Cl),Ca(Ca),shape(LIGHT_POINT),radius(0),u(0.f),v(0.f){}
+sphere::sphere(vec3 center, float radius, vec3 Cr, vec3 Cp,float phong):center(center),radius(radius),Cr(Cr),Cp(Cp),phong(phong),phongExp(-1),velocity(0.f),texture(-1){}
+triangle::triangle(vec3 a, vec3 b, vec3 c, vec3 Cr, vec3 Cp, float phong):a(a),b(b),c(c),Cr(Cr),Cp(Cp),phong(phong),phongExp(-1),
+    texture(-1),uvA(0.f,0.f),uvB(1.f,0.f),uvC(0.f,1.f){}
+plane::plane(vec3 n, vec3 q, vec3 Cr, vec3 Cp, float phong):n(n),q(q),Cr(Cr),Cp(Cp),phong(phong),phongExp(-1),texture(-1),textureScale(1.f){}
+
+vector<triangle> &triangleList::edit(){
+    if (list.use_count() > 1)
+        list = make_shared<vector<triangle> >(*list);
+    return *list;
+}
 
+void triangleList::unshare(){
+    list = make_shared<vector<triangle> >(*list);
+}
 
- 
+lightSource lightSource::sphereLight(vec3 center, float radius, vec3 Cl, vec3 Ca){
+    lightSource l(center, Cl, Ca);
+    l.shape = LIGHT_SPHERE;
+    l.radius = radius;
+    return l;
+}
 
-//fuction that extract the shapes in a scene file and store them into their respective vector of each shapes
-void parser::extractShapes(const char* filename){
-    ifstream f (filename);
+lightSource lightSource::quadLight(vec3 corner, vec3 u, vec3 v, vec3 Cl, vec3 Ca){
+    lightSource l(corner + 0.5f * (u + v), Cl, Ca);
+    l.shape = LIGHT_QUAD;
+    l.u = u;
+    l.v = v;
+    return l;
+}
 
-    const int BUFF_SIZE = 256; 
-    char buffer [BUFF_SIZE];
 
-    while(f){
-        f.getline(buffer, BUFF_SIZE);
+ 
 
-        string  line = string (buffer);
-        
-        //extract and store spheres
-        if (line.find("sphere") != string::npos && line.find("#") == string::npos){
-            float x,y,z;
-            float cr1, cr2, cr3;
-            float cp1, cp2, cp3;
-            float radius, phong;
-            
+/*
+    reads the lines of a scene file, keeping count of them for error messages
+    fields of a block are read from the next line that isn't blank or a comment, a field line that
+    doesn't parse is given back so it can start the next block if it is a keyword
+*/
+struct sceneReader{
+    sceneReader(const char *filename):f(filename),lineNumber(0),pending(false){}
+
+    ifstream f;
+    int lineNumber;
+    string line;
+    bool pending;
+
+    bool next(){
+        if (pending){
+            pending = false;
+            return true;
+        }
+        if (!getline(f, line))
+            return false;
+        lineNumber++;
+        return true;
+    }
 
-             //code for actually reading/storing the parameters 
-            f.getline(buffer, BUFF_SIZE);                       //get the next line after reading "sphere"  
-            sscanf(buffer, "%f %f %f\n", &x, &y, &z);           //read and store the center of the sphere into x y and z
+    void unread(){ pending = true; }
 
-            f.getline(buffer, BUFF_SIZE);                       //increment line again for radius
-            sscanf(buffer, "%f\n", &radius);                    //read and store the raidius into r
+    bool nextField(){
+        while (next()){
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first != string::npos && line[first] != '#')
+                return true;
+        }
+        return false;
+    }
 
-            f.getline(buffer, BUFF_SIZE);                       
-            sscanf(buffer, "%f %f %f\n", &cr1, &cr2, &cr3);     //extract diffuse
+    //a field line has to hold exactly the numbers asked for, so a missing line can't shift the rest;
+    //one that doesn't leaves the value as it was for whatever reads the line next
+    bool readVector(vec3 &v){
+        vec3 read;
+        float extra;
+        if (!nextField())
+            return false;
+        if (sscanf(line.c_str(), "%f %f %f %f", &read.x, &read.y, &read.z, &extra) == 3){
+            v = read;
+            return true;
+        }
+        unread();
+        return false;
+    }
 
-            f.getline(buffer, BUFF_SIZE);                       
-            sscanf(buffer, "%f %f %f\n", &cp1, &cp2, &cp3);     //extract the specular
+    bool readFloat(float &x){
+        float read, extra;
+        if (!nextField())
+            return false;
+        if (sscanf(line.c_str(), "%f %f", &read, &extra) == 1){
+            x = read;
+            return true;
+        }
+        unread();
+        return false;
+    }
 
-            f.getline(buffer, BUFF_SIZE);                       
-            sscanf(buffer, "%f\n", &phong);                     //extract phong
-            
-            //int reflectMode = 0;
-            //f.getline(buffer, BUFF_SIZE);                       
-            //sscanf(buffer, "%d\n", &reflectMode);               //extract phong
+    bool readPair(vec2 &v){
+        vec2 read;
+        float extra;
+        if (!nextField())
+            return false;
+        if (sscanf(line.c_str(), "%f %f %f", &read.x, &read.y, &extra) == 2){
+            v = read;
+            return true;
+        }
+        unread();
+        return false;
+    }
+};
 
-          //  printf("sph: (%f,%f,%f) || (%f, %f, %f) \n", , Cr.y, sph.Cr.y, sph.Cp.x, sph.Cp.y, sph.Cp.z);
+static string directoryOf(const string &filename){
+    size_t slash = filename.find_last_of("/\\");
+    return slash == string::npos ? "" : filename.substr(0, slash + 1);
+}
 
-            //create a sphere and store it into the vectors of spheres
-            sphere s = sphere(vec3(x,y,z), radius, vec3(cr1, cr2,cr3), vec3(cp1,cp2,cp3), phong);
-            spheres.push_back(s);
+//fuction that extract the shapes in a scene file and store them into their respective vector of each shapes
+void parser::extractShapes(const char* filename){
+    sceneReader f (filename);
+    if (!f.f)
+        printf("Could not open scene file %s\n", filename);
+
+    //the primitive the last block added, the one a texture line applies to
+    enum { NONE, SPHERE, TRIANGLE, PLANE } last = NONE;
+
+    while(f.next()){
+        string line = f.line;
+        int blockLine = f.lineNumber;
+        const char *missing = 0;
+
+        /*
+            "texture <image>" maps an image onto the primitive just before it, a triangle can give the
+            texture coordinates of its vertices on the next three lines and a plane how many units one
+            repeat of the image covers on the next one; checked first since the file name could hold any keyword
+        */
+        size_t keyword = line.find("texture");
+        if (keyword != string::npos && line.find("#") == string::npos){
+            size_t first = line.find_first_not_of(" \t\r", keyword + 7);
+            size_t end = line.find_last_not_of(" \t\r");
+            if (first == string::npos)
+                missing = "image file";
+            else if (last == NONE){
+                printf("%s:%d: texture doesn't follow a sphere, triangle or plane, skipped\n", filename, blockLine);
+                stats.malformed++;
+            }
+            else {
+                string image = directoryOf(filename) + line.substr(first, end + 1 - first);
+                int texture = (int)(find(textureFiles.begin(), textureFiles.end(), image) - textureFiles.begin());
+                if (texture == (int)textureFiles.size())
+                    textureFiles.push_back(image);
+
+                if (last == SPHERE)
+                    spheres.back().texture = texture;
+                else if (last == TRIANGLE){
+                    triangle &t = triangles.edit().back();
+                    t.texture = texture;
+                    vec2 uv[3];
+                    if (f.readPair(uv[0])){
+                        if (!f.readPair(uv[1]) || !f.readPair(uv[2]))
+                            missing = "texture coordinates";
+                        else {
+                            t.uvA = uv[0];
+                            t.uvB = uv[1];
+                            t.uvC = uv[2];
+                        }
+                    }
+                }
+                else {
+                    plane &pl = planes.back();
+                    pl.texture = texture;
+                    f.readFloat(pl.textureScale);
+                }
+            }
+            last = NONE;
+        }
 
+        //then lights, "light sphere" names an area light, not a sphere
+        else if (line.find("light") != string::npos && line.find("#") == string::npos){
+            vec3 pos, u, v, Cl, Ca;
+            float radius;
+
+            if (line.find("sphere") != string::npos){
+                if (!f.readVector(pos))         missing = "center";
+                else if (!f.readFloat(radius))  missing = "radius";
+                else if (!f.readVector(Cl))     missing = "colour";
+                else if (!f.readVector(Ca))     missing = "ambient colour";
+                else
+                    lightSources.push_back(lightSource::sphereLight(pos, radius, Cl, Ca));
+            }
+            else if (line.find("quad") != string::npos){
+                if (!f.readVector(pos))         missing = "corner";
+                else if (!f.readVector(u) || !f.readVector(v))
+                    missing = "edges";
+                else if (!f.readVector(Cl))     missing = "colour";
+                else if (!f.readVector(Ca))     missing = "ambient colour";
+                else
+                    lightSources.push_back(lightSource::quadLight(pos, u, v, Cl, Ca));
+            }
+            else if (!f.readVector(pos))        missing = "position";
+            else if (!f.readVector(Cl))         missing = "colour";
+            else if (!f.readVector(Ca))         missing = "ambient colour";
+            else
+                lightSources.push_back(lightSource(pos, Cl, Ca));
+            last = NONE;
         }
 
-        //extract and store triangles
-        else if (line.find("triangle") != string::npos && line.find("#") == string::npos){
-            
-            float x,y,z;
-            vector<vec3> t;
-
-            for (int i = 0; i < 5 ; i++){
-                f.getline(buffer, BUFF_SIZE);
-                sscanf(buffer, "%f %f %f\n", &x, &y, &z);
-                t.push_back(vec3(x,y,z));
-                
-               
+        //extract and store spheres, "sphere moving" has its velocity after the phong exponent
+        else if (line.find("sphere") != string::npos && line.find("#") == string::npos){
+            vec3 center, Cr, Cp, velocity(0.f);
+            float radius, phong;
+            bool moving = line.find("moving") != string::npos;
+
+            if (!f.readVector(center))          missing = "center";
+            else if (!f.readFloat(radius))      missing = "radius";
+            else if (!f.readVector(Cr))         missing = "diffuse colour";
+            else if (!f.readVector(Cp))         missing = "specular colour";
+            else if (!f.readFloat(phong))       missing = "phong exponent";
+            else if (moving && !f.readVector(velocity))
+                missing = "velocity";
+            else {
+                spheres.push_back(sphere(center, radius, Cr, Cp, phong));
+                spheres.back().velocity = velocity;
             }
+            last = missing ? NONE : SPHERE;
+        }
 
+        //extract and store triangles
+        else if (line.find("triangle") != string::npos && line.find("#") == string::npos){
+            vec3 a, b, c, Cr, Cp;
             float phong;
-            f.getline(buffer, BUFF_SIZE);
-            sscanf(buffer, "%f\n", &phong);
-               
 
-            triangles.push_back(triangle(t[0], t[1], t[2], t[3], t[4], phong));
+            if (!f.readVector(a) || !f.readVector(b) || !f.readVector(c))
+                missing = "vertices";
+            else if (!f.readVector(Cr))         missing = "diffuse colour";
+            else if (!f.readVector(Cp))         missing = "specular colour";
+            else if (!f.readFloat(phong))       missing = "phong exponent";
+            else
+                triangles.push_back(triangle(a, b, c, Cr, Cp, phong));
+            last = missing ? NONE : TRIANGLE;
         }
 
         //extract planes
         else if (line.find("plane") != string::npos && line.find("#") == string::npos){
-            float x,y,z;
-            vector<vec3> pl;
-
-            for (int i = 0; i < 4 ; i++){
-                f.getline(buffer, BUFF_SIZE);
-                sscanf(buffer, "%f %f %f\n", &x, &y, &z);
-                pl.push_back(vec3(x,y,z));
-
-            }
-          
+            vec3 n, q, Cr, Cp;
             float phong;
-            f.getline(buffer, BUFF_SIZE);
-            sscanf(buffer, "%f\n", &phong);               
 
-            planes.push_back(plane(pl[0], pl[1], pl[2], pl[3], phong));
+            if (!f.readVector(n))               missing = "normal";
+            else if (!f.readVector(q))          missing = "point";
+            else if (!f.readVector(Cr))         missing = "diffuse colour";
+            else if (!f.readVector(Cp))         missing = "specular colour";
+            else if (!f.readFloat(phong))       missing = "phong exponent";
+            else
+                planes.push_back(plane(n, q, Cr, Cp, phong));
+            last = missing ? NONE : PLANE;
         }
 
-        //extract light
-        else if (line.find("light") != string::npos && line.find("#") == string::npos){
-            
-            float x,y,z;
-            vector<vec3> li;
-          
-            for (int i = 0; i < 3 ; i++){
-                f.getline(buffer, BUFF_SIZE);
-                sscanf(buffer, "%f %f %f\n", &x, &y, &z);
-                li.push_back(vec3(x,y,z));
-            }
-           
-                
-           lightSources.push_back(lightSource(li[0], li[1], li[2]));
-
+        if (missing){
+            printf("%s:%d: %s is missing its %s, skipped\n", filename, blockLine, line.c_str(), missing);
+            stats.malformed++;
         }
+    }
+}
+
+int phongExponent(float phong){
+    if (phong >= 0 && phong <= 1024 && phong == floor(phong))
+        return (int)phong;
+    return -1;
+}
+
+sceneStats::sceneStats()
+    :malformed(0),droppedSpheres(0),droppedTriangles(0),droppedPlanes(0),droppedLights(0),addedLight(false),
+     lo(vec3(1e30f)),hi(vec3(-1e30f)){
+    for (int i = 0; i < sizeBuckets; i++)
+        triangleSizes[i] = sphereSizes[i] = 0;
+}
+
+static bool finite(vec3 v){
+    return std::isfinite(v.x) && std::isfinite(v.y) && std::isfinite(v.z);
+}
 
+static bool finite(vec2 v){
+    return std::isfinite(v.x) && std::isfinite(v.y);
+}
+
+static int sizeBucket(float size){
+    int bucket = (int)floor(log2(size)) + sceneStats::sizeBias;
+    return std::min(std::max(bucket, 0), sceneStats::sizeBuckets - 1);
+}
+
+//removes the elements of v that keep rejects, returning how many went
+template <class T, class Reject>
+static int dropIf(vector<T> &v, Reject rejects){
+    size_t before = v.size();
+    v.erase(remove_if(v.begin(), v.end(), rejects), v.end());
+    return (int)(before - v.size());
+}
+
+//normalizes the normals once and caches the specular exponents so shading never has to
+void parser::compile(){
+    int malformed = stats.malformed;
+    stats = sceneStats();
+    stats.malformed = malformed;
+
+    stats.droppedSpheres = dropIf(spheres, [](const sphere &s){
+        return !finite(s.center) || !(s.radius > 0) || !std::isfinite(s.radius)
+            || !finite(s.Cr) || !finite(s.Cp) || !std::isfinite(s.phong) || !finite(s.velocity);
+    });
+
+    //zero area, or so thin that the normal is all rounding
+    stats.droppedTriangles = dropIf(triangles.edit(), [](const triangle &t){
+        vec3 u = t.b - t.a, v = t.c - t.a;
+        vec3 n = cross(u, v);
+        return !finite(t.a) || !finite(t.b) || !finite(t.c) || !finite(n)
+            || !(dot(n, n) > 1e-14f * dot(u, u) * dot(v, v))
+            || !finite(t.Cr) || !finite(t.Cp) || !std::isfinite(t.phong)
+            || !finite(t.uvA) || !finite(t.uvB) || !finite(t.uvC);
+    });
+
+    stats.droppedPlanes = dropIf(planes, [](const plane &p){
+        return !finite(p.n) || !(dot(p.n, p.n) > 0) || !finite(p.q)
+            || !finite(p.Cr) || !finite(p.Cp) || !std::isfinite(p.phong)
+            || !(p.textureScale > 0) || !std::isfinite(p.textureScale);
+    });
+
+    stats.droppedLights = dropIf(lightSources, [](const lightSource &l){
+        return !finite(l.pos) || !finite(l.Cl) || !finite(l.Ca)
+            || (l.shape == LIGHT_SPHERE && !(l.radius > 0 && std::isfinite(l.radius)))
+            || (l.shape == LIGHT_QUAD && !(finite(l.u) && finite(l.v) && dot(cross(l.u, l.v), cross(l.u, l.v)) > 0));
+    });
+
+    //shading always reads the first light, without one everything is simply unlit
+    if (lightSources.empty()){
+        lightSources.push_back(lightSource(vec3(0,0,0), vec3(0,0,0), vec3(0,0,0)));
+        stats.addedLight = true;
+    }
+
+    for (sphere &sph : spheres){
+        sph.phongExp = phongExponent(sph.phong);
+        stats.lo = min(stats.lo, sph.center - vec3(sph.radius));
+        stats.hi = max(stats.hi, sph.center + vec3(sph.radius));
+        stats.sphereSizes[sizeBucket(sph.radius)]++;
+    }
+
+    for (triangle &tri : triangles.edit()){
+        tri.n = normalize(cross(tri.b - tri.a, tri.c - tri.a));
+        tri.phongExp = phongExponent(tri.phong);
+        stats.lo = min(stats.lo, min(tri.a, min(tri.b, tri.c)));
+        stats.hi = max(stats.hi, max(tri.a, max(tri.b, tri.c)));
+        float edge = std::max(length(tri.b - tri.a), std::max(length(tri.c - tri.b), length(tri.a - tri.c)));
+        stats.triangleSizes[sizeBucket(edge)]++;
+    }
+
+    //intersectPlane is scale invariant in n so it is safe to normalize in place
+    for (plane &pln : planes){
+        pln.n = normalize(pln.n);
+        pln.phongExp = phongExponent(pln.phong);
     }
 
-     
+    int dropped = stats.droppedSpheres + stats.droppedTriangles + stats.droppedPlanes + stats.droppedLights;
+    if (dropped > 0)
+        printf("Dropped %d degenerate or non-finite primitives (%d spheres, %d triangles, %d planes, %d lights)\n",
+               dropped, stats.droppedSpheres, stats.droppedTriangles, stats.droppedPlanes, stats.droppedLights);
+    if (stats.addedLight)
+        printf("Scene has no light, it will render unlit\n");
+
+    buildBVH(*this, BVH_BINARY, false);
+}
+
+//prints a size histogram on one line, skipping the empty buckets
+static void printSizes(const char *name, const int *buckets){
+    printf("  %s sizes:", name);
+    for (int i = 0; i < sceneStats::sizeBuckets; i++)
+        if (buckets[i])
+            printf(" 2^%d:%d", i - sceneStats::sizeBias, buckets[i]);
+    printf("\n");
+}
+
+void parser::printStats() const {
+    printf("Scene: %d triangles, %d spheres, %d planes, %d lights\n",
+           (int)triangles.size(), (int)spheres.size(), (int)planes.size(), (int)lightSources.size());
+    if (stats.lo.x <= stats.hi.x)
+        printf("  bounds (%g, %g, %g) to (%g, %g, %g)\n",
+               stats.lo.x, stats.lo.y, stats.lo.z, stats.hi.x, stats.hi.y, stats.hi.z);
+    if (!triangles.empty())
+        printSizes("triangle", stats.triangleSizes);
+    if (!spheres.empty())
+        printSizes("sphere", stats.sphereSizes);
+    if (stats.malformed)
+        printf("  %d malformed blocks skipped\n", stats.malformed);
 }
 
 void extractSphere(){
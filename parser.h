@@ -1,6 +1,8 @@
 
 #pragma once
 #include <vector>
+#include <string>
+#include <memory>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -8,9 +10,26 @@
 using namespace glm;
 using namespace std;
 
+class geometryPages;
+class triangleBVH;
+class textureCache;
+
+enum lightShape{
+    LIGHT_POINT,
+    LIGHT_SPHERE,       //radius around pos
+    LIGHT_QUAD          //parallelogram centred on pos with edges u and v
+};
+
 struct lightSource{
     lightSource(vec3 pos, vec3 Cl, vec3 Ca);
-    vec3 pos, Cl, Ca;
+    static lightSource sphereLight(vec3 center, float radius, vec3 Cl, vec3 Ca);
+    static lightSource quadLight(vec3 corner, vec3 u, vec3 v, vec3 Cl, vec3 Ca);
+
+    vec3 pos, Cl, Ca;   //pos is the centre of an area light, shading takes its direction from there
+
+    lightShape shape;
+    float radius;
+    vec3 u, v;
 };
 struct sphere{
     sphere(vec3 center, float radius, vec3 Cr, vec3 Cp,float phong);
@@ -20,6 +39,9 @@ struct sphere{
     float phong; 
     int relfectMode;
 
+    int phongExp;       //phong as an integer exponent, -1 if it isn't one (set by compile)
+    vec3 velocity;      //how far it moves over a unit of shutter time, only motion blur looks at it
+    int texture;        //index into parser::textureFiles, -1 for none; mapped by latitude and longitude
 };
 
 struct triangle{
@@ -31,6 +53,40 @@ struct triangle{
     vec3 Cr, Cp;
     float phong; 
     int relfectMode;
+
+    vec3 n;             //unit face normal (set by compile)
+    int phongExp;
+
+    int texture;        //index into parser::textureFiles, -1 for none
+    vec2 uvA, uvB, uvC; //texture coordinates of the vertices
+};
+
+/*
+    a scene's triangles, which copies of a parser share rather than copy: anything that changes them
+    goes through edit(), which first gives this copy a list of its own if another still holds the same one
+ */
+class triangleList{
+public:
+    triangleList() : list(make_shared<vector<triangle> >()) {}
+
+    size_t size() const { return list->size(); }
+    bool empty() const { return list->empty(); }
+    const triangle &operator[](size_t i) const { return (*list)[i]; }
+    vector<triangle>::const_iterator begin() const { return list->begin(); }
+    vector<triangle>::const_iterator end() const { return list->end(); }
+    operator const vector<triangle> &() const { return *list; }
+
+    vector<triangle> &edit();
+    void push_back(const triangle &t) { edit().push_back(t); }
+
+    //drops this copy's hold on them, freeing them if no other copy has them
+    void clear() { list = make_shared<vector<triangle> >(); }
+
+    //gives this copy a list of its own even if nothing is going to change it, so it can be placed apart
+    void unshare();
+
+private:
+    shared_ptr<vector<triangle> > list;
 };
 
 struct plane{
@@ -42,18 +98,80 @@ struct plane{
     vec3 Cr, Cp;
     float phong; 
     int relfectMode;
+
+    int phongExp;
+
+    int texture;        //index into parser::textureFiles, -1 for none
+    float textureScale; //world units one repeat of the texture covers
 };
 
+//phong as an exponent usable by repeated squaring, or -1 if it needs pow()
+int phongExponent(float phong);
+
+//what loading a scene found in it, and what it had to leave out
+struct sceneStats{
+    sceneStats();
+
+    //primitive sizes (triangle longest edge, sphere radius) are counted in powers of two,
+    //bucket i holds sizes in [2^(i - sizeBias), 2^(i - sizeBias + 1)), clamped at both ends
+    static const int sizeBuckets = 16;
+    static const int sizeBias = 8;
+
+    int malformed;          //blocks extractShapes couldn't read and skipped
+    int droppedSpheres, droppedTriangles, droppedPlanes, droppedLights;
+    bool addedLight;        //there was no light, so compile put in an unlit one
+
+    vec3 lo, hi;            //bounds of the spheres and triangles (planes have none)
+    int triangleSizes[sizeBuckets];
+    int sphereSizes[sizeBuckets];
+};
 
 class parser{
     
 
 public:
     vector<sphere> spheres;
-    vector<triangle> triangles;
+    triangleList triangles;
     vector<plane> planes;
     vector<lightSource> lightSources;
     void extractShapes(const char*);
+
+    /*
+        validates the scene and precomputes per-primitive shading constants, call once after extractShapes
+        primitives that are degenerate or not finite are dropped, and a scene without a light gets
+        an unlit one, so the tracer never has to check for any of that per ray
+    */
+    void compile();
+
+    //filled in by extractShapes and compile
+    sceneStats stats;
+
+    //prints the primitive counts, bounds and size histograms, and what was dropped
+    void printStats() const;
+
+    //acceleration structure over the triangles, shared by copies (set by compile)
+    shared_ptr<const triangleBVH> bvh;
+
+    //when set the triangles live in these pages instead of the triangles (not owned)
+    geometryPages *trianglePages = 0;
+
+    //most shadow rays a hit may cast at an area light, rounded down to a square number of strata
+    int shadowSamples = 16;
+
+    //the images primitives are textured with, paths relative to the scene file already resolved
+    vector<string> textureFiles;
+
+    //where the textures are sampled from and the cache's id for each of textureFiles, -1 for those that
+    //couldn't be read (set by attachTextures, not owned); without it everything keeps its plain colour
+    textureCache *textures = 0;
+    vector<int> textureIds;
+
+    //angle between the rays of neighbouring pixels, how much of a texture a pixel covers picks its mip level
+    float pixelAngle = 0.002f;
+
+    //the wavefront tracer sorts each bounce's rays by origin and direction (sortCoherent) before tracing it;
+    //off unless asked for, it has yet to measure faster than tracing them in the order they were shaded
+    bool sortBounces = false;
  
 
 
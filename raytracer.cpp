@@ -0,0 +1,2053 @@
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <math.h>
+
+#include "raytracer.h"
+#include "imagebuffer.h"
+#include "geometrypages.h"
+#include "bvh.h"
+#include "arena.h"
+#include "texturecache.h"
+
+#define PI 3.14
+
+using namespace std;
+using namespace glm;
+
+
+vector<vec3> generateRay(float viewAngle, float displaySizeX, float displaySizeY){
+
+	vector<vec3> rays;
+
+	viewAngle *= (PI/180.f);
+
+	//finding the z value and setting up the base vector
+	float z = displaySizeX/(2* tan(viewAngle/2));
+	vec3 tl = vec3 ((-displaySizeX/2)+0.5f,
+					(-displaySizeY/2)+0.5f,
+					-z
+				);
+
+
+	//calculate for the rays the goes through each pixel
+	for (int i = 0; i < displaySizeX;i++){
+		for (int j = 0; j< displaySizeY; j++){
+			vec3 rayDirection =  tl + vec3(i,j,0);
+			rayDirection = normalize(rayDirection);
+			rays.push_back(rayDirection);
+		}
+	}
+
+
+	return rays;
+}
+
+/*
+	precision policy: the intersection tests run in float and check how well conditioned their
+	inputs were, the few rays where float would have cancelled away most of the answer are worked
+	out again in double
+	with fewer than conditionBits significant bits left a result is refined
+ */
+const int conditionBits = 12;
+const float illConditioned = 1.f / (1 << conditionBits);
+
+/*
+triangle contains a, b, and c where u = b-a and v = c-a
+returns r,s,t value for
+		a + ru + sv = p + dt
+in that order
+solved by cramer's rule, in double when the ray runs nearly along the triangle's plane
+(the determinant is then a small difference of big terms)
+*/
+vec3 intersectTriangle(vec3 d, vec3 p, const triangle &t){
+	vec3 u = t.b-t.a;
+	vec3 v = t.c-t.a;
+	vec3 ap = t.a - p;
+
+	vec3 uv = cross(u, v);
+	float det = dot(d, uv);
+	if (det * det > illConditioned * illConditioned * dot(d, d) * dot(uv, uv)){
+		float inv = 1.f / det;
+		return vec3(dot(ap, uv), -dot(d, cross(ap, v)), -dot(d, cross(u, ap))) * inv;
+	}
+
+	dvec3 dd = dvec3(d), du = dvec3(t.b) - dvec3(t.a), dv = dvec3(t.c) - dvec3(t.a);
+	dvec3 dap = dvec3(t.a) - dvec3(p);
+	dvec3 duv = cross(du, dv);
+	double ddet = dot(dd, duv);
+	if (ddet == 0)
+		return vec3(-1, -1, -1);
+	return vec3(dvec3(dot(dap, duv), -dot(dd, cross(dap, dv)), -dot(dd, cross(du, dap))) / ddet);
+}
+
+/*
+	the two roots along direction of a sphere, in double
+	returns false if the ray misses it
+ */
+bool sphereRootsExact(vec3 direction, vec3 center, vec3 oPoint, float radius, float &t0, float &t1){
+	dvec3 d = dvec3(direction);
+	dvec3 oc = dvec3(oPoint) - dvec3(center);
+	double a = dot(d, d);
+	double b = 2 * dot(oc, d);
+	double c = dot(oc, oc) - (double)radius * radius;
+	double discriminant = b*b - 4*a*c;
+	if (discriminant < 0 || a == 0)
+		return false;
+	t0 = (float)((-b - sqrt(discriminant)) / (2*a));
+	t1 = (float)((-b + sqrt(discriminant)) / (2*a));
+	return true;
+}
+
+/*
+	whether the float discriminant of a sphere test can be trusted, hit or miss: for spheres
+	that are small next to their distance, or rays that only graze them, it is the difference
+	of two nearly equal squares and most of its bits are rounding
+ */
+inline bool sphereWellConditioned(float b, float discriminant){
+	return fabs(discriminant) > illConditioned * b * b;
+}
+
+float intersectSphere(vec3 direction, vec3 center, vec3 oPoint, float radius){
+
+	float a = dot(direction, direction);
+	float b = 2* dot(oPoint - center, direction);
+	float c = dot (oPoint - center, oPoint - center);
+	c -= pow(radius,2);
+
+	if (!sphereWellConditioned(b, pow(b,2) - (4*a*c))){
+		float t0, t1;
+		return sphereRootsExact(direction, center, oPoint, radius, t0, t1) ? t0 : delimitor;
+	}
+
+	if (pow(b,2) - (4*a*c) < 0 || a == 0)
+		return delimitor;
+
+	float t = (-b - sqrt(pow(b,2) - (4*a*c))) / (2*a);
+
+	return t;
+}
+
+/*
+	the far side of a sphere for a ray leaving from a point on it: the root of the two
+	furthest from the start is the real one, the other is the surface the ray leaves
+	delimitor if the ray heads away from the sphere
+ */
+float intersectSphereFrom(vec3 direction, vec3 center, vec3 oPoint, float radius){
+
+	float a = dot(direction, direction);
+	float b = 2* dot(oPoint - center, direction);
+	float c = dot (oPoint - center, oPoint - center);
+	c -= radius*radius;
+
+	float discriminant = b*b - (4*a*c);
+	float t0, t1;
+	if (!sphereWellConditioned(b, discriminant)){
+		if (!sphereRootsExact(direction, center, oPoint, radius, t0, t1))
+			return delimitor;
+	}
+	else {
+		if (discriminant < 0 || a == 0)
+			return delimitor;
+		t0 = (-b - sqrt(discriminant)) / (2*a);
+		t1 = (-b + sqrt(discriminant)) / (2*a);
+	}
+	float t = (fabs(t0) > fabs(t1)) ? t0 : t1;
+
+	return (t > 0) ? t : delimitor;
+}
+
+float intersectPlane(vec3 d, vec3 q, vec3 oPoint, vec3 n){
+
+	//if (dot(d,n) > 0)
+	//	return delimitor;
+
+	float t = dot(q-oPoint, n);
+	t /= dot(d,n);
+
+	return t;
+
+}
+
+
+/*
+	after "A Fast and Robust Method for Avoiding Self-Intersection" (Waechter and Binder):
+	away from zero p is moved a fixed number of units in the last place, which scales with p,
+	close to zero where those get tiny it is moved a small fixed distance instead
+ */
+vec3 offsetOrigin(vec3 p, vec3 n){
+	const float nearZero = 1.f / 32.f;
+	const float floatScale = 1.f / 65536.f;
+	const float intScale = 256.f;
+
+	vec3 result;
+	for (int axis = 0; axis < 3; axis++){
+		int offset = (int)(intScale * n[axis]);
+		int bits;
+		memcpy(&bits, &p[axis], sizeof(bits));
+		bits += (p[axis] < 0) ? -offset : offset;
+		float moved;
+		memcpy(&moved, &bits, sizeof(moved));
+		result[axis] = (fabs(p[axis]) < nearZero) ? p[axis] + floatScale * n[axis] : moved;
+	}
+	return result;
+}
+
+//number of triangles in the scene, wherever they are kept
+int triangleCount(const parser &p){
+	return p.trianglePages ? p.trianglePages->triangleCount() : (int)p.triangles.size();
+}
+
+//a triangle by id, paged in if need be
+triangle triangleAt(const parser &p, int id){
+	return p.trianglePages ? p.trianglePages->get(id) : p.triangles[id];
+}
+
+//the triangle id a ray leaving from must skip, -1 if it didn't leave from a triangle
+int excludedTriangle(primitiveRef from){
+	return (from.type == HIT_TRIANGLE) ? from.id : -1;
+}
+
+//whether anything in tris (ids starting at firstId) blocks the ray between dt and maxT
+bool trianglesOcclude(const vector<triangle> &tris, int firstId, vec3 ray, vec3 dt, float maxT, int exclude){
+	for (int i = 0; i < (int)tris.size(); i++){
+		if (firstId + i == exclude)
+			continue;
+		vec3 v = intersectTriangle(ray, dt, tris[i]);
+		if (v[0] < maxT && v[0] > 0 && v[1] >= 0 && v[2] >= 0 && (v[1]+v[2] <= 1))
+			return true;
+	}
+	return false;
+}
+
+//same for the triangles of a page, through the page's own hierarchy (exclude is a file-wide id)
+bool pageOccludes(geometryPages &pages, int pg, vec3 ray, vec3 dt, float maxT, int exclude){
+	int base = pg * geometryPages::trianglesPerPage;
+	const vector<triangle> &tris = pages.page(pg);
+	return pages.pageHierarchy(pg).occluded(ray, dt, maxT, tris, exclude - base);
+}
+
+//same for the scene's triangles wherever they are kept
+bool sceneTrianglesOcclude(const parser &p, vec3 ray, vec3 dt, float maxT, int exclude){
+	if (p.trianglePages){
+		//only pages whose bounds the shadow ray crosses get loaded
+		geometryPages &pages = *p.trianglePages;
+		bool blocked = false;
+		pages.pagesAlong(ray, dt, maxT, [&](int pg){
+			blocked = pageOccludes(pages, pg, ray, dt, maxT, exclude);
+			return blocked;
+		});
+		return blocked;
+	}
+	if (p.bvh)
+		return p.bvh->occluded(ray, dt, maxT, p.triangles, exclude);
+	return trianglesOcclude(p.triangles, 0, ray, dt, maxT, exclude);
+}
+
+//a sphere can still shadow its own far side
+bool spheresOcclude(const parser &p, vec3 ray, vec3 dt, float maxT, primitiveRef from){
+	for (int i = 0; i < (int)p.spheres.size(); i++){
+		const sphere &sph = p.spheres[i];
+		float f = (from.type == HIT_SPHERE && from.id == i)
+				? intersectSphereFrom(ray, sph.center, dt, sph.radius)
+				: intersectSphere(ray, sph.center, dt, sph.radius);
+		if (f < maxT && f > 0)
+			return true;
+	}
+	return false;
+}
+
+//but a plane can't block a ray leaving it
+bool planesOcclude(const parser &p, vec3 ray, vec3 dt, float maxT, primitiveRef from){
+	for (int i = 0; i < (int)p.planes.size(); i++){
+		if (from.type == HIT_PLANE && from.id == i)
+			continue;
+		const plane &pln = p.planes[i];
+		float f = intersectPlane(ray, pln.q, dt, pln.n);
+		if (f < maxT && f > 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+	shadow ray kernel for scenes with the primitive kinds in features (a sceneFeature mask),
+	whether anything blocks the way from dt to target (a point on the light)
+	the tests for the others compile away
+ */
+template <unsigned int features>
+bool shadowKernel(vec3 dt, vec3 target, const parser &p, primitiveRef from){
+	float maxT = std::min(length(target - dt), delimitor);
+
+
+	vec3 ray = normalize(target - dt);
+
+	if ((features & SCENE_TRIANGLES) && sceneTrianglesOcclude(p, ray, dt, maxT, excludedTriangle(from)))
+		return true;
+	if ((features & SCENE_SPHERES) && spheresOcclude(p, ray, dt, maxT, from))
+		return true;
+	return (features & SCENE_PLANES) && planesOcclude(p, ray, dt, maxT, from);
+}
+
+bool shadow(vec3 dt, const parser &p, primitiveRef from){
+	return shadowKernel<SCENE_ALL>(dt, p.lightSources[0].pos, p, from);
+}
+
+// --------------------------------------------------------------------------
+// Soft shadows from area lights
+
+/*
+	16x16 blue noise threshold mask, made by void and cluster: every value in [0,1) is in it once
+	and pixels close together get values far apart
+ */
+struct blueNoiseMask{
+	static const int Size = 16;
+	float value[Size * Size];
+	blueNoiseMask();
+};
+
+blueNoiseMask::blueNoiseMask(){
+	const int n = Size * Size;
+	const float sigma = 1.5f;
+
+	//gaussian energy a point adds at each (wrapped around) offset from it
+	float energyAt[Size][Size];
+	for (int dx = 0; dx < Size; dx++)
+		for (int dy = 0; dy < Size; dy++){
+			float x = (float)std::min(dx, Size - dx), y = (float)std::min(dy, Size - dy);
+			energyAt[dx][dy] = exp(-(x*x + y*y) / (2 * sigma * sigma));
+		}
+
+	vector<char> on(n, 0);
+	vector<float> energy(n, 0.f);
+	auto toggle = [&](int i, bool set){
+		on[i] = set;
+		float sign = set ? 1.f : -1.f;
+		for (int j = 0; j < n; j++)
+			energy[j] += sign * energyAt[abs(j % Size - i % Size)][abs(j / Size - i / Size)];
+	};
+	//the point with the most energy and the empty pixel with the least
+	auto tightestCluster = [&](){
+		int best = -1;
+		for (int i = 0; i < n; i++)
+			if (on[i] && (best < 0 || energy[i] > energy[best]))
+				best = i;
+		return best;
+	};
+	auto largestVoid = [&](){
+		int best = -1;
+		for (int i = 0; i < n; i++)
+			if (!on[i] && (best < 0 || energy[i] < energy[best]))
+				best = i;
+		return best;
+	};
+
+	//a tenth of the pixels at random, spread out by moving the tightest cluster into the largest void
+	//until that is where it already is
+	int initial = n / 10;
+	unsigned int seed = 1;
+	for (int placed = 0; placed < initial; ){
+		seed = seed * 1664525u + 1013904223u;
+		int i = (seed >> 8) % n;
+		if (!on[i]){
+			toggle(i, true);
+			placed++;
+		}
+	}
+	for (int moves = 0; moves < 4 * n; moves++){
+		int cluster = tightestCluster();
+		toggle(cluster, false);
+		int hole = largestVoid();
+		toggle(hole, true);
+		if (hole == cluster)
+			break;
+	}
+
+	//rank the initial points by taking the tightest clusters out, then fill the voids in order
+	vector<char> initialOn = on;
+	vector<float> initialEnergy = energy;
+	vector<int> rank(n);
+	for (int r = initial - 1; r >= 0; r--){
+		int cluster = tightestCluster();
+		rank[cluster] = r;
+		toggle(cluster, false);
+	}
+	on = initialOn;
+	energy = initialEnergy;
+	for (int r = initial; r < n; r++){
+		int hole = largestVoid();
+		rank[hole] = r;
+		toggle(hole, true);
+	}
+
+	for (int i = 0; i < n; i++)
+		value[i] = (rank[i] + 0.5f) / n;
+}
+
+/*
+	how far the shadow samples of a pixel are shifted across the light, from two blue noise values
+	(the second out of the middle of the mask), so that neighbouring pixels sample it in between
+	each other and a tile of them covers it far more finely than its budget
+	pixel i is in column i / imageHeight, with no imageHeight the pixels are taken as one column
+	each sample pass of a lens camera moves every pixel's shift on by the same irrational step (the
+	R2 sequence), so the passes sample the light in between each other instead of all over again
+ */
+vec2 sampleRotation(int pixel, int imageHeight, int pass = 0){
+	static const blueNoiseMask mask;
+	const int size = blueNoiseMask::Size;
+	int x = imageHeight > 0 ? pixel / imageHeight : 0;
+	int y = imageHeight > 0 ? pixel % imageHeight : pixel;
+	vec2 shift = vec2(mask.value[(y % size) * size + x % size],
+					  mask.value[((y + size / 2) % size) * size + (x + size / 2) % size]);
+	return pass == 0 ? shift : fract(shift + (float)pass * vec2(0.7548777f, 0.5698403f));
+}
+
+//the point (s, t) in [0,1)^2 on an area light, a sphere is sampled over the disc it shows dt
+vec3 lightPoint(const lightSource &light, vec3 dt, float s, float t){
+	if (light.shape == LIGHT_QUAD)
+		return light.pos + (s - 0.5f) * light.u + (t - 0.5f) * light.v;
+
+	vec3 w = normalize(light.pos - dt);
+	vec3 a = normalize(cross(fabs(w.x) > 0.5f ? vec3(0,1,0) : vec3(1,0,0), w));
+	vec3 b = cross(w, a);
+	float r = light.radius * sqrt(s), phi = 6.2831853f * t;
+	return light.pos + r * (cos(phi) * a + sin(phi) * b);
+}
+
+/*
+	the fraction of the light dt sees, 0 or 1 for a point light
+	an area light gets up to p.shadowSamples shadow rays, one in each stratum of a square grid over
+	it, the grid shifted by rotation (wrapping around, so every stratum still has one)
+	a sparse set of probe strata goes first, the four corners, the centre and a diagonal that crosses
+	every row and column (so even an occluder narrower than a stratum is seen when it spans the light),
+	and when they all agree dt is taken to be fully lit or in the umbra, so only points in the
+	penumbra pay for the whole budget
+ */
+template <unsigned int features>
+float lightVisibility(vec3 dt, const parser &p, primitiveRef from, vec2 rotation){
+	const lightSource &light = p.lightSources[0];
+	if (light.shape == LIGHT_POINT)
+		return shadowKernel<features>(dt, light.pos, p, from) ? 0.f : 1.f;
+
+	int side = std::max(1, (int)sqrt((float)std::max(p.shadowSamples, 1)));
+	auto blocked = [&](int i, int j){
+		float s = fract((i + 0.5f) / side + rotation.x);
+		float t = fract((j + 0.5f) / side + rotation.y);
+		return shadowKernel<features>(dt, lightPoint(light, dt, s, t), p, from);
+	};
+
+	if (side == 1)
+		return blocked(0, 0) ? 0.f : 1.f;
+
+	//the probes: the four corners, the centre and a diagonal shifted half way round, which passes
+	//through every row and every column of the grid
+	int last = side - 1, half = side / 2;
+	auto probe = [&](int i, int j){
+		return ((i == 0 || i == last) && (j == 0 || j == last)) || (i == half && j == half) || j == (i + half) % side;
+	};
+	int probes = 0, shadowed = 0;
+	for (int i = 0; i < side; i++)
+		for (int j = 0; j < side; j++)
+			if (probe(i, j)){
+				probes++;
+				shadowed += blocked(i, j);
+			}
+	if (shadowed == 0 || shadowed == probes)
+		return shadowed ? 0.f : 1.f;
+
+	for (int i = 0; i < side; i++)
+		for (int j = 0; j < side; j++)
+			if (!probe(i, j))
+				shadowed += blocked(i, j);
+	return 1.f - (float)shadowed / (side * side);
+}
+
+//raises a non-negative x to a non-negative integer power by repeated squaring
+inline float powi(float x, int n){
+	float r = 1.f;
+	while (n){
+		if (n & 1)
+			r *= x;
+		x *= x;
+		n >>= 1;
+	}
+	return r;
+}
+
+/*
+	blinn-phong shading of a hit point on any primitive with Cr, Cp and phong,
+	normal must already be unit length (precomputed by parser::compile where possible)
+*/
+template <class T>
+vec3 phongShade(const T &prim, vec3 normal, vec3 ray, vec3 hitPoint, const lightSource &light, float visibility,
+				vec3 texture = vec3(1.f)){
+	vec3 Cr = prim.Cr * texture;
+	if (visibility <= 0)
+		return Cr * light.Ca;
+
+	vec3 l = normalize(light.pos - hitPoint);
+	vec3 h = normalize(l - ray);
+
+	float diffuse = std::max(dot(normal, l), 0.f);
+	float nh = dot(h, normal);
+	float specular = (prim.phongExp >= 0 && nh >= 0) ? powi(nh, prim.phongExp) : pow(nh, prim.phong);
+
+	vec3 Cl = light.Cl * visibility;
+	return (Cr * (light.Ca + (Cl * diffuse)))
+			+ (Cl * prim.Cp * specular);
+}
+
+//tests triangle id, keeping hit if it is still the closest
+inline void hitTriangle(const triangle &tri, int id, vec3 ray, vec3 oPoint, hitRecord &hit){
+	vec3 v = intersectTriangle(ray, oPoint, tri);
+	if (v[0] < hit.t && v[0] > 0 && v[1] >= 0 && v[2] >= 0 && (v[1]+v[2] <= 1)){
+		hit.type = HIT_TRIANGLE;
+		hit.id = id;
+		hit.t = v[0];
+		hit.u = v[1];
+		hit.v = v[2];
+	}
+}
+
+//tests a run of triangles whose ids start at firstId
+void hitTriangles(const vector<triangle> &tris, int firstId, vec3 ray, vec3 oPoint, hitRecord &hit, int exclude){
+	for (int i = 0; i < (int)tris.size(); i++)
+		if (firstId + i != exclude)
+			hitTriangle(tris[i], firstId + i, ray, oPoint, hit);
+}
+
+/*
+	same for the triangles of a page, through the page's own hierarchy, the ids in hit and exclude
+	are file-wide; the page counts its ids from its first triangle, so a closest hit already found
+	is shifted to the page's count for the test, keeping equal distances going to the lower id
+ */
+void hitPageTriangles(geometryPages &pages, int pg, vec3 ray, vec3 oPoint, hitRecord &hit, int exclude){
+	int base = pg * geometryPages::trianglesPerPage;
+	const vector<triangle> &tris = pages.page(pg);
+	if (hit.type == HIT_TRIANGLE)
+		hit.id -= base;
+	pages.pageHierarchy(pg).closestHit(ray, oPoint, tris, hit, exclude - base);
+	if (hit.type == HIT_TRIANGLE)
+		hit.id += base;
+}
+
+//same for the scene's triangles wherever they are kept
+void hitSceneTriangles(vec3 ray, const parser &p, vec3 oPoint, hitRecord &hit, int exclude){
+	if (p.trianglePages){
+		//nearer pages first, so the closest hit so far rules out the pages behind it
+		geometryPages &pages = *p.trianglePages;
+		pages.pagesAlong(ray, oPoint, hit.t, [&](int pg){
+			hitPageTriangles(pages, pg, ray, oPoint, hit, exclude);
+			return false;
+		});
+	}
+	else if (p.bvh)
+		p.bvh->closestHit(ray, oPoint, p.triangles, hit, exclude);
+	else
+		hitTriangles(p.triangles, 0, ray, oPoint, hit, exclude);
+}
+
+//spheres and planes are always tested after the triangles, so ties go the same way every time
+void hitSpheres(vec3 ray, const parser &p, vec3 oPoint, hitRecord &hit, primitiveRef from){
+	for (int i = 0; i < (int)p.spheres.size(); i++){
+		const sphere &sph = p.spheres[i];
+		float f = (from.type == HIT_SPHERE && from.id == i)
+				? intersectSphereFrom(ray, sph.center, oPoint, sph.radius)
+				: intersectSphere(ray, sph.center, oPoint, sph.radius);
+		if (f < hit.t && f > 0){
+			hit.type = HIT_SPHERE;
+			hit.id = i;
+			hit.t = f;
+		}
+	}
+}
+
+void hitPlanes(vec3 ray, const parser &p, vec3 oPoint, hitRecord &hit, primitiveRef from){
+	for (int i = 0; i < (int)p.planes.size(); i++){
+		if (from.type == HIT_PLANE && from.id == i)
+			continue;
+		const plane &pln = p.planes[i];
+		float f = intersectPlane(ray, pln.q, oPoint, pln.n);
+		if (f < hit.t && f > 0){
+			hit.type = HIT_PLANE;
+			hit.id = i;
+			hit.t = f;
+		}
+	}
+}
+
+//closest hit kernel for scenes with the primitive kinds in features, like shadowKernel
+template <unsigned int features>
+hitRecord closestHitKernel(vec3 ray, const parser &p, vec3 oPoint, primitiveRef from){
+
+	hitRecord hit = { HIT_NONE, -1, delimitor, 0.f, 0.f };
+
+	if (features & SCENE_TRIANGLES)
+		hitSceneTriangles(ray, p, oPoint, hit, excludedTriangle(from));
+	if (features & SCENE_SPHERES)
+		hitSpheres(ray, p, oPoint, hit, from);
+	if (features & SCENE_PLANES)
+		hitPlanes(ray, p, oPoint, hit, from);
+	return hit;
+}
+
+/*
+	visibility pass: find the closest thing a ray hits without shading anything
+	returns a record with type HIT_NONE if the ray misses the scene
+ */
+hitRecord closestHit(vec3 ray, const parser &p, vec3 oPoint, primitiveRef from){
+	return closestHitKernel<SCENE_ALL>(ray, p, oPoint, from);
+}
+
+//distance along a ray to a single primitive, delimitor if the ray misses it
+float primitiveDistance(const parser &p, int type, int id, vec3 ray, vec3 oPoint){
+	switch (type){
+	case HIT_TRIANGLE: {
+		vec3 v = intersectTriangle(ray, oPoint, triangleAt(p, id));
+		if (v[1] >= 0 && v[2] >= 0 && (v[1]+v[2] <= 1))
+			return v[0];
+		return delimitor;
+	}
+	case HIT_SPHERE:
+		return intersectSphere(ray, p.spheres[id].center, oPoint, p.spheres[id].radius);
+	case HIT_PLANE:
+		return intersectPlane(ray, p.planes[id].q, oPoint, p.planes[id].n);
+	}
+	return delimitor;
+}
+
+//the point a hit record lies at, for the ray it was found along
+vec3 hitPosition(const hitRecord &hit, vec3 ray, vec3 oPoint){
+	return oPoint + ray * hit.t;
+}
+
+//the primitive a hit record landed on
+primitiveRef hitPrimitive(const hitRecord &hit){
+	primitiveRef prim = { hit.type, hit.id };
+	return prim;
+}
+
+//a point on the hit surface moved off it towards the side the ray came from
+vec3 leaveSurface(vec3 hitPoint, vec3 normal, vec3 ray){
+	return offsetOrigin(hitPoint, (dot(normal, ray) > 0) ? -normal : normal);
+}
+
+//unit surface normal at a hit point
+vec3 hitNormal(const hitRecord &hit, vec3 hitPoint, const parser &p){
+	switch (hit.type){
+	case HIT_TRIANGLE:	return triangleAt(p, hit.id).n;
+	case HIT_SPHERE:	return normalize(hitPoint - p.spheres[hit.id].center);
+	case HIT_PLANE:		return p.planes[hit.id].n;
+	}
+	return vec3(0,0,0);
+}
+
+/*
+	the texture colour at a hit, white for primitives without one
+	spheres are mapped by longitude and latitude, triangles by their vertices' texture coordinates
+	and planes by a basis of their own repeating every textureScale units; the mip level comes from
+	how far apart neighbouring pixels' rays are by the end of this segment, spread by how obliquely it hits
+ */
+vec3 textureColour(const hitRecord &hit, vec3 ray, vec3 hitPoint, vec3 normal, const parser &p){
+	if (!p.textures)
+		return vec3(1.f);
+
+	int texture = -1;
+	vec2 uv;
+	float uvPerUnit = 1.f;
+	switch (hit.type){
+	case HIT_SPHERE: {
+		const sphere &s = p.spheres[hit.id];
+		texture = s.texture;
+		uv = vec2(0.5f + atan2(normal.z, normal.x) / 6.2831853f, 0.5f + asin(clamp(normal.y, -1.f, 1.f)) / 3.1415927f);
+		uvPerUnit = 1.f / (3.1415927f * s.radius);
+		break;
+	}
+	case HIT_TRIANGLE: {
+		triangle t = triangleAt(p, hit.id);
+		texture = t.texture;
+		vec2 du = t.uvB - t.uvA, dv = t.uvC - t.uvA;
+		uv = t.uvA + hit.u * du + hit.v * dv;
+		uvPerUnit = sqrt(fabs(du.x * dv.y - du.y * dv.x) / length(cross(t.b - t.a, t.c - t.a)));
+		break;
+	}
+	case HIT_PLANE: {
+		const plane &pl = p.planes[hit.id];
+		texture = pl.texture;
+		vec3 a = normalize(cross(pl.n, fabs(pl.n.x) < 0.9f ? vec3(1, 0, 0) : vec3(0, 1, 0)));
+		vec3 b = cross(pl.n, a);
+		vec3 d = hitPoint - pl.q;
+		uv = vec2(dot(d, a), dot(d, b)) / pl.textureScale;
+		uvPerUnit = 1.f / pl.textureScale;
+		break;
+	}
+	}
+	if (texture < 0 || p.textureIds[texture] < 0)
+		return vec3(1.f);
+
+	float footprint = hit.t * p.pixelAngle / std::max(fabs(dot(ray, normal)), 0.1f) * uvPerUnit;
+	return p.textures->sample(p.textureIds[texture], uv, footprint);
+}
+
+//where the shadow ray of a hit starts
+vec3 shadowOrigin(const hitRecord &hit, vec3 ray, vec3 oPoint, const parser &p){
+	vec3 hitPoint = hitPosition(hit, ray, oPoint);
+	return leaveSurface(hitPoint, hitNormal(hit, hitPoint, p), ray);
+}
+
+//casts the shadow rays for a hit, misses are never in shadow
+float hitVisibility(const hitRecord &hit, vec3 ray, vec3 oPoint, const parser &p, vec2 rotation){
+	if (hit.type == HIT_NONE)
+		return 1.f;
+
+	return lightVisibility<SCENE_ALL>(shadowOrigin(hit, ray, oPoint, p), p, hitPrimitive(hit), rotation);
+}
+
+/*
+	lights a single hit record without following any reflection or casting any rays
+	returns true in reflects for spheres, with the mirrored ray leaving the hit in reflectOrigin/reflectRay
+ */
+vec3 shadeLocal(const hitRecord &hit, vec3 ray, vec3 oPoint, const parser &p, float visibility,
+				bool &reflects, vec3 &reflectOrigin, vec3 &reflectRay){
+	const lightSource &light = p.lightSources[0];
+	vec3 hitPoint = hitPosition(hit, ray, oPoint);
+	vec3 normal = hitNormal(hit, hitPoint, p);
+	reflects = false;
+
+	vec3 texture = textureColour(hit, ray, hitPoint, normal, p);
+
+	switch (hit.type){
+	case HIT_TRIANGLE:
+		return phongShade(triangleAt(p, hit.id), normal, ray, hitPoint, light, visibility, texture);
+	case HIT_SPHERE:
+		//reflection
+		reflects = true;
+		reflectRay = ray - (2*(dot(ray, normal))*normal);
+		reflectOrigin = leaveSurface(hitPoint, normal, ray);
+
+		return phongShade(p.spheres[hit.id], normal, ray, hitPoint, light, visibility, texture);
+	case HIT_PLANE:
+		return phongShade(p.planes[hit.id], normal, ray, hitPoint, light, visibility, texture);
+	}
+
+	return vec3(0,0,0);
+}
+
+/*
+	shading pass: light a single hit record, spheres also trace their reflection
+	depth first so that only the closest hit of every ray ever casts a shadow ray
+	rotation is the pixel's sampleRotation
+ */
+vec3 shadeHit(const hitRecord &hit, vec3 ray, vec3 oPoint, const parser &p, vec2 rotation){
+	bool reflects;
+	vec3 reflectOrigin, reflectRay;
+	vec3 resultColor = shadeLocal(hit, ray, oPoint, p, hitVisibility(hit, ray, oPoint, p, rotation),
+								  reflects, reflectOrigin, reflectRay);
+
+	if (reflects)
+		resultColor *= intersect(reflectRay, p, reflectOrigin, hitPrimitive(hit), rotation);
+
+	return resultColor;
+}
+
+ /*
+	check in a ray intersects with anything in the scene
+	return the color at the intersection
+	if there is no intersection, default to black
+ */
+vec3  intersect(vec3 ray, const parser &p, vec3 oPoint, primitiveRef from, vec2 rotation){
+	return shadeHit(closestHit(ray, p, oPoint, from), ray, oPoint, p, rotation);
+}
+
+//groups hits by the primitive (and so the material) they landed on, 0 is reserved for misses
+int materialKey(const hitRecord &hit, const parser &p){
+	switch (hit.type){
+	case HIT_TRIANGLE:	return 1 + hit.id;
+	case HIT_SPHERE:	return 1 + triangleCount(p) + hit.id;
+	case HIT_PLANE:		return 1 + triangleCount(p) + (int)p.spheres.size() + hit.id;
+	}
+	return 0;
+}
+
+/*
+	fills order with the ray indices ordered by the material of their hit, in index order within each
+	material: sorts (key, index) pairs packed into keys, so it costs only as much as the hits do,
+	however many primitives the scene has
+ */
+void sortByMaterial(const arenaVector<hitRecord> &hits, const parser &p, arenaVector<int> &order,
+					arenaVector<unsigned long long> &keys){
+	keys.resize(hits.size());
+	for (int i = 0; i < (int)hits.size(); i++)
+		keys[i] = ((unsigned long long)materialKey(hits[i], p) << 32) | (unsigned int)i;
+	sort(keys.begin(), keys.end());
+
+	order.resize(hits.size());
+	for (int i = 0; i < (int)hits.size(); i++)
+		order[i] = (int)(keys[i] & 0xffffffffu);
+}
+
+// --------------------------------------------------------------------------
+// Per tile culling of primary rays
+
+const int tileCulling::TileSize;
+const int tileCulling::SubtreeTiles;
+
+//a rectangle of tiles, x0 > x1 when it is empty
+struct tileRect{
+	int x0, y0, x1, y1;
+};
+
+/*
+	distance from the camera to the image plane in pixels, worked back out of the rays
+	(pixel (i, j)'s ray points at (i - width/2 + 0.5, j - height/2 + 0.5, -focal)), 0 if it can't be
+ */
+float imageFocal(const vector<vec3> &rays, int wnd_width, int wnd_height){
+	vec3 corner = rays[0];
+	if (wnd_width > 1)
+		return (wnd_width / 2.f - 0.5f) * corner.z / corner.x;
+	if (wnd_height > 1)
+		return (wnd_height / 2.f - 0.5f) * corner.z / corner.y;
+	return 0.f;
+}
+
+//pixel range [lo, hi] of the image covers, padded by a pixel for rounding in the rays, as a tile range
+void tileRange(float lo, float hi, int size, int tiles, int &t0, int &t1){
+	const int ts = tileCulling::TileSize;
+	int i0 = (int)floor(clamp(lo + size / 2.f - 0.5f, -2.f, size + 1.f)) - 1;
+	int i1 = (int)ceil(clamp(hi + size / 2.f - 0.5f, -2.f, size + 1.f)) + 1;
+	if (i1 < 0 || i0 > size - 1){
+		t0 = tiles;
+		t1 = -1;
+		return;
+	}
+	t0 = std::max(i0, 0) / ts;
+	t1 = std::min(i1, size - 1) / ts;
+}
+
+/*
+	the tiles the convex hull of some points covers on the image
+	none if they are all behind the camera, every tile if only some of them are
+ */
+tileRect projectPoints(const vec3 *points, int count, const tileCulling &c, float focal){
+	tileRect all = { 0, 0, c.tilesX - 1, c.tilesY - 1 };
+	tileRect none = { 0, 0, -1, -1 };
+
+	bool behind = true, inFront = true;
+	vec2 lo = vec2(1e30f), hi = vec2(-1e30f);
+	for (int i = 0; i < count; i++){
+		const vec3 &q = points[i];
+		behind = behind && q.z > 0;
+		inFront = inFront && q.z < 0;
+		if (q.z < 0){
+			vec2 s = vec2(q.x, q.y) * (focal / -q.z);
+			lo = vec2(std::min(lo.x, s.x), std::min(lo.y, s.y));
+			hi = vec2(std::max(hi.x, s.x), std::max(hi.y, s.y));
+		}
+	}
+	if (behind)
+		return none;
+	if (!inFront || focal <= 0)
+		return all;
+
+	tileRect r;
+	tileRange(lo.x, hi.x, c.width, c.tilesX, r.x0, r.x1);
+	tileRange(lo.y, hi.y, c.height, c.tilesY, r.y0, r.y1);
+	if (r.x0 > r.x1 || r.y0 > r.y1)
+		return none;
+	return r;
+}
+
+//lays the ids out tile by tile, each primitive in every tile of its rectangle
+void binRects(const arenaVector<tileRect> &rects, const tileCulling &c, vector<int> &start, vector<int> &ids){
+	int numTiles = c.tilesX * c.tilesY;
+	start.assign(numTiles + 1, 0);
+	for (const tileRect &r : rects)
+		for (int tx = r.x0; tx <= r.x1; tx++)
+			for (int ty = r.y0; ty <= r.y1; ty++)
+				start[tx * c.tilesY + ty + 1]++;
+	for (int t = 0; t < numTiles; t++)
+		start[t + 1] += start[t];
+
+	ids.resize(start[numTiles]);
+	arenaVector<int> fill(start.begin(), start.end() - 1);
+	for (int id = 0; id < (int)rects.size(); id++){
+		const tileRect &r = rects[id];
+		for (int tx = r.x0; tx <= r.x1; tx++)
+			for (int ty = r.y0; ty <= r.y1; ty++)
+				ids[fill[tx * c.tilesY + ty]++] = id;
+	}
+}
+
+/*
+	whether a plane crosses the frustum of a tile's rays, out to twice delimitor along
+	its corner rays so the flat far end still reaches past every hit that counts
+ */
+bool planeInTile(const plane &pl, const vector<vec3> &rays, const tileCulling &c, int tx, int ty){
+	const int ts = tileCulling::TileSize;
+	int xs[2] = { tx * ts, std::min((tx + 1) * ts, c.width) - 1 };
+	int ys[2] = { ty * ts, std::min((ty + 1) * ts, c.height) - 1 };
+
+	float s0 = dot(pl.n, origin - pl.q);
+	for (int x : xs)
+		for (int y : ys){
+			float s = dot(pl.n, rays[x * c.height + y] * (2 * delimitor) - pl.q);
+			if (s == 0 || s0 == 0 || (s > 0) != (s0 > 0))
+				return true;
+		}
+	return false;
+}
+
+tileCulling cullTiles(const parser &p, const vector<vec3> &rays, int wnd_width, int wnd_height){
+	const int ts = tileCulling::TileSize;
+	tileCulling c;
+	c.width = wnd_width;
+	c.height = wnd_height;
+	c.tilesX = (wnd_width + ts - 1) / ts;
+	c.tilesY = (wnd_height + ts - 1) / ts;
+	c.triangles = !p.trianglePages && (!p.bvh || p.bvh->layout() == BVH_BINARY);
+	c.subtrees = c.triangles && p.bvh;
+	float focal = rays.empty() ? 0.f : imageFocal(rays, wnd_width, wnd_height);
+
+	arenaScope scratch;
+	arenaVector<tileRect> rects;
+	if (c.subtrees){
+		//opened from the root until a node's box covers few enough tiles, or is a leaf
+		arenaVector<int> nodes;
+		arenaVector<float> nearest;
+		p.bvh->subtrees([&](int node, const bounds &box, bool leaf){
+			vec3 corners[8];
+			for (int k = 0; k < 8; k++)
+				corners[k] = vec3(k & 1 ? box.hi.x : box.lo.x, k & 2 ? box.hi.y : box.lo.y, k & 4 ? box.hi.z : box.lo.z);
+			tileRect r = projectPoints(corners, 8, c, focal);
+			if (r.x0 > r.x1 || r.y0 > r.y1)
+				return false;
+			if (!leaf && (r.x1 - r.x0 + 1) * (r.y1 - r.y0 + 1) > tileCulling::SubtreeTiles)
+				return true;
+			rects.push_back(r);
+			nodes.push_back(node);
+			nearest.push_back(length(max(box.lo - origin, max(origin - box.hi, vec3(0.f)))));
+			return false;
+		});
+		binRects(rects, c, c.triangleStart, c.triangleIds);
+
+		//nearest first within a tile, so the hit found in one rules out the boxes behind it
+		for (int t = 0; t < c.tilesX * c.tilesY; t++)
+			stable_sort(c.triangleIds.begin() + c.triangleStart[t], c.triangleIds.begin() + c.triangleStart[t + 1],
+						[&](int a, int b){ return nearest[a] < nearest[b]; });
+		for (int &id : c.triangleIds)
+			id = nodes[id];
+	}
+	else if (c.triangles){
+		const vector<triangle> &tris = p.triangles;
+		rects.resize(tris.size());
+		for (int i = 0; i < (int)tris.size(); i++){
+			const triangle &tri = tris[i];
+			vec3 corners[3] = { tri.a, tri.b, tri.c };
+			rects[i] = projectPoints(corners, 3, c, focal);
+		}
+		binRects(rects, c, c.triangleStart, c.triangleIds);
+	}
+
+	//spheres by the corners of their bounding boxes
+	rects.resize(p.spheres.size());
+	for (int i = 0; i < (int)p.spheres.size(); i++){
+		const sphere &sph = p.spheres[i];
+		vec3 corners[8];
+		for (int k = 0; k < 8; k++)
+			corners[k] = sph.center + sph.radius * vec3(k & 1 ? 1 : -1, k & 2 ? 1 : -1, k & 4 ? 1 : -1);
+		rects[i] = projectPoints(corners, 8, c, focal);
+	}
+	binRects(rects, c, c.sphereStart, c.sphereIds);
+
+	//planes are unbounded, so they go tile by tile
+	int numTiles = c.tilesX * c.tilesY;
+	c.planeStart.assign(numTiles + 1, 0);
+	c.planeIds.clear();
+	for (int t = 0; t < numTiles; t++){
+		for (int i = 0; i < (int)p.planes.size(); i++)
+			if (focal <= 0 || planeInTile(p.planes[i], rays, c, t / c.tilesY, t % c.tilesY))
+				c.planeIds.push_back(i);
+		c.planeStart[t + 1] = (int)c.planeIds.size();
+	}
+	return c;
+}
+
+//closest hit of a pixel's primary ray, testing only its tile's candidates
+hitRecord primaryHit(const tileCulling &c, int pixel, vec3 ray, const parser &p){
+	const int ts = tileCulling::TileSize;
+	int tile = (pixel / c.height / ts) * c.tilesY + (pixel % c.height) / ts;
+	hitRecord hit = { HIT_NONE, -1, delimitor, 0.f, 0.f };
+
+	if (c.subtrees){
+		for (int k = c.triangleStart[tile]; k < c.triangleStart[tile + 1]; k++)
+			p.bvh->closestHit(ray, origin, p.triangles, hit, -1, c.triangleIds[k]);
+	}
+	else if (c.triangles){
+		const vector<triangle> &tris = p.triangles;
+		for (int k = c.triangleStart[tile]; k < c.triangleStart[tile + 1]; k++){
+			int id = c.triangleIds[k];
+			hitTriangle(tris[id], id, ray, origin, hit);
+		}
+	}
+	else
+		hitSceneTriangles(ray, p, origin, hit, -1);
+
+	for (int k = c.sphereStart[tile]; k < c.sphereStart[tile + 1]; k++){
+		const sphere &sph = p.spheres[c.sphereIds[k]];
+		float f = intersectSphere(ray, sph.center, origin, sph.radius);
+		if (f < hit.t && f > 0){
+			hit.type = HIT_SPHERE;
+			hit.id = c.sphereIds[k];
+			hit.t = f;
+		}
+	}
+	for (int k = c.planeStart[tile]; k < c.planeStart[tile + 1]; k++){
+		const plane &pln = p.planes[c.planeIds[k]];
+		float f = intersectPlane(ray, pln.q, origin, pln.n);
+		if (f < hit.t && f > 0){
+			hit.type = HIT_PLANE;
+			hit.id = c.planeIds[k];
+			hit.t = f;
+		}
+	}
+	return hit;
+}
+
+// --------------------------------------------------------------------------
+// Wavefront tracing: every ray of a bounce is traced before any of the next
+
+//a ray waiting in the wavefront queue, along with the pixel it will eventually colour
+struct pathRay{
+	vec3 oPoint;
+	vec3 ray;
+	vec3 weight;	//product of the sphere colours this path has reflected off so far
+	int pixel;
+	primitiveRef from;	//the surface the ray leaves, noPrimitive for primary rays
+};
+
+//the queues and records of a frame are scratch, drawn from the thread's arena
+typedef arenaVector<pathRay> rayQueue;
+
+//path vertices as they come out of the wavefront, tagged with their pixel
+typedef arenaVector<pair<int, pathVertex> > vertexRecord;
+
+/*
+	buffers every bounce of a wavefront works in, sized by the first bounce (the largest)
+	and reused by the rest so the arena isn't bumped again for each one
+ */
+struct wavefrontScratch{
+	arenaVector<hitRecord> hits;
+	arenaVector<float> visibility;
+	arenaVector<int> order;
+	arenaVector<unsigned long long> materialKeys;
+	arenaVector<pair<unsigned long long, int> > keys;
+	rayQueue sorted;
+};
+
+/*
+	orders the queue so rays that leave in the same direction octant from nearby points
+	are traced one after another, keeping the same primitives hot in cache (with parser::sortBounces)
+ */
+void sortCoherent(rayQueue &queue, wavefrontScratch &scratch){
+	if (queue.size() < 2)
+		return;
+
+	bounds box;
+	for (const pathRay &r : queue)
+		box.grow(r.oPoint);
+
+	arenaVector<pair<unsigned long long, int> > &keys = scratch.keys;
+	keys.resize(queue.size());
+	for (int i = 0; i < (int)queue.size(); i++){
+		const pathRay &r = queue[i];
+		unsigned int morton = mortonCode(r.oPoint, box);
+		unsigned int octant = (r.ray.x < 0 ? 4 : 0) | (r.ray.y < 0 ? 2 : 0) | (r.ray.z < 0 ? 1 : 0);
+		keys[i] = make_pair(((unsigned long long)octant << 30) | morton, i);
+	}
+	sort(keys.begin(), keys.end());
+
+	rayQueue &sorted = scratch.sorted;
+	sorted.resize(queue.size());
+	for (int i = 0; i < (int)queue.size(); i++)
+		sorted[i] = queue[keys[i].second];
+	queue.swap(sorted);
+}
+
+/*
+	closest hits for a whole queue of rays, kernel for scenes with the primitive kinds in features
+	kept as a loop over the queue so the tests that compile away leave nothing behind in it
+ */
+template <unsigned int features>
+void closestHitsKernel(const rayQueue &queue, const parser &p, arenaVector<hitRecord> &hits){
+	hits.resize(queue.size());
+	for (int i = 0; i < (int)queue.size(); i++)
+		hits[i] = closestHitKernel<features>(queue[i].ray, p, queue[i].oPoint, queue[i].from);
+}
+
+/*
+	the shadow rays of a queue's hits, misses are never in shadow
+	imageHeight places the rays' pixels, and pass is the lens camera's sample pass, for their sampleRotation
+	with pointLight the light is known to be a point, so each hit casts its one ray straight at it
+ */
+template <unsigned int features, bool pointLight>
+void castShadowsKernel(const rayQueue &queue, const arenaVector<hitRecord> &hits, const parser &p, int imageHeight,
+					   int pass, arenaVector<float> &visibility){
+	const lightSource &light = p.lightSources[0];
+	bool area = light.shape != LIGHT_POINT;
+	visibility.assign(queue.size(), 1.f);
+	for (int i = 0; i < (int)queue.size(); i++){
+		if (hits[i].type == HIT_NONE)
+			continue;
+		vec3 dt = shadowOrigin(hits[i], queue[i].ray, queue[i].oPoint, p);
+		if (pointLight)
+			visibility[i] = shadowKernel<features>(dt, light.pos, p, hitPrimitive(hits[i])) ? 0.f : 1.f;
+		else
+			visibility[i] = lightVisibility<features>(dt, p, hitPrimitive(hits[i]),
+													  area ? sampleRotation(queue[i].pixel, imageHeight, pass) : vec2(0.f));
+	}
+}
+
+/*
+	the (page, ray) pairs of the pages each ray crosses before its maxT, sorted by page, as the
+	hierarchy over the pages finds them; rays(i, ray, oPoint, maxT) gives ray i
+ */
+template <class Rays>
+void pageVisits(const geometryPages &pages, int numRays, Rays rays, arenaVector<pair<int, int> > &visits){
+	visits.clear();
+	for (int i = 0; i < numRays; i++){
+		vec3 ray, oPoint;
+		float maxT;
+		rays(i, ray, oPoint, maxT);
+		pages.pagesAlong(ray, oPoint, maxT, [&](int pg){
+			visits.push_back(make_pair(pg, i));
+			return false;
+		});
+	}
+	sort(visits.begin(), visits.end());
+}
+
+/*
+	closest hits with paged triangles: the pages are the outer loop
+	so each one is loaded at most once per bounce no matter how small the budget is
+ */
+void closestHitsPaged(const rayQueue &queue, const parser &p, arenaVector<hitRecord> &hits){
+	hitRecord none = { HIT_NONE, -1, delimitor, 0.f, 0.f };
+	hits.assign(queue.size(), none);
+
+	arenaScope scratch;
+	arenaVector<pair<int, int> > visits;
+	geometryPages &pages = *p.trianglePages;
+	pageVisits(pages, (int)queue.size(), [&](int i, vec3 &ray, vec3 &oPoint, float &maxT){
+		ray = queue[i].ray;
+		oPoint = queue[i].oPoint;
+		maxT = delimitor;
+	}, visits);
+
+	//by the time a ray's later pages come up it may have found a hit in front of them
+	for (const pair<int, int> &visit : visits){
+		int pg = visit.first, i = visit.second;
+		if (boxEntry(pages.pageBounds(pg), queue[i].ray, queue[i].oPoint, hits[i].t) >= 0)
+			hitPageTriangles(pages, pg, queue[i].ray, queue[i].oPoint, hits[i], excludedTriangle(queue[i].from));
+	}
+
+	for (int i = 0; i < (int)queue.size(); i++){
+		hitSpheres(queue[i].ray, p, queue[i].oPoint, hits[i], queue[i].from);
+		hitPlanes(queue[i].ray, p, queue[i].oPoint, hits[i], queue[i].from);
+	}
+}
+
+/*
+	the shadow rays of a queue's hits, batched over the pages the same way for a point light
+	an area light's rays go one hit at a time, loading the pages each one crosses
+ */
+void castShadowsPaged(const rayQueue &queue, const arenaVector<hitRecord> &hits, const parser &p, int imageHeight,
+					  int pass, arenaVector<float> &visibility){
+	const lightSource &light = p.lightSources[0];
+	if (light.shape != LIGHT_POINT){
+		castShadowsKernel<SCENE_ALL, false>(queue, hits, p, imageHeight, pass, visibility);
+		return;
+	}
+	visibility.assign(queue.size(), 1.f);
+
+	//the spheres and planes are cheap and resident, only rays they don't block go on to the pages
+	arenaScope scratch;
+	arenaVector<int> pending;
+	arenaVector<vec3> starts(queue.size()), dirs(queue.size());
+	arenaVector<float> maxTs(queue.size());
+	for (int i = 0; i < (int)queue.size(); i++){
+		if (hits[i].type == HIT_NONE)
+			continue;
+		starts[i] = shadowOrigin(hits[i], queue[i].ray, queue[i].oPoint, p);
+		dirs[i] = normalize(light.pos - starts[i]);
+		maxTs[i] = std::min(length(light.pos - starts[i]), delimitor);
+		if (spheresOcclude(p, dirs[i], starts[i], maxTs[i], hitPrimitive(hits[i]))
+			|| planesOcclude(p, dirs[i], starts[i], maxTs[i], hitPrimitive(hits[i])))
+			visibility[i] = 0.f;
+		else
+			pending.push_back(i);
+	}
+
+	arenaVector<pair<int, int> > visits;
+	geometryPages &pages = *p.trianglePages;
+	pageVisits(pages, (int)pending.size(), [&](int k, vec3 &ray, vec3 &oPoint, float &maxT){
+		int i = pending[k];
+		ray = dirs[i];
+		oPoint = starts[i];
+		maxT = maxTs[i];
+	}, visits);
+
+	for (const pair<int, int> &visit : visits){
+		int pg = visit.first, i = pending[visit.second];
+		if (visibility[i] != 0.f
+			&& pageOccludes(pages, pg, dirs[i], starts[i], maxTs[i], excludedTriangle(hitPrimitive(hits[i]))))
+			visibility[i] = 0.f;
+	}
+}
+
+/*
+	the shading pass of a bounce: lights the hits in order (ray indices, by material), writing the
+	colour of each path that ends (pixel i's at colours[i - colourBase]) and appending the reflected
+	ones to next, and every vertex to record if one is given
+	without reflections (a scene with no spheres) nothing is ever appended to next, and with
+	pointLight every visibility is 0 or 1, so a shadowed hit is just its ambient colour
+ */
+template <bool reflections, bool pointLight>
+void shadeKernel(const rayQueue &queue, const arenaVector<hitRecord> &hits, const arenaVector<float> &visibility,
+				 const arenaVector<int> &order, const parser &p, vector<vec3> &colours, int colourBase,
+				 rayQueue &next, vertexRecord *record){
+	const lightSource &light = p.lightSources[0];
+	for (int index : order){
+		const pathRay &r = queue[index];
+		const hitRecord &hit = hits[index];
+		if (record){
+			pathVertex vertex = { r.oPoint, r.ray, hit, visibility[index] };
+			record->push_back(make_pair(r.pixel, vertex));
+		}
+
+		if (reflections){
+			pathRay bounce;
+			bool reflects;
+			vec3 local = shadeLocal(hit, r.ray, r.oPoint, p, visibility[index], reflects, bounce.oPoint, bounce.ray);
+			if (reflects){
+				bounce.weight = r.weight * local;
+				bounce.pixel = r.pixel;
+				bounce.from = hitPrimitive(hit);
+				next.push_back(bounce);
+			}
+			else
+				colours[r.pixel - colourBase] = r.weight * local;
+			continue;
+		}
+
+		vec3 local(0.f);
+		if (hit.type != HIT_NONE){
+			vec3 hitPoint = hitPosition(hit, r.ray, r.oPoint);
+			vec3 normal = hitNormal(hit, hitPoint, p);
+			vec3 texture = textureColour(hit, r.ray, hitPoint, normal, p);
+			float lit = pointLight ? 1.f : visibility[index];
+			if (pointLight && visibility[index] <= 0)
+				local = (hit.type == HIT_TRIANGLE ? triangleAt(p, hit.id).Cr : p.planes[hit.id].Cr) * texture * light.Ca;
+			else if (hit.type == HIT_TRIANGLE)
+				local = phongShade(triangleAt(p, hit.id), normal, r.ray, hitPoint, light, lit, texture);
+			else
+				local = phongShade(p.planes[hit.id], normal, r.ray, hitPoint, light, lit, texture);
+		}
+		colours[r.pixel - colourBase] = r.weight * local;
+	}
+}
+
+//the visibility, shadow and shading passes a scene is traced with
+struct traceKernels{
+	const char *name;
+	void (*closestHits)(const rayQueue &queue, const parser &p, arenaVector<hitRecord> &hits);
+	void (*castShadows)(const rayQueue &queue, const arenaVector<hitRecord> &hits, const parser &p, int imageHeight,
+						int pass, arenaVector<float> &visibility);
+	void (*shade)(const rayQueue &queue, const arenaVector<hitRecord> &hits, const arenaVector<float> &visibility,
+				  const arenaVector<int> &order, const parser &p, vector<vec3> &colours, int colourBase,
+				  rayQueue &next, vertexRecord *record);
+};
+
+#define TRACE_KERNELS(name, features, pointLight) { name, closestHitsKernel<(features)>, \
+	castShadowsKernel<(features), pointLight>, shadeKernel<((features) & SCENE_SPHERES) != 0, pointLight> }
+
+/*
+	one kernel per combination of primitive kinds, indexed by sceneFeatures, for any light
+	and for a point light; only spheres reflect, so a scene without them has no reflections
+ */
+static const traceKernels featureKernels[2][SCENE_ALL + 1] = {
+	{
+		TRACE_KERNELS("empty", 0, false),
+		TRACE_KERNELS("triangles only", SCENE_TRIANGLES, false),
+		TRACE_KERNELS("spheres only", SCENE_SPHERES, false),
+		TRACE_KERNELS("no planes", SCENE_TRIANGLES | SCENE_SPHERES, false),
+		TRACE_KERNELS("planes only", SCENE_PLANES, false),
+		TRACE_KERNELS("no reflection", SCENE_TRIANGLES | SCENE_PLANES, false),
+		TRACE_KERNELS("no triangles", SCENE_SPHERES | SCENE_PLANES, false),
+		TRACE_KERNELS("generic", SCENE_ALL, false),
+	},
+	{
+		TRACE_KERNELS("empty, point light", 0, true),
+		TRACE_KERNELS("triangles only, point light", SCENE_TRIANGLES, true),
+		TRACE_KERNELS("spheres only, point light", SCENE_SPHERES, true),
+		TRACE_KERNELS("no planes, point light", SCENE_TRIANGLES | SCENE_SPHERES, true),
+		TRACE_KERNELS("planes only, point light", SCENE_PLANES, true),
+		TRACE_KERNELS("no reflection, point light", SCENE_TRIANGLES | SCENE_PLANES, true),
+		TRACE_KERNELS("no triangles, point light", SCENE_SPHERES | SCENE_PLANES, true),
+		TRACE_KERNELS("all primitives, point light", SCENE_ALL, true),
+	},
+};
+
+//what every scene can be traced with, whatever it holds and whatever its light
+static const traceKernels &genericKernels = featureKernels[0][SCENE_ALL];
+
+static const traceKernels pagedKernels = { "paged", closestHitsPaged, castShadowsPaged, shadeKernel<true, false> };
+
+unsigned int sceneFeatures(const parser &p){
+	return (triangleCount(p) > 0 ? SCENE_TRIANGLES : 0)
+		 | (p.spheres.empty() ? 0 : SCENE_SPHERES)
+		 | (p.planes.empty() ? 0 : SCENE_PLANES);
+}
+
+//picks the kernels for what the scene holds and how it's lit, paged scenes need their own page-outer loops
+const traceKernels &selectKernels(const parser &p){
+	if (p.trianglePages)
+		return pagedKernels;
+	return featureKernels[p.lightSources[0].shape == LIGHT_POINT][sceneFeatures(p)];
+}
+
+/*
+	traces one bounce worth of rays: visibility for the whole queue first, then shading by material
+	finished paths write their colour (pixel i's at colours[i - colourBase]), reflected ones are appended to next
+	every vertex is also appended to record if one is given
+	a queue of primary rays finds its hits through culling's tile lists when it is given
+	pass is the lens camera's sample pass the rays are for, 0 for a pinhole
+ */
+void traceWavefront(const rayQueue &queue, const parser &p, const traceKernels &kernels, wavefrontScratch &scratch,
+					int imageHeight, int pass, vector<vec3> &colours, int colourBase, rayQueue &next,
+					vertexRecord *record, const tileCulling *culling){
+	arenaVector<hitRecord> &hits = scratch.hits;
+	arenaVector<float> &visibility = scratch.visibility;
+	if (culling){
+		hits.resize(queue.size());
+		for (int i = 0; i < (int)queue.size(); i++)
+			hits[i] = primaryHit(*culling, queue[i].pixel, queue[i].ray, p);
+	}
+	else
+		kernels.closestHits(queue, p, hits);
+	kernels.castShadows(queue, hits, p, imageHeight, pass, visibility);
+
+	sortByMaterial(hits, p, scratch.order, scratch.materialKeys);
+	kernels.shade(queue, hits, visibility, scratch.order, p, colours, colourBase, next, record);
+}
+
+/*
+	traces the paths of a queue of primary rays to the end a bounce at a time
+	the queue and record must belong to the calling thread's arena, within the caller's arenaScope
+	colours holds the pixels from colourBase on, of an image imageHeight pixels high
+	pass is the lens camera's sample pass the rays are for
+ */
+void traceWavefronts(rayQueue &queue, const parser &p, int imageHeight, vector<vec3> &colours, vertexRecord *record,
+					 const tileCulling *culling = 0, int colourBase = 0, int pass = 0){
+	const traceKernels &kernels = selectKernels(p);
+
+	//no bounce has more rays than the first, so nothing grows once these are reserved
+	wavefrontScratch scratch;
+	scratch.hits.reserve(queue.size());
+	scratch.visibility.reserve(queue.size());
+	scratch.order.reserve(queue.size());
+	scratch.materialKeys.reserve(queue.size());
+	scratch.keys.reserve(queue.size());
+	scratch.sorted.reserve(queue.size());
+	rayQueue next;
+	next.reserve(queue.size());
+
+	//paged scenes keep to their page by page kernels
+	if (p.trianglePages)
+		culling = 0;
+
+	//primary rays are already coherent in scanline order
+	for (int bounce = 0; bounce < maxBounces && !queue.empty(); bounce++){
+		if (bounce > 0 && p.sortBounces)
+			sortCoherent(queue, scratch);
+		next.clear();
+		traceWavefront(queue, p, kernels, scratch, imageHeight, pass, colours, colourBase, next, record,
+					   bounce == 0 ? culling : 0);
+		queue.swap(next);
+	}
+}
+
+//the primary ray of a pixel, ready to be queued
+pathRay primaryRay(const vector<vec3> &rays, int pixel){
+	pathRay r;
+	r.oPoint = origin;
+	r.ray = rays[pixel];
+	r.weight = vec3(1,1,1);
+	r.pixel = pixel;
+	r.from = noPrimitive;
+	return r;
+}
+
+/*
+	replaces the cached paths of the pixels marked in replaced with the ones in record,
+	record holds the vertices of each path in bounce order
+ */
+void storePaths(renderCache &cache, const vertexRecord &record, const arenaVector<char> &replaced){
+	int numPixels = cache.width * cache.height;
+	bool hadPaths = (int)cache.pathStart.size() == numPixels + 1;
+
+	vector<int> pathStart(numPixels + 1, 0);
+	for (int i = 0; i < numPixels; i++)
+		if (!replaced[i] && hadPaths)
+			pathStart[i + 1] = cache.pathStart[i + 1] - cache.pathStart[i];
+	for (const pair<int, pathVertex> &r : record)
+		pathStart[r.first + 1]++;
+	for (int i = 0; i < numPixels; i++)
+		pathStart[i + 1] += pathStart[i];
+
+	vector<pathVertex> vertices(pathStart[numPixels]);
+	arenaScope scratch;
+	arenaVector<int> fill(pathStart.begin(), pathStart.end() - 1);
+	for (int i = 0; i < numPixels; i++)
+		if (!replaced[i] && hadPaths)
+			for (int k = cache.pathStart[i]; k < cache.pathStart[i + 1]; k++)
+				vertices[fill[i]++] = cache.vertices[k];
+	for (const pair<int, pathVertex> &r : record)
+		vertices[fill[r.first]++] = r.second;
+
+	cache.pathStart.swap(pathStart);
+	cache.vertices.swap(vertices);
+}
+
+//works a pixel's colour back out from its cached path without tracing any rays
+vec3 reshadePath(const renderCache &cache, int pixel, const parser &p){
+	vec3 weight = vec3(1,1,1);
+
+	for (int k = cache.pathStart[pixel]; k < cache.pathStart[pixel + 1]; k++){
+		const pathVertex &vertex = cache.vertices[k];
+		bool reflects;
+		vec3 reflectOrigin, reflectRay;
+		vec3 local = shadeLocal(vertex.hit, vertex.ray, vertex.oPoint, p, vertex.visibility, reflects, reflectOrigin, reflectRay);
+
+		if (!reflects)
+			return weight * local;
+		weight = weight * local;
+	}
+
+	//the path ran out of bounces
+	return vec3(0,0,0);
+}
+
+void traceColours(const parser &p, const vector<vec3> &rays, int first, int last, int imageHeight,
+				  vector<vec3> &colours, const tileCulling *culling, renderCache *paths){
+	arenaScope frame;
+	rayQueue queue(last - first);
+	for (int i = first; i < last; i++)
+		queue[i - first] = primaryRay(rays, i);
+
+	vertexRecord record;
+	if (paths)
+		record.reserve(last - first);
+	traceWavefronts(queue, p, imageHeight, colours, paths ? &record : 0, culling, first);
+
+	//the same layout storePaths makes, for just the range
+	if (paths){
+		int numPixels = last - first;
+		paths->pathStart.assign(numPixels + 1, 0);
+		for (const pair<int, pathVertex> &r : record)
+			paths->pathStart[r.first - first + 1]++;
+		for (int i = 0; i < numPixels; i++)
+			paths->pathStart[i + 1] += paths->pathStart[i];
+
+		paths->vertices.resize(paths->pathStart[numPixels]);
+		arenaVector<int> fill(paths->pathStart.begin(), paths->pathStart.end() - 1);
+		for (const pair<int, pathVertex> &r : record)
+			paths->vertices[fill[r.first - first]++] = r.second;
+	}
+}
+
+// --------------------------------------------------------------------------
+// Thin lens camera and motion blur
+
+/*
+	the first Size points of the Halton sequence in bases 2, 3, 5, 7 and 11, for the pixel (x, y),
+	lens (u, v) and shutter time of each sample pass
+	made once and only read after, so every thread shares the one table
+ */
+struct cameraSampleTable{
+	static const int Size = 256;
+	float value[Size][5];
+	cameraSampleTable();
+};
+
+cameraSampleTable::cameraSampleTable(){
+	const int bases[5] = { 2, 3, 5, 7, 11 };
+	for (int i = 0; i < Size; i++)
+		for (int d = 0; d < 5; d++){
+			float inverse = 0.f, digit = 1.f / bases[d];
+			for (int n = i; n > 0; n /= bases[d], digit /= bases[d])
+				inverse += (n % bases[d]) * digit;
+			value[i][d] = inverse;
+		}
+}
+
+static const cameraSampleTable &cameraSamples(){
+	static const cameraSampleTable table;
+	return table;
+}
+
+int samplePasses(const lensCamera &camera){
+	return std::min(std::max(camera.samples, 1), (int)cameraSampleTable::Size);
+}
+
+vector<shared_ptr<const parser> > shutterScenes(shared_ptr<const parser> scene, const lensCamera &camera){
+	const cameraSampleTable &table = cameraSamples();
+	vector<shared_ptr<const parser> > scenes(samplePasses(camera), scene);
+
+	bool moving = false;
+	for (const sphere &sph : scene->spheres)
+		moving = moving || sph.velocity != vec3(0.f);
+	if (!moving || camera.shutter <= 0.f)
+		return scenes;
+
+	for (int s = 0; s < (int)scenes.size(); s++){
+		shared_ptr<parser> moved = make_shared<parser>(*scene);
+		float t = table.value[s][4] * camera.shutter;
+		for (sphere &sph : moved->spheres)
+			sph.center += t * sph.velocity;
+		scenes[s] = moved;
+	}
+	return scenes;
+}
+
+void traceSample(const parser &scene, const vector<vec3> &rays, int first, int last, int imageWidth, int imageHeight,
+				 float fieldOfView, const lensCamera &camera, int pass, vector<vec3> &colours){
+	const cameraSampleTable &table = cameraSamples();
+	const int s = std::min(std::max(pass, 0), samplePasses(camera) - 1);
+	float planeDistance = imageWidth / (2 * tan(fieldOfView * (PI/180.f) / 2));
+
+	arenaScope frame;
+	rayQueue queue(last - first);
+
+	//the same table point for every pixel, shifted by the pixel's blue noise (swapped for the lens)
+	for (int i = first; i < last; i++){
+		vec2 rotation = sampleRotation(i, imageHeight);
+		vec2 jitter = fract(vec2(table.value[s][0], table.value[s][1]) + rotation);
+		vec2 lens = fract(vec2(table.value[s][2], table.value[s][3]) + vec2(rotation.y, rotation.x));
+
+		//through a random point of the pixel to the plane in focus, from a random point of the lens
+		vec3 onPlane = rays[i] * (planeDistance / -rays[i].z) + vec3(jitter.x - 0.5f, jitter.y - 0.5f, 0.f);
+		vec3 focus = onPlane * (camera.focusDistance / planeDistance);
+		float r = camera.aperture * sqrt(lens.x), phi = 6.2831853f * lens.y;
+		vec3 lensPoint = origin + vec3(r * cos(phi), r * sin(phi), 0.f);
+
+		pathRay &ray = queue[i - first];
+		ray = primaryRay(rays, i);
+		ray.oPoint = lensPoint;
+		ray.ray = normalize(focus - lensPoint);
+	}
+
+	//the rays don't all leave from the origin, so the tile culling doesn't hold for them
+	colours.assign(last - first, vec3(0,0,0));
+	traceWavefronts(queue, scene, imageHeight, colours, 0, 0, first, s);
+}
+
+void writeColumns(ImageBuffer &iBuff, const vector<vec3> &colours, int x0, int x1, int wnd_height, bool accumulate){
+	const int ts = ImageBuffer::TileSize;
+	vec3 tile[ImageBuffer::TilePixels];
+
+	for (int ty = 0; ty * ts < wnd_height; ty++){
+		for (int tx = x0 / ts; tx * ts < x1; tx++){
+			int left = tx * ts, y0 = ty * ts;
+
+			//partial tiles along the edge of the window (or of the columns) go pixel by pixel
+			if (left < x0 || left + ts > x1 || y0 + ts > wnd_height){
+				for (int w = std::max(left, x0); w < std::min(left + ts, x1); w++)
+					for (int h = y0; h < std::min(y0 + ts, wnd_height); h++){
+						if (accumulate)
+							iBuff.AccumulatePixel(w, h, colours[(w - x0)*wnd_height + h]);
+						else
+							iBuff.SetPixel(w, h, colours[(w - x0)*wnd_height + h]);
+					}
+				continue;
+			}
+
+			for (int j = 0; j < ts; j++)
+				for (int i = 0; i < ts; i++)
+					tile[j*ts + i] = colours[(left - x0 + i)*wnd_height + (y0 + j)];
+			if (accumulate)
+				iBuff.AccumulateTile(tx, ty, tile);
+			else
+				iBuff.SetTile(tx, ty, tile);
+		}
+	}
+}
+
+void writeTiles(ImageBuffer &iBuff, const vector<vec3> &colours, int wnd_width, int wnd_height, bool accumulate){
+	writeColumns(iBuff, colours, 0, wnd_width, wnd_height, accumulate);
+}
+
+/*
+	renders in two passes: every primary ray first records its closest hit,
+	then the hit buffer is bucketed by material and shaded in bulk
+	with wavefront set, reflection rays are queued up per bounce and traced a bounce at a time
+	instead of recursing from inside the shading pass
+ */
+void generateScene(ImageBuffer &iBuff, const parser &p, const vector<vec3> &rays,  int wnd_width, int wnd_height,
+				   bool wavefront, renderCache *cache){
+
+	int numRays = wnd_width * wnd_height;
+	vector<vec3> colours(numRays, vec3(0,0,0));
+	tileCulling culling = cullTiles(p, rays, wnd_width, wnd_height);
+	arenaScope frame;
+
+	if (wavefront || cache){
+		rayQueue queue(numRays);
+		for (int i = 0; i < numRays; i++)
+			queue[i] = primaryRay(rays, i);
+
+		//every path has at least its primary vertex
+		vertexRecord record;
+		if (cache)
+			record.reserve(numRays);
+		traceWavefronts(queue, p, wnd_height, colours, cache ? &record : 0, &culling);
+
+		if (cache){
+			cache->width = wnd_width;
+			cache->height = wnd_height;
+			cache->pathStart.clear();
+			storePaths(*cache, record, arenaVector<char>(numRays, 1));
+			cache->colours = colours;
+		}
+	}
+	else {
+		//visibility pass
+		arenaVector<hitRecord> hits(numRays);
+		for (int i = 0; i < numRays; i++)
+			hits[i] = p.trianglePages ? closestHit(rays[i], p, origin) : primaryHit(culling, i, rays[i], p);
+
+		//shading pass
+		arenaVector<int> order;
+		arenaVector<unsigned long long> materialKeys;
+		sortByMaterial(hits, p, order, materialKeys);
+		for (int index : order)
+			colours[index] = shadeHit(hits[index], rays[index], origin, p, sampleRotation(index, wnd_height));
+	}
+
+	writeTiles(iBuff, colours, wnd_width, wnd_height);
+}
+
+// --------------------------------------------------------------------------
+// Incremental re-rendering of edited scenes
+
+//whether two versions of a primitive differ in shape (geometry) or just in colour (material)
+bool sameMaterial(vec3 Cr0, vec3 Cp0, float phong0, vec3 Cr1, vec3 Cp1, float phong1){
+	return Cr0 == Cr1 && Cp0 == Cp1 && phong0 == phong1;
+}
+
+//whether two primitives are textured with the same image (or both have none), indices are per scene
+bool sameTexture(const parser &scene0, int texture0, const parser &scene1, int texture1){
+	if (texture0 < 0 || texture1 < 0)
+		return texture0 == texture1;
+	return scene0.textureFiles[texture0] == scene1.textureFiles[texture1];
+}
+
+/*
+	whether a cached path vertex could come out differently now that the given primitives moved:
+	its ray or its shadow ray might cross the old or the new position of one of them
+ */
+bool touchesMoved(const pathVertex &vertex, const vector<primitiveRef> &moved, const parser &oldScene, const parser &newScene){
+	vec3 shadowStart, shadowRay;
+	float shadowT = 0;
+	if (vertex.hit.type != HIT_NONE){
+		const lightSource &light = newScene.lightSources[0];
+		shadowStart = shadowOrigin(vertex.hit, vertex.ray, vertex.oPoint, newScene);
+		shadowRay = normalize(light.pos - shadowStart);
+		shadowT = length(light.pos - shadowStart);
+	}
+
+	for (const primitiveRef &m : moved){
+		if (vertex.hit.type == m.type && vertex.hit.id == m.id)
+			return true;
+
+		const parser *versions[2] = { &oldScene, &newScene };
+		for (const parser *p : versions){
+			//ties count, closestHit keeps whichever primitive it tested first
+			float t = primitiveDistance(*p, m.type, m.id, vertex.ray, vertex.oPoint);
+			if (t > 0 && t <= vertex.hit.t)
+				return true;
+
+			if (vertex.hit.type == HIT_NONE)
+				continue;
+			t = primitiveDistance(*p, m.type, m.id, shadowRay, shadowStart);
+			if (t > 0 && t < shadowT)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+sceneEdit diffScenes(const parser &oldScene, const parser &newScene){
+	sceneEdit edit;
+
+	//adding or removing anything, or moving or reshaping the light, can change every pixel
+	//paged triangles aren't compared one by one either
+	const lightSource &oldLight = oldScene.lightSources[0], &newLight = newScene.lightSources[0];
+	edit.everything = oldScene.trianglePages || newScene.trianglePages
+					|| oldScene.triangles.size() != newScene.triangles.size()
+					|| oldScene.spheres.size() != newScene.spheres.size()
+					|| oldScene.planes.size() != newScene.planes.size()
+					|| oldScene.lightSources.size() != newScene.lightSources.size()
+					|| oldLight.pos != newLight.pos || oldLight.shape != newLight.shape
+					|| oldLight.radius != newLight.radius || oldLight.u != newLight.u || oldLight.v != newLight.v
+					|| oldScene.shadowSamples != newScene.shadowSamples;
+	edit.relight = false;
+	if (edit.everything)
+		return edit;
+
+	edit.relight = oldLight.Cl != newLight.Cl || oldLight.Ca != newLight.Ca;
+
+	//sort every primitive into moved, recoloured (flagged by material key) or untouched
+	vector<primitiveRef> &moved = edit.moved;
+	vector<char> &recoloured = edit.recoloured;
+	recoloured.assign(1 + newScene.triangles.size() + newScene.spheres.size() + newScene.planes.size(), 0);
+	int key = 1;
+	for (int i = 0; i < (int)newScene.triangles.size(); i++, key++){
+		const triangle &a = oldScene.triangles[i], &b = newScene.triangles[i];
+		if (a.a != b.a || a.b != b.b || a.c != b.c){
+			primitiveRef m = { HIT_TRIANGLE, i };
+			moved.push_back(m);
+		}
+		else
+			recoloured[key] = !sameMaterial(a.Cr, a.Cp, a.phong, b.Cr, b.Cp, b.phong)
+							|| !sameTexture(oldScene, a.texture, newScene, b.texture)
+							|| a.uvA != b.uvA || a.uvB != b.uvB || a.uvC != b.uvC;
+	}
+	for (int i = 0; i < (int)newScene.spheres.size(); i++, key++){
+		const sphere &a = oldScene.spheres[i], &b = newScene.spheres[i];
+		if (a.center != b.center || a.radius != b.radius){
+			primitiveRef m = { HIT_SPHERE, i };
+			moved.push_back(m);
+		}
+		else
+			recoloured[key] = !sameMaterial(a.Cr, a.Cp, a.phong, b.Cr, b.Cp, b.phong)
+							|| !sameTexture(oldScene, a.texture, newScene, b.texture);
+	}
+	for (int i = 0; i < (int)newScene.planes.size(); i++, key++){
+		const plane &a = oldScene.planes[i], &b = newScene.planes[i];
+		if (a.n != b.n || a.q != b.q){
+			primitiveRef m = { HIT_PLANE, i };
+			moved.push_back(m);
+		}
+		else
+			recoloured[key] = !sameMaterial(a.Cr, a.Cp, a.phong, b.Cr, b.Cp, b.phong)
+							|| !sameTexture(oldScene, a.texture, newScene, b.texture) || a.textureScale != b.textureScale;
+	}
+
+	//past a handful of moved primitives testing every path against them costs more than tracing again,
+	//and touchesMoved only follows the shadow ray to the centre of an area light
+	if (moved.size() > 16 || (!moved.empty() && newLight.shape != LIGHT_POINT))
+		edit.everything = true;
+	return edit;
+}
+
+void updateColumns(const sceneEdit &edit, const parser &oldScene, const parser &newScene, const vector<vec3> &rays,
+				   const renderCache &cache, int first, int last, const tileCulling *culling, vector<vec3> &colours,
+				   renderCache &paths, int &retraced, int &reshaded){
+	arenaScope frame;
+	int numPixels = last - first;
+	arenaVector<char> retrace(numPixels, 0), reshade(numPixels, 0);
+
+	for (int i = first; i < last; i++){
+		if (edit.everything){
+			retrace[i - first] = 1;
+			continue;
+		}
+
+		for (int k = cache.pathStart[i]; k < cache.pathStart[i + 1]; k++){
+			const pathVertex &vertex = cache.vertices[k];
+			if (!edit.moved.empty() && touchesMoved(vertex, edit.moved, oldScene, newScene)){
+				retrace[i - first] = 1;
+				break;
+			}
+			if (edit.relight || edit.recoloured[materialKey(vertex.hit, newScene)])
+				reshade[i - first] = 1;
+		}
+	}
+
+	//trace the affected pixels again from scratch, keeping their new paths
+	colours.assign(cache.colours.begin() + first, cache.colours.begin() + last);
+	rayQueue queue;
+	queue.reserve(count(retrace.begin(), retrace.end(), 1));
+	for (int i = first; i < last; i++){
+		if (retrace[i - first]){
+			queue.push_back(primaryRay(rays, i));
+			colours[i - first] = vec3(0,0,0);
+			retraced++;
+		}
+	}
+
+	vertexRecord record;
+	record.reserve(queue.size());
+	traceWavefronts(queue, newScene, cache.height, colours, &record, queue.empty() ? 0 : culling, first);
+
+	//the range's paths laid out as traceColours keeps them, the retraced ones new and the rest as they were
+	paths.width = cache.width;
+	paths.height = cache.height;
+	paths.pathStart.assign(numPixels + 1, 0);
+	for (int i = 0; i < numPixels; i++)
+		if (!retrace[i])
+			paths.pathStart[i + 1] = cache.pathStart[first + i + 1] - cache.pathStart[first + i];
+	for (const pair<int, pathVertex> &r : record)
+		paths.pathStart[r.first - first + 1]++;
+	for (int i = 0; i < numPixels; i++)
+		paths.pathStart[i + 1] += paths.pathStart[i];
+
+	paths.vertices.resize(paths.pathStart[numPixels]);
+	arenaVector<int> fill(paths.pathStart.begin(), paths.pathStart.end() - 1);
+	for (int i = 0; i < numPixels; i++)
+		if (!retrace[i])
+			for (int k = cache.pathStart[first + i]; k < cache.pathStart[first + i + 1]; k++)
+				paths.vertices[fill[i]++] = cache.vertices[k];
+	for (const pair<int, pathVertex> &r : record)
+		paths.vertices[fill[r.first - first]++] = r.second;
+
+	//recolour the rest from the hits they already have
+	for (int i = 0; i < numPixels; i++){
+		if (reshade[i] && !retrace[i]){
+			colours[i] = reshadePath(cache, first + i, newScene);
+			reshaded++;
+		}
+	}
+}
+
+void updateScene(ImageBuffer &iBuff, const parser &oldScene, const parser &newScene, const vector<vec3> &rays,
+				 renderCache &cache, int &retraced, int &reshaded){
+	sceneEdit edit = diffScenes(oldScene, newScene);
+	int numPixels = cache.width * cache.height;
+	retraced = reshaded = 0;
+
+	//only worth culling when something is traced again
+	tileCulling culling;
+	if (edit.everything || !edit.moved.empty())
+		culling = cullTiles(newScene, rays, cache.width, cache.height);
+
+	vector<vec3> colours;
+	renderCache paths;
+	updateColumns(edit, oldScene, newScene, rays, cache, 0, numPixels, &culling, colours, paths, retraced, reshaded);
+
+	if (edit.everything)
+		writeTiles(iBuff, colours, cache.width, cache.height);
+	else
+		for (int i = 0; i < numPixels; i++)
+			if (colours[i] != cache.colours[i])
+				iBuff.SetPixel(i / cache.height, i % cache.height, colours[i]);
+
+	cache.colours.swap(colours);
+	cache.pathStart.swap(paths.pathStart);
+	cache.vertices.swap(paths.vertices);
+}
+
+// --------------------------------------------------------------------------
+// Self intersection regression
+
+//copy of a scene with every position and size multiplied by s, the camera sees the same picture
+parser scaledScene(const parser &p, float s){
+	parser scaled = p;
+	for (sphere &sph : scaled.spheres){
+		sph.center *= s;
+		sph.radius *= s;
+	}
+	for (triangle &tri : scaled.triangles.edit()){
+		tri.a *= s;
+		tri.b *= s;
+		tri.c *= s;
+	}
+	for (plane &pln : scaled.planes)
+		pln.q *= s;
+	for (lightSource &light : scaled.lightSources){
+		light.pos *= s;
+		light.radius *= s;
+		light.u *= s;
+		light.v *= s;
+	}
+	scaled.compile();
+	return scaled;
+}
+
+//whether a secondary ray's closest hit is the surface it just left
+bool selfHit(const hitRecord &hit, primitiveRef from, const parser &p, float maxT){
+	if (hit.type != from.type || hit.id != from.id || hit.t >= maxT)
+		return false;
+
+	//a ray can cross a sphere it leaves, just not right where it leaves it
+	if (hit.type == HIT_SPHERE)
+		return hit.t < 1e-3f * p.spheres[hit.id].radius;
+	return true;
+}
+
+static const float selfHitScales[] = { 1e-4f, 1e-2f, 1.f, 1e2f };
+
+//self hits of the shadow and reflection rays leaving the primary hits of scene, for each way of
+//leaving a surface from firstMethod on (0 the old 0.0001 nudge, 1 offsetOrigin, 2 offsetOrigin + skip)
+static int countSelfHits(const parser &scene, const vector<vec3> &rays, int firstMethod, int selfHits[3]){
+	const lightSource &light = scene.lightSources[0];
+	int secondary = 0;
+	for (const vec3 &ray : rays){
+		hitRecord hit = closestHit(ray, scene, origin);
+		if (hit.type == HIT_NONE)
+			continue;
+
+		vec3 hitPoint = hitPosition(hit, ray, origin);
+		vec3 normal = hitNormal(hit, hitPoint, scene);
+		primitiveRef from = hitPrimitive(hit);
+		secondary += (hit.type == HIT_SPHERE) ? 2 : 1;
+
+		for (int method = firstMethod; method < 3; method++){
+			vec3 start = (method == 0) ? hitPoint + (normal * 0.0001f) : leaveSurface(hitPoint, normal, ray);
+			primitiveRef skip = (method == 2) ? from : noPrimitive;
+
+			vec3 toLight = normalize(light.pos - start);
+			if (selfHit(closestHit(toLight, scene, start, skip), from, scene, length(light.pos - start)))
+				selfHits[method]++;
+
+			if (hit.type == HIT_SPHERE){
+				vec3 reflected = ray - (2*(dot(ray, normal))*normal);
+				if (selfHit(closestHit(reflected, scene, start, skip), from, scene, delimitor))
+					selfHits[method]++;
+			}
+		}
+	}
+	return secondary;
+}
+
+void selfHitReport(const parser &p, const vector<vec3> &rays){
+	if (p.trianglePages || p.lightSources.empty()){
+		printf("self hit report needs a lit scene held in memory\n");
+		return;
+	}
+
+	const char *methods[] = { "0.0001 nudge", "offsetOrigin", "offsetOrigin + skip" };
+	for (float s : selfHitScales){
+		int selfHits[3] = { 0, 0, 0 };
+		int secondary = countSelfHits(scaledScene(p, s), rays, 0, selfHits);
+		printf("scene scale %g, %d secondary rays, self hits:", s, secondary);
+		for (int method = 0; method < 3; method++)
+			printf(" %s %d%s", methods[method], selfHits[method], (method < 2) ? "," : "\n");
+	}
+}
+
+int checkSelfHits(const parser &p, const vector<vec3> &rays){
+	if (p.trianglePages || p.lightSources.empty())
+		return 0;
+
+	int total = 0;
+	for (float s : selfHitScales){
+		int selfHits[3] = { 0, 0, 0 };
+		countSelfHits(scaledScene(p, s), rays, 2, selfHits);
+		total += selfHits[2];
+	}
+	return total;
+}
+
+// --------------------------------------------------------------------------
+// Kernel benchmark
+
+//best of a few runs of each pass of one bounce over the primary rays, in milliseconds
+struct kernelTiming{
+	double hits, shadows, shading;
+};
+
+//runs the passes once with kernels, keeping whichever of them beat their best so far
+void timeKernels(const traceKernels &kernels, const parser &p, const rayQueue &queue, wavefrontScratch &scratch,
+				 vector<vec3> &colours, rayQueue &next, kernelTiming &best){
+	auto start = chrono::steady_clock::now();
+	kernels.closestHits(queue, p, scratch.hits);
+	auto hitsDone = chrono::steady_clock::now();
+	kernels.castShadows(queue, scratch.hits, p, 0, 0, scratch.visibility);
+	auto shadowsDone = chrono::steady_clock::now();
+	sortByMaterial(scratch.hits, p, scratch.order, scratch.materialKeys);
+	next.clear();
+	kernels.shade(queue, scratch.hits, scratch.visibility, scratch.order, p, colours, 0, next, 0);
+	auto shadingDone = chrono::steady_clock::now();
+
+	best.hits = std::min(best.hits, chrono::duration<double, milli>(hitsDone - start).count());
+	best.shadows = std::min(best.shadows, chrono::duration<double, milli>(shadowsDone - hitsDone).count());
+	best.shading = std::min(best.shading, chrono::duration<double, milli>(shadingDone - shadowsDone).count());
+}
+
+void kernelReport(const parser &p, const vector<vec3> &rays){
+	if (p.trianglePages || p.lightSources.empty()){
+		printf("kernel report needs a lit scene held in memory\n");
+		return;
+	}
+
+	arenaScope scratch;
+	rayQueue queue(rays.size()), next;
+	next.reserve(rays.size());
+	for (int i = 0; i < (int)rays.size(); i++)
+		queue[i] = primaryRay(rays, i);
+	wavefrontScratch passes;
+	vector<vec3> colours(rays.size());
+
+	//the two take turns, so anything else slowing the machine down hits both
+	const traceKernels &picked = selectKernels(p);
+	kernelTiming generic = { 1e30, 1e30, 1e30 }, specialized = generic;
+	for (int run = 0; run < 5; run++){
+		timeKernels(genericKernels, p, queue, passes, colours, next, generic);
+		timeKernels(picked, p, queue, passes, colours, next, specialized);
+	}
+
+	printf("kernels for the scene: %s, against %s\n", picked.name, genericKernels.name);
+	const char *names[] = { "visibility", "shadows", "shading", "together" };
+	double genericMs[] = { generic.hits, generic.shadows, generic.shading, generic.hits + generic.shadows + generic.shading };
+	double specializedMs[] = { specialized.hits, specialized.shadows, specialized.shading,
+							   specialized.hits + specialized.shadows + specialized.shading };
+	for (int k = 0; k < 4; k++)
+		printf("%-11s generic %8.2f ms, specialized %8.2f ms (%.2fx)\n", names[k], genericMs[k], specializedMs[k],
+			   genericMs[k] / specializedMs[k]);
+}
+
+coherenceTiming coherenceBenchmark(const parser &p, const vector<vec3> &rays, int imageHeight, int bandColumns){
+	coherenceTiming timing = { 1e30, 1e30, 1e30 };
+	vector<vec3> colours(rays.size());
+
+	//sorted and unsorted runs take turns, so anything else slowing the machine down hits both
+	parser sorted = p, unsorted = p;
+	sorted.sortBounces = true;
+	unsorted.sortBounces = false;
+	for (int run = 0; run < 5; run++)
+		for (int coherent = 0; coherent < 2; coherent++){
+			arenaScope scratch;
+			rayQueue queue(rays.size());
+			for (int i = 0; i < (int)rays.size(); i++)
+				queue[i] = primaryRay(rays, i);
+			auto start = chrono::steady_clock::now();
+			traceWavefronts(queue, coherent ? sorted : unsorted, imageHeight, colours, 0, 0, 0);
+			double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			double &best = coherent ? timing.sortedMs : timing.unsortedMs;
+			best = std::min(best, ms);
+		}
+
+	//the primary hits cut into bands of columns, as the renderer's threads shade them
+	arenaScope scratch;
+	int bandRays = std::max(bandColumns, 1) * imageHeight;
+	vector<arenaVector<hitRecord> > bands;
+	for (int first = 0; first < (int)rays.size(); first += bandRays){
+		bands.emplace_back();
+		bands.back().reserve(bandRays);
+		for (int i = first; i < std::min(first + bandRays, (int)rays.size()); i++)
+			bands.back().push_back(closestHit(rays[i], p, origin));
+	}
+	arenaVector<int> order;
+	arenaVector<unsigned long long> keys;
+	for (int run = 0; run < 5; run++){
+		auto start = chrono::steady_clock::now();
+		for (const arenaVector<hitRecord> &hits : bands)
+			sortByMaterial(hits, p, order, keys);
+		timing.materialSortMs = std::min(timing.materialSortMs,
+										 chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+	}
+	return timing;
+}
@@ -0,0 +1,258 @@
+
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "parser.h"
+
+class ImageBuffer;
+
+using namespace glm;
+using namespace std;
+
+//every primary ray starts at the camera, which sits at the origin
+const vec3 origin = vec3(0,0,0);
+
+//distance reported by the intersection tests when a ray misses
+const float delimitor = 9999.f;
+
+//paths that are still reflecting after this many bounces are treated as misses
+const int maxBounces = 32;
+
+
+vector<vec3> generateRay(float viewAngle, float displaySizeX, float displaySizeY);
+
+//which vector in the parser a hit record's id refers to
+enum hitType { HIT_NONE = 0, HIT_TRIANGLE, HIT_SPHERE, HIT_PLANE };
+
+//a single primitive of a scene
+struct primitiveRef{
+	int type;
+	int id;
+};
+
+//what primary rays leave from
+const primitiveRef noPrimitive = { HIT_NONE, -1 };
+
+//the kinds of primitive a scene holds, the wavefront tracer picks a kernel specialized for them
+enum sceneFeature { SCENE_TRIANGLES = 1, SCENE_SPHERES = 2, SCENE_PLANES = 4, SCENE_ALL = 7 };
+unsigned int sceneFeatures(const parser &p);
+
+vec3 intersectTriangle(vec3 d, vec3 p, const triangle &t);
+float intersectSphere(vec3 direction, vec3 center, vec3 oPoint, float radius);
+float intersectSphereFrom(vec3 direction, vec3 center, vec3 oPoint, float radius);
+float intersectPlane(vec3 d, vec3 q, vec3 oPoint, vec3 n);
+
+/*
+	moves a point on a surface off it along n by a few float steps, so a ray leaving
+	from it can't find the surface again through rounding, at any scale
+ */
+vec3 offsetOrigin(vec3 p, vec3 n);
+
+//whether the light (the centre of an area light) is blocked from dt, which lies on the primitive from (never tested for a self hit)
+bool shadow(vec3 dt, const parser &p, primitiveRef from = noPrimitive);
+
+/*
+	compact record of the closest hit along a ray, written by the visibility pass
+	u and v are the barycentrics (r,s from intersectTriangle) and only meaningful for triangles
+*/
+struct hitRecord{
+	int type;
+	int id;
+	float t;
+	float u, v;
+};
+
+//rays leaving the surface of a primitive pass from so they can't hit it where they start
+hitRecord closestHit(vec3 ray, const parser &p, vec3 oPoint, primitiveRef from = noPrimitive);
+vec3 intersect(vec3 ray, const parser &p, vec3 oPoint, primitiveRef from = noPrimitive, vec2 rotation = vec2(0.f));
+
+//the shading half of intersect: lights a hit found along ray, following a sphere's reflection
+vec3 shadeHit(const hitRecord &hit, vec3 ray, vec3 oPoint, const parser &p, vec2 rotation);
+
+
+//one segment of a pixel's path: the ray, what it hit and how much of the light that hit point could see
+struct pathVertex{
+	vec3 oPoint;
+	vec3 ray;
+	hitRecord hit;
+	float visibility;	//1 fully lit, 0 in shadow, in between in an area light's penumbra
+};
+
+/*
+	per pixel record of a finished render, kept so an edited scene can be re-rendered incrementally
+	pixels are indexed column by column like the rays, pixel i's path is
+	vertices[pathStart[i]] up to (not including) vertices[pathStart[i+1]]
+*/
+struct renderCache{
+	int width, height;
+	vector<int> pathStart;
+	vector<pathVertex> vertices;
+	vector<vec3> colours;
+};
+
+/*
+	for every tile of the image, the primitives the primary rays through it could hit, so those
+	rays test only them: each primitive's bounds are projected onto the image and it is listed
+	in the tiles they cover, planes are tested against the frustum of each tile
+	with a bvh the triangles are listed by subtree instead: the hierarchy is cut where a node's box
+	covers only a few tiles, and each tile gets the subtrees that reach it to traverse
+	the lists are conservative, the spheres and planes in id order and the subtrees nearest first
+	(equal distances go to the lower triangle id whatever the order), so the closest hits come out
+	exactly the same
+	paged scenes, and ones with a wide bvh, keep their triangles unculled
+ */
+struct tileCulling{
+	static const int TileSize = 16;
+
+	//most tiles a subtree's box may cover before it's cut into its children
+	static const int SubtreeTiles = 16;
+
+	int width, height;
+	int tilesX, tilesY;
+	bool triangles;
+	bool subtrees;		//the triangle ids are the bvh nodes of subtrees rather than triangles
+	//tile t's candidates of each kind are ids[start[t]] up to ids[start[t+1]], tile t = tx * tilesY + ty
+	vector<int> triangleStart, triangleIds;
+	vector<int> sphereStart, sphereIds;
+	vector<int> planeStart, planeIds;
+};
+
+tileCulling cullTiles(const parser &p, const vector<vec3> &rays, int wnd_width, int wnd_height);
+
+/*
+	traces the pixels first up to (not including) last wavefront style, writing pixel i's colour
+	to colours[i - first], so colours only has to hold the range
+	ranges that don't overlap can be traced at the same time from different threads,
+	as long as the scene isn't paged; culling, if given, must have been made for the same rays
+	imageHeight is the height of the image the rays are for, it lays out the area light samples
+	if paths is given the range's paths are kept in its pathStart and vertices, as if the range were
+	the whole image (pixel i's path starts at vertices[pathStart[i - first]])
+ */
+void traceColours(const parser &p, const vector<vec3> &rays, int first, int last, int imageHeight,
+				  vector<vec3> &colours, const tileCulling *culling = 0, renderCache *paths = 0);
+
+/*
+	thin lens camera with a shutter, at the origin looking down -z like generateRay's pinhole
+	a render from it is the mean of samples passes (up to 256) of one ray per pixel, each through
+	its own point of the pixel and leaving from a point on a lens aperture across (as a radius),
+	focused on the plane focusDistance in front of it
+	spheres move on by velocity * t, t in [0, shutter) is the same for every pixel of a pass
+ */
+struct lensCamera{
+	lensCamera():aperture(0.f),focusDistance(1.f),shutter(0.f),samples(1){}
+
+	float aperture;
+	float focusDistance;
+	float shutter;
+	int samples;
+
+	//renders exactly like the pinhole, through the middle of each pixel
+	bool pinhole() const { return aperture <= 0.f && shutter <= 0.f && samples <= 1; }
+};
+
+//sample passes a render from camera takes, no more than the sample table holds
+int samplePasses(const lensCamera &camera);
+
+/*
+	the scene each sample pass of camera sees, with its moving spheres moved on to the pass's time
+	when the shutter is open and something moves, and scene itself otherwise
+	the moved ones are copies of scene, which share its triangles rather than copying them
+ */
+vector<shared_ptr<const parser> > shutterScenes(shared_ptr<const parser> scene, const lensCamera &camera);
+
+/*
+	traceColours for one sample pass of a lens camera: the colours of pixels first up to last through
+	the pass's point of each pixel and of the lens, traced in scene (shutterScenes' scene for the pass)
+	a render is the mean of its passes, an ImageBuffer's AccumulateTile takes them as they come in
+	fieldOfView and imageWidth must be the ones rays were made with
+	the lens, pixel and time samples come from a table made once and shared by every thread,
+	shifted for each pixel by its blue noise so neighbouring pixels don't share their samples, and
+	the area light samples are shifted on for every pass
+ */
+void traceSample(const parser &scene, const vector<vec3> &rays, int first, int last, int imageWidth, int imageHeight,
+				 float fieldOfView, const lensCamera &camera, int pass, vector<vec3> &colours);
+
+/*
+	hands a column by column colour buffer (like the rays) to the image a whole tile at a time,
+	replacing what it held or, with accumulate, adding the colours to it as one more sample per pixel
+ */
+void writeTiles(ImageBuffer &iBuff, const vector<vec3> &colours, int wnd_width, int wnd_height,
+				bool accumulate = false);
+
+//the same for just the columns x0 up to (not including) x1, which colours holds from column x0 on
+void writeColumns(ImageBuffer &iBuff, const vector<vec3> &colours, int x0, int x1, int wnd_height,
+				  bool accumulate = false);
+
+/*
+	renders the scene into iBuff, with wavefront set reflection rays are traced
+	a bounce at a time instead of recursively
+	if cache is given the paths of every pixel are kept in it (this always traces wavefront)
+*/
+void generateScene(ImageBuffer &iBuff, const parser &p, const vector<vec3> &rays,  int wnd_width, int wnd_height,
+				   bool wavefront, renderCache *cache = 0);
+
+/*
+	brings a render of oldScene made with generateScene up to date with newScene
+	pixels whose paths (or shadow rays) could touch a moved primitive are traced again,
+	pixels that only saw a recoloured one are reshaded from the cached hits
+	returns the number of pixels traced and reshaded through retraced and reshaded
+*/
+void updateScene(ImageBuffer &iBuff, const parser &oldScene, const parser &newScene, const vector<vec3> &rays,
+				 renderCache &cache, int &retraced, int &reshaded);
+
+//what an edit from one version of a scene to the next changed, as updateScene sorts it
+struct sceneEdit{
+	bool everything;				//any pixel could have changed, they are all traced again
+	bool relight;					//the light's colours changed, every pixel is reshaded
+	vector<primitiveRef> moved;
+	vector<char> recoloured;		//by materialKey in the new scene
+};
+
+sceneEdit diffScenes(const parser &oldScene, const parser &newScene);
+
+/*
+	updateScene for just the pixels first up to last of cache (a whole render of oldScene with its
+	paths), leaving the rest of it alone so ranges can be brought up to date side by side
+	their new colours go in colours and their paths in paths, as traceColours keeps a range's;
+	culling (of newScene) is used for the pixels traced again, retraced and reshaded are added to
+*/
+void updateColumns(const sceneEdit &edit, const parser &oldScene, const parser &newScene, const vector<vec3> &rays,
+				   const renderCache &cache, int first, int last, const tileCulling *culling, vector<vec3> &colours,
+				   renderCache &paths, int &retraced, int &reshaded);
+
+/*
+	counts the shadow and reflection rays leaving the primary hits that come straight back
+	to the surface they left, with the old fixed 0.0001 nudge, with offsetOrigin alone,
+	and with offsetOrigin plus skipping the primitive the ray leaves from
+	the scene is scaled up and down to show which of them hold at every scale
+	(up to the point where it reaches past delimitor)
+ */
+void selfHitReport(const parser &p, const vector<vec3> &rays);
+
+/*
+	the same rays at the same scales, but only the way the tracer itself leaves a surface, which
+	must never hit it again: returns how many self hits there were, so 0 passes
+	scenes the report can't run on (paged or unlit) pass as they are
+ */
+int checkSelfHits(const parser &p, const vector<vec3> &rays);
+
+/*
+	times the visibility, shadow and shading passes of the primary rays on the scene as it is, with
+	the generic kernels and with the ones picked for what it holds and how it's lit
+ */
+void kernelReport(const parser &p, const vector<vec3> &rays);
+
+//best of 5 runs, in milliseconds
+struct coherenceTiming{
+	double sortedMs;		//the wavefront tracer with parser::sortBounces, each bounce after the first sorted by sortCoherent
+	double unsortedMs;		//the bounces traced in the order they were shaded in, as the tracer runs by default
+	double materialSortMs;	//sortByMaterial alone on the primary hits, a band of columns at a time
+};
+
+/*
+	times what keeping the wavefront's rays coherent costs and buys on a scene held in memory:
+	the whole trace of rays (imageHeight pixels high) with and without the sorting of the bounces,
+	and the material sort over bands bandColumns wide
+ */
+coherenceTiming coherenceBenchmark(const parser &p, const vector<vec3> &rays, int imageHeight, int bandColumns);
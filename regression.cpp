@@ -0,0 +1,210 @@
+#include <cstdio>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <algorithm>
+
+#include "regression.h"
+#include "parser.h"
+#include "renderer.h"
+#include "raytracer.h"
+#include "texturecache.h"
+
+using namespace std;
+using namespace glm;
+
+static string directoryOf(const string &filename){
+    size_t slash = filename.find_last_of("/\\");
+    return slash == string::npos ? "" : filename.substr(0, slash + 1);
+}
+
+bool readCorpus(const string &corpusFile, vector<regressionCase> &cases){
+    cases.clear();
+    ifstream in(corpusFile.c_str());
+    if (!in){
+        printf("can't open %s\n", corpusFile.c_str());
+        return false;
+    }
+
+    bool ok = true;
+    string directory = directoryOf(corpusFile), line;
+    for (int number = 1; getline(in, line); number++){
+        line = line.substr(0, line.find('#'));
+        istringstream fields(line);
+        regressionCase c;
+        c.line = number;
+        c.maxDeltaE = 2.3f;
+        c.maxPercent = 0.1f;
+        if (!(fields >> c.scene))
+            continue;
+        if (!(fields >> c.golden >> c.maxMilliseconds)){
+            printf("%s:%d: needs a scene, a golden image and a time limit, skipped\n", corpusFile.c_str(), number);
+            ok = false;
+            continue;
+        }
+        fields >> c.maxDeltaE >> c.maxPercent;
+        c.scene = directory + c.scene;
+        c.golden = directory + c.golden;
+        cases.push_back(c);
+    }
+    return ok && !in.bad();
+}
+
+// --------------------------------------------------------------------------
+
+//8 bit sRGB to CIELAB under D65, the displayed bytes are taken as sRGB like a monitor shows them
+static vec3 toLab(const unsigned char *rgb){
+    vec3 c;
+    for (int i = 0; i < 3; i++){
+        float v = rgb[i] / 255.f;
+        c[i] = v <= 0.04045f ? v / 12.92f : pow((v + 0.055f) / 1.055f, 2.4f);
+    }
+    vec3 xyz(0.4124f * c.r + 0.3576f * c.g + 0.1805f * c.b,
+             0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b,
+             0.0193f * c.r + 0.1192f * c.g + 0.9505f * c.b);
+    xyz /= vec3(0.95047f, 1.f, 1.08883f);
+    for (int i = 0; i < 3; i++)
+        xyz[i] = xyz[i] > 0.008856f ? cbrt(xyz[i]) : 7.787f * xyz[i] + 16.f / 116.f;
+    return vec3(116.f * xyz.y - 16.f, 500.f * (xyz.x - xyz.y), 200.f * (xyz.y - xyz.z));
+}
+
+imageDifference compareImages(const vector<unsigned char> &image, const vector<unsigned char> &golden,
+                              float maxDeltaE){
+    imageDifference d = { image.size() == golden.size(), 0.f, 0.f, 0 };
+    int pixels = (int)image.size() / 3;
+    if (!d.sizeMatches){
+        d.pixelsOver = pixels;
+        return d;
+    }
+
+    double total = 0;
+    for (int i = 0; i < pixels; i++){
+        float deltaE = length(toLab(&image[3 * i]) - toLab(&golden[3 * i]));
+        total += deltaE;
+        d.maxDeltaE = std::max(d.maxDeltaE, deltaE);
+        d.pixelsOver += deltaE > maxDeltaE;
+    }
+    d.meanDeltaE = pixels ? (float)(total / pixels) : 0.f;
+    return d;
+}
+
+bool readPPM(const string &filename, int &width, int &height, vector<unsigned char> &pixels){
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f)
+        return false;
+
+    int maxValue;
+    bool ok = fscanf(f, "P6 %d %d %d", &width, &height, &maxValue) == 3 && maxValue == 255
+              && width > 0 && height > 0 && fgetc(f) != EOF;
+    if (ok){
+        pixels.resize((size_t)width * height * 3);
+        ok = fread(pixels.data(), 1, pixels.size(), f) == pixels.size();
+    }
+    fclose(f);
+    return ok;
+}
+
+bool writePPM(const string &filename, int width, int height, const vector<unsigned char> &pixels){
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f)
+        return false;
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    bool ok = fwrite(pixels.data(), 1, pixels.size(), f) == pixels.size();
+    return fclose(f) == 0 && ok;
+}
+
+vector<unsigned char> displayImage(const vector<vec3> &colours, int width, int height){
+    vector<unsigned char> pixels((size_t)width * height * 3);
+    for (int x = 0; x < width; x++)
+        for (int y = 0; y < height; y++){
+            vec3 c = clamp(colours[x * height + y], 0.f, 1.f);
+            unsigned char *p = &pixels[3 * ((height - 1 - y) * width + x)];
+            p[0] = (unsigned char)(255 * c.r);
+            p[1] = (unsigned char)(255 * c.g);
+            p[2] = (unsigned char)(255 * c.b);
+        }
+    return pixels;
+}
+
+// --------------------------------------------------------------------------
+
+int runRegression(const string &corpusFile, int width, int height, int threads, int frames, bool update){
+    vector<regressionCase> cases;
+    bool corpusOk = readCorpus(corpusFile, cases);
+    printf("regression run, %d scenes at %dx%d on %d thread%s\n", (int)cases.size(), width, height,
+           threads, threads == 1 ? "" : "s");
+
+    //the scenes are set up as the window sets up its own: textures attached, sampled for this size
+    Renderer renderer(threads);
+    textureCache textures((size_t)256 * 1024 * 1024);
+    renderCamera camera;
+    int failures = 0;
+    for (const regressionCase &c : cases){
+        shared_ptr<parser> scene = make_shared<parser>();
+        scene->extractShapes(c.scene.c_str());
+        scene->compile();
+        scene->pixelAngle = texturePixelAngle(camera.fieldOfView, width);
+        if (attachTextures(*scene, textures) < (int)scene->textureFiles.size()){
+            printf("FAIL %s: can't load its textures\n", c.scene.c_str());
+            failures++;
+            continue;
+        }
+
+        //the first frame warms the caches and isn't timed
+        renderResult result;
+        double best = 1e30;
+        for (int frame = 0; frame <= max(frames, 1); frame++){
+            result = renderer.Submit(scene, camera, width, height).get();
+            if (result.status != RENDER_DONE)
+                break;
+            if (frame > 0)
+                best = min(best, result.milliseconds);
+        }
+        if (result.status != RENDER_DONE){
+            printf("FAIL %s: can't be rendered\n", c.scene.c_str());
+            failures++;
+            continue;
+        }
+
+        vector<unsigned char> image = displayImage(result.image->colours, width, height);
+        bool slow = best > c.maxMilliseconds;
+        int selfHits = checkSelfHits(*scene, generateRay(camera.fieldOfView, (float)width, (float)height));
+        bool differs = false;
+        char detail[160];
+        if (update){
+            if (!writePPM(c.golden, width, height, image)){
+                printf("FAIL %s: can't write %s\n", c.scene.c_str(), c.golden.c_str());
+                failures++;
+                continue;
+            }
+            snprintf(detail, sizeof(detail), "golden image written");
+        }
+        else {
+            int goldenWidth = 0, goldenHeight = 0;
+            vector<unsigned char> golden;
+            if (!readPPM(c.golden, goldenWidth, goldenHeight, golden) || goldenWidth != width
+                || goldenHeight != height)
+                golden.clear();
+            imageDifference d = compareImages(image, golden, c.maxDeltaE);
+            float percent = 100.f * d.pixelsOver / (width * height);
+            differs = percent > c.maxPercent;
+            if (!d.sizeMatches)
+                snprintf(detail, sizeof(detail), "no %dx%d golden image", width, height);
+            else
+                snprintf(detail, sizeof(detail), "mean dE %.3f, max dE %.2f, %.3f%% over %.1f", d.meanDeltaE,
+                         d.maxDeltaE, percent, c.maxDeltaE);
+        }
+
+        bool failed = slow || differs || selfHits > 0;
+        printf("%s %s: %.1f ms (limit %.1f), %s, %d self hits\n", failed ? "FAIL" : "ok  ", c.scene.c_str(), best,
+               c.maxMilliseconds, detail, selfHits);
+        failures += failed;
+    }
+    printf("%d of %d scenes failed\n", failures, (int)cases.size());
+    if (!corpusOk || cases.empty()){
+        printf("FAIL %s: %s\n", corpusFile.c_str(), corpusOk ? "has no scenes" : "can't be read or has bad lines");
+        failures++;
+    }
+    return failures;
+}
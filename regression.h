@@ -0,0 +1,61 @@
+
+#pragma once
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+using namespace std;
+using namespace glm;
+
+/*
+    headless regression run: renders a corpus of scenes, compares them with golden images and
+    times them, without opening a window or touching OpenGL
+
+    the corpus is a text file with one scene a line (blank lines and # comments are skipped),
+    paths relative to the corpus file:
+        scene-file golden-file max-ms [max-delta-e [max-percent]]
+    a scene fails when its best frame takes longer than max-ms, when more than max-percent
+    (default 0.1) of its pixels are further than max-delta-e (default 2.3, about the smallest
+    difference anyone can see) from the golden image in CIELAB, or when any of the shadow and
+    reflection rays leaving its primary hits comes straight back to its own surface (checkSelfHits)
+*/
+
+//one line of a corpus
+struct regressionCase{
+    string scene, golden;
+    double maxMilliseconds;
+    float maxDeltaE, maxPercent;
+    int line;
+};
+
+//false when the file can't be read or has lines that aren't cases (those are left out of cases)
+bool readCorpus(const string &corpusFile, vector<regressionCase> &cases);
+
+//how an image compares with its golden image
+struct imageDifference{
+    bool sizeMatches;
+    float meanDeltaE, maxDeltaE;
+    int pixelsOver;         //further than the case's max-delta-e
+};
+
+/*
+    images are 8 bit RGB, row by row from the top, as a binary PPM holds them
+    with no golden image the difference is every pixel over
+*/
+imageDifference compareImages(const vector<unsigned char> &image, const vector<unsigned char> &golden,
+                              float maxDeltaE);
+
+bool readPPM(const string &filename, int &width, int &height, vector<unsigned char> &pixels);
+bool writePPM(const string &filename, int width, int height, const vector<unsigned char> &pixels);
+
+//a render (column by column, as generateRay lays out its rays) as the 8 bit image the window shows
+vector<unsigned char> displayImage(const vector<vec3> &colours, int width, int height);
+
+/*
+    renders every scene of the corpus width x height on threads threads (the best of frames
+    frames is its time), prints a line for each and returns how many failed
+    a corpus that can't be read, has bad lines or has no scenes at all counts as one more failure,
+    so a run that checked nothing never passes
+    with update set the golden images are written instead of compared, the timing gate still applies
+*/
+int runRegression(const string &corpusFile, int width, int height, int threads, int frames, bool update);
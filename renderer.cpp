@@ -0,0 +1,529 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "renderer.h"
+#include "raytracer.h"
+#include "resultcache.h"
+#include "bvh.h"
+#include "numa.h"
+
+using namespace std;
+
+//everything about one submitted render, the counters are guarded by the renderer's lock
+struct renderJob{
+    shared_ptr<const parser> scene;
+    bool paged;
+    int width, height;
+    renderCamera camera;
+    vector<vec3> rays;
+    vector<shared_ptr<const parser> > shutter;  //each sample pass's scene, for a camera that isn't a pinhole
+    int columnBands;        //bands across the image, traced once for every sample pass
+    vector<vector<vec3> > bandColours;  //each band's colours (summed over its passes), made by the worker that traces it first
+    vector<int> bandSamples;            //passes summed into each band's colours
+    unique_ptr<mutex[]> bandLocks;      //for those two, passes of a band may be traced side by side
+    vector<renderCache> bandPaths;      //and its paths, with keepPaths
+    tileCulling culling;
+    uint64_t key;           //in the result cache
+
+    //for an update, the scene and finished render (with its paths) it starts from, and what changed
+    shared_ptr<const parser> oldScene;
+    shared_ptr<const renderCache> base;
+    sceneEdit edit;
+    atomic<int> retraced, reshaded;
+
+    int priority;
+    renderClock::time_point deadline;
+    renderClock::time_point submitted;
+    unsigned long long order;
+    function<void(const renderResult &)> onComplete;
+    function<void(int, int, int, const vector<vec3> &)> onBand;
+    promise<renderResult> done;
+
+    int bands;              //units of work, every sample pass of every band
+    int nextBand;           //next unit to hand out
+    int running;            //units being traced right now
+    bool stopped;           //taken off the queue before every band was handed out
+    renderStatus stopStatus;
+
+    atomic<bool> cancelled;
+    atomic<bool> failed;
+};
+
+void renderTicket::cancel(){
+    if (job)
+        job->cancelled = true;
+}
+
+//which of two queued renders goes first
+static bool moreUrgent(const renderJob &a, const renderJob &b){
+    if (a.priority != b.priority)
+        return a.priority > b.priority;
+    if (a.deadline != b.deadline)
+        return a.deadline < b.deadline;
+    return a.order < b.order;
+}
+
+// --------------------------------------------------------------------------
+
+const int Renderer::BandWidth;
+
+Renderer::Renderer(int threads, resultCache *results, bool numaAware)
+    :m_results(results),m_numaAware(numaAware),m_nodeCount(1),m_submitted(0),m_stopping(false)
+{
+    if (threads <= 0)
+        threads = max(1, (int)thread::hardware_concurrency());
+
+    //worker i goes to node i % nodes, so every thread count spreads over all of them
+    m_workerCpu.assign(threads, -1);
+    m_workerNode.assign(threads, 0);
+    if (numaAware){
+        vector<numaNode> nodes = numaNodes();
+        m_nodeCount = min((int)nodes.size(), threads);
+        for (int i = 0; i < threads; i++){
+            const numaNode &node = nodes[i % nodes.size()];
+            m_workerNode[i] = i % nodes.size();
+            m_workerCpu[i] = node.cpus[(i / nodes.size()) % node.cpus.size()];
+        }
+    }
+
+    for (int i = 0; i < threads; i++)
+        m_workers.push_back(thread(&Renderer::WorkerLoop, this, i));
+}
+
+Renderer::~Renderer()
+{
+    vector<shared_ptr<renderJob> > idle;
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_stopping = true;
+
+        //renders with bands in flight are finished by the worker that traces the last of them
+        for (shared_ptr<renderJob> &job : m_queue){
+            job->stopped = true;
+            job->stopStatus = RENDER_CANCELLED;
+            if (job->running == 0)
+                idle.push_back(job);
+        }
+        m_queue.clear();
+    }
+    m_wake.notify_all();
+
+    for (shared_ptr<renderJob> &job : idle)
+        Finish(*job, RENDER_CANCELLED);
+    for (thread &worker : m_workers)
+        worker.join();
+}
+
+//a render of scene as it is submitted, before any of it is worked out
+static shared_ptr<renderJob> newJob(shared_ptr<const parser> scene, renderCamera camera, int width, int height,
+                                    const renderOptions &options)
+{
+    shared_ptr<renderJob> job = make_shared<renderJob>();
+    job->scene = scene;
+    job->paged = scene && scene->trianglePages;
+    job->width = max(width, 0);
+    job->height = max(height, 0);
+    job->camera = camera;
+    job->priority = options.priority;
+    job->deadline = options.deadline;
+    job->submitted = renderClock::now();
+    job->onComplete = options.onComplete;
+    job->onBand = options.onBand;
+    job->columnBands = (job->width + Renderer::BandWidth - 1) / Renderer::BandWidth;
+    job->bands = job->columnBands;
+    job->nextBand = 0;
+    job->running = 0;
+    job->stopped = false;
+    job->stopStatus = RENDER_DONE;
+    job->cancelled = false;
+    job->failed = false;
+    job->key = 0;
+    job->retraced = 0;
+    job->reshaded = 0;
+    return job;
+}
+
+renderTicket Renderer::Submit(shared_ptr<const parser> scene, renderCamera camera, int width, int height,
+                              const renderOptions &options)
+{
+    return Start(newJob(scene, camera, width, height, options), options);
+}
+
+renderTicket Renderer::SubmitUpdate(shared_ptr<const parser> oldScene, shared_ptr<const parser> newScene,
+                                    shared_ptr<const renderCache> image, renderCamera camera,
+                                    const renderOptions &options)
+{
+    bool paths = oldScene && image && !oldScene->lightSources.empty()
+                 && (int)image->pathStart.size() == image->width * image->height + 1;
+    if (!paths || !camera.lens.pinhole())
+        return Submit(newScene, camera, image ? image->width : 0, image ? image->height : 0, options);
+
+    shared_ptr<renderJob> job = newJob(newScene, camera, image->width, image->height, options);
+    job->oldScene = oldScene;
+    job->base = image;
+    return Start(job, options);
+}
+
+renderTicket Renderer::Start(shared_ptr<renderJob> job, const renderOptions &options)
+{
+    shared_ptr<const parser> scene = job->scene;
+    const renderCamera &camera = job->camera;
+    renderTicket ticket(job, job->done.get_future().share());
+
+    //a scene without a light (or an empty image) is as far as it will ever get
+    if (!scene || scene->lightSources.empty() || job->bands == 0 || job->height == 0){
+        Finish(*job, scene && !scene->lightSources.empty() ? RENDER_DONE : RENDER_FAILED);
+        return ticket;
+    }
+
+    if (m_results){
+        uint64_t hash = options.sceneHash;
+        if (hash == 0){
+            unique_lock<mutex> paged(m_pagedLock, defer_lock);
+            if (job->paged)
+                paged.lock();
+            hash = sceneHash(*scene);
+        }
+        job->key = renderKey(hash, camera.fieldOfView, job->width, job->height, camera.lens);
+
+        shared_ptr<const renderCache> image = m_results->find(job->key);
+        if (image){
+            Finish(*job, RENDER_DONE, image);
+            return ticket;
+        }
+    }
+
+    job->rays = generateRay(camera.fieldOfView, (float)job->width, (float)job->height);
+    job->bandColours.resize(job->columnBands);
+    job->bandSamples.assign(job->columnBands, 0);
+    job->bandLocks.reset(new mutex[job->columnBands]);
+    if (!camera.lens.pinhole()){
+        job->shutter = shutterScenes(scene, camera.lens);
+        job->bands = job->columnBands * (int)job->shutter.size();
+    }
+    else if (job->base){
+        //only worth culling when something is traced again
+        job->edit = diffScenes(*job->oldScene, *scene);
+        job->bandPaths.resize(job->bands);
+        if (!job->paged && (job->edit.everything || !job->edit.moved.empty()))
+            job->culling = cullTiles(*scene, job->rays, job->width, job->height);
+    }
+    else {
+        if (options.keepPaths)
+            job->bandPaths.resize(job->bands);
+        if (!job->paged)
+            job->culling = cullTiles(*scene, job->rays, job->width, job->height);
+    }
+
+    bool stopping;
+    {
+        lock_guard<mutex> lock(m_lock);
+        stopping = m_stopping;
+        if (!stopping){
+            job->order = m_submitted++;
+            m_queue.push_back(job);
+        }
+    }
+    if (stopping)
+        Finish(*job, RENDER_CANCELLED);
+    else
+        m_wake.notify_one();
+    return ticket;
+}
+
+/*
+    takes the next band of the most urgent render, call with m_lock held
+    renders that were cancelled or ran out of time are taken off the queue on the way,
+    the ones with nothing in flight are left in m_expired so they can be finished
+*/
+shared_ptr<renderJob> Renderer::NextJob()
+{
+    renderClock::time_point now = renderClock::now();
+    shared_ptr<renderJob> best;
+
+    for (size_t i = 0; i < m_queue.size(); ){
+        renderJob &job = *m_queue[i];
+        if (job.cancelled || job.failed || now >= job.deadline){
+            job.stopped = true;
+            job.stopStatus = job.failed ? RENDER_FAILED : job.cancelled ? RENDER_CANCELLED : RENDER_EXPIRED;
+            if (job.running == 0)
+                m_expired.push_back(m_queue[i]);
+            m_queue.erase(m_queue.begin() + i);
+            continue;
+        }
+        if (!best || moreUrgent(job, *best))
+            best = m_queue[i];
+        i++;
+    }
+
+    if (best){
+        best->running++;
+        if (++best->nextBand == best->bands)
+            m_queue.erase(find(m_queue.begin(), m_queue.end(), best));
+    }
+    return best;
+}
+
+void Renderer::WorkerLoop(int worker)
+{
+    if (m_workerCpu[worker] >= 0)
+        pinThread(m_workerCpu[worker]);
+    int node = m_workerNode[worker];
+
+    unique_lock<mutex> lock(m_lock);
+
+    while (true){
+        shared_ptr<renderJob> job = NextJob();
+
+        if (!m_expired.empty()){
+            vector<shared_ptr<renderJob> > expired;
+            expired.swap(m_expired);
+            lock.unlock();
+            for (shared_ptr<renderJob> &stale : expired)
+                Finish(*stale, stale->stopStatus);
+            lock.lock();
+        }
+
+        if (!job){
+            if (m_stopping)
+                return;
+            m_wake.wait(lock);
+            continue;
+        }
+
+        //there may be more bands (or renders) for the other workers to pick up
+        int band = job->nextBand - 1;
+        if (!m_queue.empty())
+            m_wake.notify_one();
+
+        lock.unlock();
+        RunBand(*job, band, node);
+        lock.lock();
+
+        //whoever traces the last band in flight of a render finishes it
+        job->running--;
+        if (job->running == 0 && (job->stopped || job->nextBand == job->bands)){
+            renderStatus status = job->stopped ? job->stopStatus
+                                : job->failed ? RENDER_FAILED : job->cancelled ? RENDER_CANCELLED : RENDER_DONE;
+            lock.unlock();
+            Finish(*job, status);
+            lock.lock();
+        }
+    }
+}
+
+/*
+    the scene the workers of a node trace a render from, its own copy of the render's scene
+    when the renderer is NUMA aware and there is more than one node
+    the copy is made by the first worker of the node to need it, so its memory is first
+    touched (and placed) on that node, and it is kept for later renders of the same scene
+*/
+shared_ptr<const parser> Renderer::SceneOnNode(const renderJob &job, int node)
+{
+    if (!m_numaAware || m_nodeCount < 2 || job.paged)
+        return job.scene;
+
+    {
+        lock_guard<mutex> lock(m_replicaLock);
+        m_replicas.erase(remove_if(m_replicas.begin(), m_replicas.end(),
+                                   [](const sceneReplicas &r){ return r.scene.expired(); }), m_replicas.end());
+        for (const sceneReplicas &r : m_replicas)
+            if (r.scene.lock() == job.scene && r.nodes[node])
+                return r.nodes[node];
+    }
+
+    //copied without the lock so the other nodes aren't held up, two workers of a node may
+    //both make one the first time and the later one is dropped; the triangles and the bvh are
+    //copied too rather than shared, so this node's worker is the one that first touches them
+    shared_ptr<parser> copy = make_shared<parser>(*job.scene);
+    copy->triangles.unshare();
+    if (copy->bvh)
+        copy->bvh = make_shared<triangleBVH>(*copy->bvh);
+
+    lock_guard<mutex> lock(m_replicaLock);
+    sceneReplicas *entry = 0;
+    for (sceneReplicas &r : m_replicas)
+        if (r.scene.lock() == job.scene)
+            entry = &r;
+    if (!entry){
+        sceneReplicas r;
+        r.scene = job.scene;
+        r.nodes.resize(m_nodeCount);
+        m_replicas.push_back(r);
+        entry = &m_replicas.back();
+    }
+    if (!entry->nodes[node])
+        entry->nodes[node] = copy;
+    return entry->nodes[node];
+}
+
+void Renderer::RunBand(renderJob &job, int unit, int node)
+{
+    if (job.cancelled || job.failed)
+        return;
+
+    int band = unit % job.columnBands, pass = unit / job.columnBands;
+    int x0 = band * BandWidth;
+    int x1 = min(x0 + BandWidth, job.width);
+
+    try {
+        shared_ptr<const parser> scene = SceneOnNode(job, node);
+
+        if (job.shutter.empty()){
+            //sized here rather than at submit so the band's memory is first touched by this worker
+            vector<vec3> &colours = job.bandColours[band];
+            colours.assign((x1 - x0) * job.height, vec3(0,0,0));
+
+            //the page cache of a paged scene is shared, so only one band of one goes at a time
+            {
+                unique_lock<mutex> paged(m_pagedLock, defer_lock);
+                if (job.paged)
+                    paged.lock();
+                if (job.base){
+                    int retraced = 0, reshaded = 0;
+                    updateColumns(job.edit, *job.oldScene, *scene, job.rays, *job.base, x0 * job.height,
+                                  x1 * job.height, &job.culling, colours, job.bandPaths[band], retraced, reshaded);
+                    job.retraced += retraced;
+                    job.reshaded += reshaded;
+                }
+                else
+                    traceColours(*scene, job.rays, x0 * job.height, x1 * job.height, job.height, colours,
+                                 &job.culling, job.bandPaths.empty() ? 0 : &job.bandPaths[band]);
+            }
+            job.bandSamples[band] = 1;
+
+            if (job.onBand && !job.cancelled)
+                job.onBand(x0, x1, 0, colours);
+            return;
+        }
+
+        //a pass where nothing has moved can trace the node's copy
+        const parser &passScene = job.shutter[pass] == job.scene ? *scene : *job.shutter[pass];
+        vector<vec3> colours;
+        {
+            unique_lock<mutex> paged(m_pagedLock, defer_lock);
+            if (job.paged)
+                paged.lock();
+            traceSample(passScene, job.rays, x0 * job.height, x1 * job.height, job.width, job.height,
+                        job.camera.fieldOfView, job.camera.lens, pass, colours);
+        }
+
+        //handed over in the order they are summed, so the first one shown is the first one in
+        lock_guard<mutex> summing(job.bandLocks[band]);
+        vector<vec3> &sum = job.bandColours[band];
+        if (job.bandSamples[band] == 0)
+            sum = colours;
+        else
+            for (size_t i = 0; i < sum.size(); i++)
+                sum[i] += colours[i];
+        int sample = job.bandSamples[band]++;
+
+        if (job.onBand && !job.cancelled)
+            job.onBand(x0, x1, sample, colours);
+    }
+    catch (...) {
+        job.failed = true;
+    }
+}
+
+void Renderer::Finish(renderJob &job, renderStatus status, shared_ptr<const renderCache> cached)
+{
+    renderResult result;
+    result.status = status;
+    result.width = job.width;
+    result.height = job.height;
+    result.cached = cached != 0;
+    result.image = cached;
+    result.retraced = job.retraced;
+    result.reshaded = job.reshaded;
+
+    if (!cached){
+        shared_ptr<renderCache> image = make_shared<renderCache>();
+        image->width = job.width;
+        image->height = job.height;
+        if (!job.bandColours.empty()){
+            image->colours.assign(job.width * job.height, vec3(0,0,0));
+            for (int band = 0; band < (int)job.bandColours.size(); band++){
+                vector<vec3>::iterator out = image->colours.begin() + band * BandWidth * job.height;
+                copy(job.bandColours[band].begin(), job.bandColours[band].end(), out);
+
+                //the mean of the passes the band got through
+                if (job.bandSamples[band] > 1)
+                    for (size_t i = 0; i < job.bandColours[band].size(); i++)
+                        out[i] /= (float)job.bandSamples[band];
+            }
+        }
+
+        //only a finished render has a path for every pixel
+        if (status == RENDER_DONE && !job.bandPaths.empty()){
+            image->pathStart.assign(1, 0);
+            for (const renderCache &band : job.bandPaths){
+                int base = image->pathStart.back();
+                for (size_t i = 1; i < band.pathStart.size(); i++)
+                    image->pathStart.push_back(base + band.pathStart[i]);
+                image->vertices.insert(image->vertices.end(), band.vertices.begin(), band.vertices.end());
+            }
+        }
+        result.image = image;
+        if (m_results && status == RENDER_DONE)
+            m_results->store(job.key, image);
+    }
+    result.milliseconds = chrono::duration<double, milli>(renderClock::now() - job.submitted).count();
+
+    if (job.onComplete)
+        job.onComplete(result);
+    job.done.set_value(move(result));
+
+    //nothing reads these again, let them go even if the ticket lives on
+    job.scene.reset();
+    job.oldScene.reset();
+    job.base.reset();
+    vector<vec3>().swap(job.rays);
+    vector<vector<vec3> >().swap(job.bandColours);
+    vector<int>().swap(job.bandSamples);
+    vector<renderCache>().swap(job.bandPaths);
+    vector<shared_ptr<const parser> >().swap(job.shutter);
+}
+
+// --------------------------------------------------------------------------
+
+void scalingReport(shared_ptr<const parser> scene, int width, int height)
+{
+    vector<numaNode> nodes = numaNodes();
+    int cpus = 0;
+    for (const numaNode &node : nodes)
+        cpus += (int)node.cpus.size();
+    printf("scaling report, %d cpus on %d NUMA node%s\n", cpus, (int)nodes.size(), nodes.size() == 1 ? "" : "s");
+
+    vector<int> counts;
+    for (int threads = 1; threads < cpus; threads *= 2)
+        counts.push_back(threads);
+    counts.push_back(cpus);
+
+    double single[2] = { 0, 0 };
+    for (int threads : counts){
+        printf("%4d threads", threads);
+        for (int pinned = 0; pinned < 2; pinned++){
+            Renderer renderer(threads, 0, pinned != 0);
+
+            //the first render also makes the scene's copies, it isn't timed
+            double best = 1e30;
+            for (int run = 0; run < 4; run++){
+                renderResult result = renderer.Submit(scene, renderCamera(), width, height).get();
+                if (result.status != RENDER_DONE){
+                    printf("\nthe scene can't be rendered\n");
+                    return;
+                }
+                if (run > 0)
+                    best = min(best, result.milliseconds);
+            }
+            if (threads == 1)
+                single[pinned] = best;
+
+            double speedup = single[pinned] / best;
+            printf("  |  %s %8.1f ms %5.2fx %4.0f%%", pinned ? "pinned, replicated" : "unpinned", best,
+                   speedup, 100 * speedup / threads);
+        }
+        printf("\n");
+    }
+}
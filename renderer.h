@@ -0,0 +1,190 @@
+
+#pragma once
+#include <vector>
+#include <memory>
+#include <future>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#include "parser.h"
+#include "raytracer.h"
+
+using namespace std;
+using namespace glm;
+
+/*
+    renderer for embedding the ray tracer in another program, nothing in here touches OpenGL
+    every render submitted to a Renderer is split into bands of columns, and one pool of worker
+    threads takes the bands of the most urgent render first, so renders run side by side
+*/
+
+//where a render is seen from, the camera always sits at the origin looking down -z
+struct renderCamera{
+    renderCamera(float fov = 55.f, lensCamera lens = lensCamera()):fieldOfView(fov),lens(lens){}
+    float fieldOfView;      //horizontal, in degrees
+    lensCamera lens;        //the pinhole unless it is given a lens, shutter or more samples
+};
+
+typedef chrono::steady_clock renderClock;
+
+enum renderStatus{
+    RENDER_DONE,            //every pixel was traced
+    RENDER_CANCELLED,       //cancel was called (or the renderer shut down) before it finished
+    RENDER_EXPIRED,         //the deadline passed before it finished
+    RENDER_FAILED           //the scene can't be rendered (no light) or tracing threw
+};
+
+/*
+    a finished render, image->colours is stored column by column like the rays of generateRay
+    (pixel (x, y) is image->colours[x * height + y]); cancelled and expired renders keep the
+    columns that were traced and leave the rest black
+    the image is shared with the result cache, if there is one, and never changes
+*/
+struct renderResult{
+    renderStatus status;
+    int width, height;
+    shared_ptr<const renderCache> image;
+    bool cached;            //came straight out of the result cache
+    double milliseconds;    //from submit to completion
+    int retraced, reshaded; //pixels an update traced again and reshaded (an update that finished)
+};
+
+struct renderJob;
+class resultCache;
+
+//how urgent a render is and what to do when it finishes
+struct renderOptions{
+    renderOptions():priority(0),deadline(renderClock::time_point::max()),sceneHash(0),keepPaths(false){}
+
+    int priority;                   //higher goes first, equal priorities go by deadline then submission
+    renderClock::time_point deadline;
+
+    //the scene's sceneHash when the caller keeps it, 0 has submit work it out (with a result cache)
+    uint64_t sceneHash;
+
+    //keep every pixel's path in the image as generateScene does, so it can be brought up to date
+    //with updateScene or SubmitUpdate after an edit (only for a pinhole camera, the others take many per pixel)
+    bool keepPaths;
+
+    //called on the thread that finished the render (usually a worker) before the future is ready,
+    //it must not throw
+    function<void(const renderResult &)> onComplete;
+
+    /*
+        called on the worker that traced them with the colours of the columns x0 up to x1 (column by
+        column) as soon as they are done, for showing a render as it comes in; it must not throw
+        a camera that isn't a pinhole traces the whole image once for each sample pass before the
+        next, handing over each pass of the columns on its own: sample is how many of theirs were
+        handed over before (0 for a pinhole), and the render is the mean of them
+    */
+    function<void(int x0, int x1, int sample, const vector<vec3> &colours)> onBand;
+};
+
+//what submit hands back: the result to wait on, and a way to stop the render early
+class renderTicket{
+public:
+    renderTicket() {}
+    renderTicket(shared_ptr<renderJob> job, shared_future<renderResult> result):job(job),result(result){}
+
+    shared_future<renderResult> future() const { return result; }
+    const renderResult &get() const { return result.get(); }
+
+    //stops handing out the render's remaining columns, the ones already being traced still finish
+    void cancel();
+
+private:
+    shared_ptr<renderJob> job;
+    shared_future<renderResult> result;
+};
+
+class Renderer
+{
+public:
+    //columns per unit of work, small enough that cancellation and deadlines take effect quickly
+    static const int BandWidth = 8;
+
+    /*
+        threads = 0 uses one worker per hardware thread
+        with results, renders already in it are returned without tracing anything,
+        and every render that completes is added to it
+        numaAware pins the workers to cpus, taking the NUMA nodes in turn, and has the workers
+        of each node trace from a copy of the scene made on that node (paged scenes excepted)
+    */
+    explicit Renderer(int threads = 0, resultCache *results = 0, bool numaAware = false);
+
+    //renders still waiting are cancelled, the ones being traced are finished first
+    ~Renderer();
+
+    /*
+        queues a render of scene, which must stay unchanged until the render completes
+        can be called from any thread, paged scenes are traced a band at a time so their
+        page cache is only ever touched by one worker
+        a camera that isn't a pinhole has its sample passes handed out one after the other, each
+        as bands of its own, so the whole image refines a pass at a time
+    */
+    renderTicket Submit(shared_ptr<const parser> scene, renderCamera camera, int width, int height,
+                        const renderOptions &options = renderOptions());
+
+    /*
+        queues bringing image, a finished render of oldScene that kept its paths, up to date with
+        newScene as updateScene does, its bands handed to the workers like those of any render
+        so even an edit that changes every pixel doesn't hold up the caller; the result keeps
+        its paths for the next edit, and is stored in the result cache under newScene
+        both scenes must stay unchanged until it completes; without paths for every pixel of
+        image (or for a camera that isn't a pinhole) newScene is rendered from scratch instead
+    */
+    renderTicket SubmitUpdate(shared_ptr<const parser> oldScene, shared_ptr<const parser> newScene,
+                              shared_ptr<const renderCache> image, renderCamera camera,
+                              const renderOptions &options = renderOptions());
+
+    int ThreadCount() const { return (int)m_workers.size(); }
+    int NodeCount() const { return m_nodeCount; }
+
+private:
+    //copies of a scene's geometry for each NUMA node, dropped once the scene is gone
+    struct sceneReplicas{
+        weak_ptr<const parser> scene;
+        vector<shared_ptr<const parser> > nodes;
+    };
+
+    renderTicket Start(shared_ptr<renderJob> job, const renderOptions &options);
+    void WorkerLoop(int worker);
+    shared_ptr<renderJob> NextJob();
+    shared_ptr<const parser> SceneOnNode(const renderJob &job, int node);
+    void RunBand(renderJob &job, int unit, int node);
+    void Finish(renderJob &job, renderStatus status, shared_ptr<const renderCache> cached = shared_ptr<const renderCache>());
+
+    vector<thread> m_workers;
+    resultCache *m_results;
+
+    //the node of each worker's cpu (all 0 unless numaAware)
+    bool m_numaAware;
+    int m_nodeCount;
+    vector<int> m_workerCpu, m_workerNode;
+    mutex m_replicaLock;
+    vector<sceneReplicas> m_replicas;
+
+    //renders with columns still to hand out, guarded by m_lock
+    mutex m_lock;
+    condition_variable m_wake;
+    vector<shared_ptr<renderJob> > m_queue;
+    vector<shared_ptr<renderJob> > m_expired;   //taken off the queue with nothing in flight, still to finish
+    unsigned long long m_submitted;
+    bool m_stopping;
+
+    //held while a paged scene is traced
+    mutex m_pagedLock;
+};
+
+/*
+    renders the scene at every thread count from 1 to the number of cpus (doubling, then all of
+    them), with the workers left to the scheduler and then pinned with the scene replicated
+    per NUMA node, and prints the times and how close to linear they scale
+*/
+void scalingReport(shared_ptr<const parser> scene, int width, int height);
@@ -0,0 +1,349 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <utime.h>
+#include <unistd.h>
+#else
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#include <sys/utime.h>
+#endif
+
+#include "resultcache.h"
+#include "geometrypages.h"
+
+using namespace std;
+
+/*
+    result file layout, native endianness like the page files:
+        header      "RRC1", uint32 renderer version, uint64 key, int32 width, height,
+                    uint32 colour, path start and vertex counts
+        data        vec3 colours[], int pathStart[], pathVertex vertices[]
+*/
+static const char resultMagic[4] = { 'R', 'R', 'C', '1' };
+
+struct resultHeader{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    int32_t width, height;
+    uint32_t colours, pathStarts, vertices;
+};
+
+//64 bit FNV-1a
+struct hasher{
+    hasher():h(14695981039346656037ull){}
+    uint64_t h;
+
+    void bytes(const void *data, size_t size){
+        const unsigned char *b = (const unsigned char *)data;
+        for (size_t i = 0; i < size; i++)
+            h = (h ^ b[i]) * 1099511628211ull;
+    }
+    void add(float f){ bytes(&f, sizeof(f)); }
+    void add(uint64_t v){ bytes(&v, sizeof(v)); }
+    void add(vec2 v){ add(v.x); add(v.y); }
+    void add(vec3 v){ add(v.x); add(v.y); add(v.z); }
+    void add(const string &s){ add((uint64_t)s.size()); bytes(s.data(), s.size()); }
+};
+
+static void addTriangle(hasher &h, const triangle &t){
+    h.add(t.a); h.add(t.b); h.add(t.c);
+    h.add(t.Cr); h.add(t.Cp); h.add(t.phong);
+    h.add((uint64_t)(int64_t)t.texture); h.add(t.uvA); h.add(t.uvB); h.add(t.uvC);
+}
+
+uint64_t sceneHash(const parser &p){
+    hasher h;
+
+    //hit records refer to triangles by index, so a paged scene (whose triangles are reordered)
+    //must never share a key with the same scene in memory
+    h.add((uint64_t)(p.trianglePages != 0));
+    if (p.trianglePages){
+        h.add((uint64_t)p.trianglePages->triangleCount());
+        for (int pg = 0; pg < p.trianglePages->pageCount(); pg++)
+            for (const triangle &t : p.trianglePages->page(pg))
+                addTriangle(h, t);
+    }
+    else {
+        h.add((uint64_t)p.triangles.size());
+        for (const triangle &t : p.triangles)
+            addTriangle(h, t);
+    }
+
+    h.add((uint64_t)p.spheres.size());
+    for (const sphere &s : p.spheres){
+        h.add(s.center); h.add(s.radius);
+        h.add(s.Cr); h.add(s.Cp); h.add(s.phong);
+        h.add(s.velocity);
+        h.add((uint64_t)(int64_t)s.texture);
+    }
+    h.add((uint64_t)p.planes.size());
+    for (const plane &pl : p.planes){
+        h.add(pl.n); h.add(pl.q);
+        h.add(pl.Cr); h.add(pl.Cp); h.add(pl.phong);
+        h.add((uint64_t)(int64_t)pl.texture); h.add(pl.textureScale);
+    }
+    h.add((uint64_t)p.lightSources.size());
+    for (const lightSource &l : p.lightSources){
+        h.add(l.pos); h.add(l.Cl); h.add(l.Ca);
+        h.add((uint64_t)l.shape); h.add(l.radius); h.add(l.u); h.add(l.v);
+    }
+    h.add((uint64_t)p.shadowSamples);
+
+    //an image edited in place has the same name, its size and time tell it apart
+    h.add((uint64_t)p.textureFiles.size());
+    for (const string &filename : p.textureFiles){
+        struct stat s;
+        h.add(filename);
+        if (stat(filename.c_str(), &s) == 0){
+            h.add((uint64_t)s.st_size);
+            h.add((uint64_t)s.st_mtime);
+        }
+    }
+    if (!p.textureFiles.empty())
+        h.add(p.pixelAngle);
+    return h.h;
+}
+
+uint64_t renderKey(uint64_t scene, float fieldOfView, int width, int height, const lensCamera &lens){
+    hasher h;
+    h.add((uint64_t)rendererVersion);
+    h.add(scene);
+    h.add(fieldOfView);
+    h.add((uint64_t)width);
+    h.add((uint64_t)height);
+    if (!lens.pinhole()){
+        h.add(lens.aperture); h.add(lens.focusDistance); h.add(lens.shutter);
+        h.add((uint64_t)lens.samples);
+    }
+    return h.h;
+}
+
+static size_t renderBytes(const renderCache &render){
+    return render.colours.size() * sizeof(vec3) + render.pathStart.size() * sizeof(int)
+         + render.vertices.size() * sizeof(pathVertex);
+}
+
+// --------------------------------------------------------------------------
+
+resultCache::resultCache(size_t memoryBudget, const string &directory, size_t diskBudget)
+    :budget(memoryBudget),resident(0),numHits(0),numMisses(0),directory(directory),diskBudget(diskBudget){}
+
+shared_ptr<const renderCache> resultCache::find(uint64_t key){
+    {
+        lock_guard<mutex> guard(lock);
+        unordered_map<uint64_t, entry>::iterator it = entries.find(key);
+        if (it != entries.end()){
+            lru.splice(lru.begin(), lru, it->second.lru);
+            numHits++;
+            return it->second.render;
+        }
+    }
+
+    //the file is read without holding the lock, it is never written in place
+    shared_ptr<const renderCache> render = load(key);
+
+    lock_guard<mutex> guard(lock);
+    if (render){
+        numHits++;
+        remember(key, render);
+    }
+    else
+        numMisses++;
+    return render;
+}
+
+size_t resultCache::memoryBytes() const {
+    lock_guard<mutex> guard(lock);
+    return resident;
+}
+
+int resultCache::hits() const {
+    lock_guard<mutex> guard(lock);
+    return numHits;
+}
+
+int resultCache::misses() const {
+    lock_guard<mutex> guard(lock);
+    return numMisses;
+}
+
+void resultCache::store(uint64_t key, shared_ptr<const renderCache> render){
+    if (!render)
+        return;
+    {
+        lock_guard<mutex> guard(lock);
+        remember(key, render);
+    }
+    if (!directory.empty()){
+        save(key, *render);
+        trimDirectory();
+    }
+}
+
+//keeps render in memory as the most recently used entry, call with the lock held
+void resultCache::remember(uint64_t key, shared_ptr<const renderCache> render){
+    unordered_map<uint64_t, entry>::iterator it = entries.find(key);
+    if (it != entries.end()){
+        resident -= it->second.bytes;
+        lru.erase(it->second.lru);
+        entries.erase(it);
+    }
+
+    size_t bytes = renderBytes(*render);
+    if (bytes > budget)
+        return;
+
+    lru.push_front(key);
+    entry e = { render, bytes, lru.begin() };
+    entries[key] = e;
+    resident += bytes;
+
+    while (resident > budget){
+        unordered_map<uint64_t, entry>::iterator oldest = entries.find(lru.back());
+        resident -= oldest->second.bytes;
+        entries.erase(oldest);
+        lru.pop_back();
+    }
+}
+
+string resultCache::path(uint64_t key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.rrc", (unsigned long long)key);
+    return directory + "/" + name;
+}
+
+shared_ptr<const renderCache> resultCache::load(uint64_t key) const {
+    if (directory.empty())
+        return shared_ptr<const renderCache>();
+
+    string filename = path(key);
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f)
+        return shared_ptr<const renderCache>();
+
+    resultHeader header;
+    shared_ptr<renderCache> render = make_shared<renderCache>();
+    bool ok = fread(&header, sizeof(header), 1, f) == 1
+        && memcmp(header.magic, resultMagic, 4) == 0
+        && header.version == rendererVersion && header.key == key
+        && header.colours == (uint32_t)header.width * (uint32_t)header.height
+        && (header.pathStarts == 0 || header.pathStarts == header.colours + 1);
+    if (ok){
+        render->width = header.width;
+        render->height = header.height;
+        render->colours.resize(header.colours);
+        render->pathStart.resize(header.pathStarts);
+        render->vertices.resize(header.vertices);
+        ok = fread(render->colours.data(), sizeof(vec3), header.colours, f) == header.colours
+            && fread(render->pathStart.data(), sizeof(int), header.pathStarts, f) == header.pathStarts
+            && fread(render->vertices.data(), sizeof(pathVertex), header.vertices, f) == header.vertices
+            && (header.pathStarts == 0 || render->pathStart.back() == (int)header.vertices);
+    }
+    fclose(f);
+    if (!ok)
+        return shared_ptr<const renderCache>();
+
+    //mark it used, the directory is trimmed oldest first
+#ifndef _WIN32
+    utime(filename.c_str(), 0);
+#else
+    _utime(filename.c_str(), 0);
+#endif
+    return render;
+}
+
+void resultCache::save(uint64_t key, const renderCache &render) const {
+    //every writer has a partial file of its own, even other processes sharing the directory
+    static atomic<unsigned int> writes(0);
+#ifndef _WIN32
+    int process = (int)getpid();
+#else
+    int process = _getpid();
+#endif
+    string filename = path(key);
+    string partial = filename + "." + to_string(process) + "-" + to_string(writes++) + ".part";
+    FILE *f = fopen(partial.c_str(), "wb");
+    if (!f){
+        printf("Could not write result file %s\n", partial.c_str());
+        return;
+    }
+
+    resultHeader header;
+    memcpy(header.magic, resultMagic, 4);
+    header.version = rendererVersion;
+    header.key = key;
+    header.width = render.width;
+    header.height = render.height;
+    header.colours = (uint32_t)render.colours.size();
+    header.pathStarts = (uint32_t)render.pathStart.size();
+    header.vertices = (uint32_t)render.vertices.size();
+
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(render.colours.data(), sizeof(vec3), render.colours.size(), f);
+    fwrite(render.pathStart.data(), sizeof(int), render.pathStart.size(), f);
+    fwrite(render.vertices.data(), sizeof(pathVertex), render.vertices.size(), f);
+    bool ok = !ferror(f);
+    fclose(f);
+
+    //readers only ever see whole files, the old one is replaced in a single step
+#ifndef _WIN32
+    ok = ok && rename(partial.c_str(), filename.c_str()) == 0;
+#else
+    ok = ok && MoveFileExA(partial.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#endif
+    if (!ok)
+        remove(partial.c_str());
+}
+
+//deletes the least recently used result files until the directory is back under its budget
+void resultCache::trimDirectory() const {
+    if (diskBudget == 0)
+        return;
+
+    struct resultFile{ time_t used; size_t bytes; string name; };
+    vector<resultFile> files;
+    size_t total = 0;
+
+#ifndef _WIN32
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+        return;
+    while (dirent *d = readdir(dir)){
+        string name = d->d_name;
+        struct stat info;
+        if (name.size() < 4 || name.compare(name.size() - 4, 4, ".rrc") != 0
+            || stat((directory + "/" + name).c_str(), &info) != 0)
+            continue;
+        resultFile file = { info.st_mtime, (size_t)info.st_size, name };
+        files.push_back(file);
+    }
+    closedir(dir);
+#else
+    _finddata_t found;
+    intptr_t search = _findfirst((directory + "/*.rrc").c_str(), &found);
+    if (search == -1)
+        return;
+    do {
+        resultFile file = { found.time_write, (size_t)found.size, found.name };
+        files.push_back(file);
+    } while (_findnext(search, &found) == 0);
+    _findclose(search);
+#endif
+
+    for (const resultFile &file : files)
+        total += file.bytes;
+    sort(files.begin(), files.end(), [](const resultFile &a, const resultFile &b){ return a.used < b.used; });
+    for (size_t i = 0; i < files.size() && total > diskBudget; i++){
+        remove((directory + "/" + files[i].name).c_str());
+        total -= files[i].bytes;
+    }
+}
@@ -0,0 +1,73 @@
+
+#pragma once
+#include <vector>
+#include <list>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+#include "parser.h"
+#include "raytracer.h"
+
+using namespace std;
+
+//bump whenever a change to the tracer changes the pictures it makes, so older results are never reused
+const unsigned int rendererVersion = 5;
+
+/*
+    hash of everything in a scene that shows up in a render: shapes, materials and lights
+    (the acceleration structure doesn't, so it is left out)
+    paged triangles are read back through their pages, so it mustn't race a render of the same scene
+*/
+uint64_t sceneHash(const parser &p);
+
+//key of a render of a scene (by its sceneHash) for a camera and resolution
+//the lens only goes into it when it isn't a pinhole, so pinhole keys stay what they were
+uint64_t renderKey(uint64_t scene, float fieldOfView, int width, int height, const lensCamera &lens = lensCamera());
+
+/*
+    content addressed store of finished renders, the colours and (when the render kept them) the
+    per pixel paths updateScene works from
+    the most recently used ones are kept in memory up to a budget, and with a directory every one
+    is also written there as <key>.rrc so later runs find them, the least recently used files
+    going once the directory passes its own budget
+    safe to use from any number of threads
+*/
+class resultCache{
+public:
+    resultCache(size_t memoryBudget, const string &directory = "", size_t diskBudget = 0);
+
+    //the render stored under key, from memory or else from disk, null if there is none
+    shared_ptr<const renderCache> find(uint64_t key);
+
+    void store(uint64_t key, shared_ptr<const renderCache> render);
+
+    size_t memoryBytes() const;
+    int hits() const;
+    int misses() const;
+
+private:
+    struct entry{
+        shared_ptr<const renderCache> render;
+        size_t bytes;
+        list<uint64_t>::iterator lru;
+    };
+
+    void remember(uint64_t key, shared_ptr<const renderCache> render);
+    string path(uint64_t key) const;
+    shared_ptr<const renderCache> load(uint64_t key) const;
+    void save(uint64_t key, const renderCache &render) const;
+    void trimDirectory() const;
+
+    mutable mutex lock;
+    unordered_map<uint64_t, entry> entries;
+    list<uint64_t> lru;             //keys in memory, most recently used first
+    size_t budget, resident;
+    int numHits, numMisses;
+
+    string directory;
+    size_t diskBudget;
+};
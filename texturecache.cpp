@@ -0,0 +1,433 @@
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <algorithm>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include "texturecache.h"
+
+using namespace std;
+using namespace glm;
+
+/*
+    mip file layout: a header ("TMP2", then width, height, level count and tile size as 32 bit
+    ints, then the size and modification time of the image it was made from as 64 bit ints), then
+    every level from the full image down to 1x1, each as its tiles row by row from the top left,
+    each tile TileSize rows of TileSize RGB texels; tiles over the edge of a level repeat its last
+    row and column
+*/
+static const char mipMagic[4] = { 'T', 'M', 'P', '2' };
+static const int headerBytes = 4 + 4 * sizeof(int32_t) + 2 * sizeof(int64_t);
+static const size_t tileBytes = (size_t)textureCache::TileSize * textureCache::TileSize * 3;
+
+//reads the header of a binary PPM, leaving f at its first pixel
+static bool readPPMHeader(FILE *f, int &width, int &height){
+    int maxValue;
+    return fscanf(f, "P6 %d %d %d", &width, &height, &maxValue) == 3 && maxValue == 255
+           && width > 0 && height > 0 && fgetc(f) != EOF;
+}
+
+//mip files can be bigger than a long can seek through on some platforms
+static bool seek(FILE *f, uint64_t offset){
+#ifdef _WIN32
+    return _fseeki64(f, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(f, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+//reads bytes at offset of an open mip file without moving any shared position, so any number of
+//threads can read the same file at once
+#ifdef _WIN32
+static bool readAt(void *file, uint64_t offset, unsigned char *data, size_t bytes){
+    OVERLAPPED at = {};
+    at.Offset = (DWORD)offset;
+    at.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD got = 0;
+    return ReadFile((HANDLE)file, data, (DWORD)bytes, &got, &at) && got == bytes;
+}
+#else
+static bool readAt(int file, uint64_t offset, unsigned char *data, size_t bytes){
+    while (bytes > 0){
+        ssize_t got = pread(file, data, bytes, (off_t)offset);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        data += got;
+        offset += got;
+        bytes -= got;
+    }
+    return true;
+}
+#endif
+
+
+// --------------------------------------------------------------------------
+// Making mip files, a band of rows at a time
+
+//cuts a band of rows of a level (rows of them, the top of tile row tileY) into tiles and writes them
+static bool writeBand(FILE *f, const vector<unsigned char> &band, int rows, int tileY,
+                      int width, int tilesX, uint64_t offset){
+    const int T = textureCache::TileSize;
+    vector<unsigned char> tile(tileBytes);
+    if (!seek(f, offset + (uint64_t)tileY * tilesX * tileBytes))
+        return false;
+    for (int tileX = 0; tileX < tilesX; tileX++){
+        for (int r = 0; r < T; r++){
+            const unsigned char *row = &band[(size_t)std::min(r, rows - 1) * width * 3];
+            for (int c = 0; c < T; c++)
+                memcpy(&tile[(r * T + c) * 3], row + std::min(tileX * T + c, width - 1) * 3, 3);
+        }
+        if (fwrite(tile.data(), 1, tileBytes, f) != tileBytes)
+            return false;
+    }
+    return true;
+}
+
+//reads tile row tileY of a level back as TileSize rows of width texels
+static bool readBand(FILE *f, vector<unsigned char> &band, int tileY, int width, int tilesX, uint64_t offset){
+    const int T = textureCache::TileSize;
+    vector<unsigned char> tile(tileBytes);
+    band.resize((size_t)width * T * 3);
+    if (!seek(f, offset + (uint64_t)tileY * tilesX * tileBytes))
+        return false;
+    for (int tileX = 0; tileX < tilesX; tileX++){
+        if (fread(tile.data(), 1, tileBytes, f) != tileBytes)
+            return false;
+        int columns = std::min(T, width - tileX * T);
+        for (int r = 0; r < T; r++)
+            memcpy(&band[((size_t)r * width + tileX * T) * 3], &tile[r * T * 3], columns * 3);
+    }
+    return true;
+}
+
+/*
+    level 0 is copied from the image a tile row at a time, every other level is box filtered from
+    the two tile rows of the level above that cover one of its own, read back from the file so far
+    memory stays at a few rows of the image however big it is
+*/
+static bool buildMips(FILE *image, FILE *f, int width, int height, const int64_t imageStamp[2],
+                      const vector<int> &dims, const vector<uint64_t> &offsets){
+    const int T = textureCache::TileSize;
+    int32_t header[4] = { width, height, (int32_t)offsets.size(), T };
+    if (fwrite(mipMagic, 1, 4, f) != 4 || fwrite(header, sizeof(int32_t), 4, f) != 4
+        || fwrite(imageStamp, sizeof(int64_t), 2, f) != 2)
+        return false;
+
+    vector<unsigned char> band, upper, lower, source;
+    int tilesX = (width + T - 1) / T, tilesY = (height + T - 1) / T;
+    for (int tileY = 0; tileY < tilesY; tileY++){
+        int rows = std::min(T, height - tileY * T);
+        band.resize((size_t)width * rows * 3);
+        if (fread(band.data(), 1, band.size(), image) != band.size()
+            || !writeBand(f, band, rows, tileY, width, tilesX, offsets[0]))
+            return false;
+    }
+
+    for (int level = 1; level < (int)offsets.size(); level++){
+        int srcWidth = dims[2 * level - 2], srcHeight = dims[2 * level - 1];
+        int srcTilesX = (srcWidth + T - 1) / T, srcTilesY = (srcHeight + T - 1) / T;
+        int w = dims[2 * level], h = dims[2 * level + 1];
+        tilesX = (w + T - 1) / T;
+        tilesY = (h + T - 1) / T;
+
+        for (int tileY = 0; tileY < tilesY; tileY++){
+            //the source rows 2 * tileY * T onwards, two tile rows of them
+            if (!readBand(f, upper, 2 * tileY, srcWidth, srcTilesX, offsets[level - 1]))
+                return false;
+            source = upper;
+            if (2 * tileY + 1 < srcTilesY){
+                if (!readBand(f, lower, 2 * tileY + 1, srcWidth, srcTilesX, offsets[level - 1]))
+                    return false;
+                source.insert(source.end(), lower.begin(), lower.end());
+            }
+
+            int rows = std::min(T, h - tileY * T);
+            band.resize((size_t)w * rows * 3);
+            for (int r = 0; r < rows; r++){
+                int y0 = std::min(2 * (tileY * T + r), srcHeight - 1) - 2 * tileY * T;
+                int y1 = std::min(2 * (tileY * T + r) + 1, srcHeight - 1) - 2 * tileY * T;
+                for (int x = 0; x < w; x++){
+                    int x0 = std::min(2 * x, srcWidth - 1), x1 = std::min(2 * x + 1, srcWidth - 1);
+                    for (int c = 0; c < 3; c++){
+                        int sum = source[((size_t)y0 * srcWidth + x0) * 3 + c] + source[((size_t)y0 * srcWidth + x1) * 3 + c]
+                                + source[((size_t)y1 * srcWidth + x0) * 3 + c] + source[((size_t)y1 * srcWidth + x1) * 3 + c];
+                        band[((size_t)r * w + x) * 3 + c] = (unsigned char)((sum + 2) / 4);
+                    }
+                }
+            }
+            if (!writeBand(f, band, rows, tileY, w, tilesX, offsets[level]))
+                return false;
+        }
+    }
+    return true;
+}
+
+/*
+    whether mipFile is complete and holds the levels of a width x height image made from the image
+    with imageStamp's size and modification time, so an edited image is never shown from old mips
+*/
+static bool mipsUpToDate(const string &mipFile, int width, int height, const int64_t imageStamp[2], int levels,
+                         uint64_t bytes){
+    struct stat mips;
+    if (stat(mipFile.c_str(), &mips) != 0 || (uint64_t)mips.st_size != bytes)
+        return false;
+
+    FILE *f = fopen(mipFile.c_str(), "rb");
+    if (!f)
+        return false;
+    char magic[4];
+    int32_t header[4];
+    int64_t stamp[2];
+    bool ok = fread(magic, 1, 4, f) == 4 && memcmp(magic, mipMagic, 4) == 0
+              && fread(header, sizeof(int32_t), 4, f) == 4 && header[0] == width && header[1] == height
+              && header[2] == levels && header[3] == textureCache::TileSize
+              && fread(stamp, sizeof(int64_t), 2, f) == 2 && stamp[0] == imageStamp[0] && stamp[1] == imageStamp[1];
+    fclose(f);
+    return ok;
+}
+
+// --------------------------------------------------------------------------
+
+textureCache::textureCache(size_t budgetBytes)
+    :textures(new texture[MaxTextures]),count(0),budget(budgetBytes),resident(0),loads(0){
+    static atomic<uint64_t> caches(0);
+    serial = ++caches;
+}
+
+textureCache::~textureCache(){
+    for (int i = 0; i < count; i++)
+#ifdef _WIN32
+        CloseHandle((HANDLE)textures[i].mips);
+#else
+        ::close(textures[i].mips);
+#endif
+}
+
+int textureCache::load(const string &filename){
+    lock_guard<mutex> loading(loadLock);
+
+    //the same size and modification time sceneHash puts in a scene's key
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0){
+        printf("can't read texture %s, it needs to be a binary PPM\n", filename.c_str());
+        return -1;
+    }
+    int64_t stamp[2] = { (int64_t)info.st_size, (int64_t)info.st_mtime };
+    for (int i = 0; i < count; i++)
+        if (textures[i].filename == filename && (int64_t)textures[i].imageSize == stamp[0]
+            && textures[i].imageTime == stamp[1])
+            return i;
+    if (count == MaxTextures){
+        printf("too many textures, %s left off\n", filename.c_str());
+        return -1;
+    }
+
+    FILE *image = fopen(filename.c_str(), "rb");
+    int width, height;
+    if (!image || !readPPMHeader(image, width, height)){
+        printf("can't read texture %s, it needs to be a binary PPM\n", filename.c_str());
+        if (image)
+            fclose(image);
+        return -1;
+    }
+
+    texture &t = textures[count];
+    t.filename = filename;
+    t.imageSize = (uint64_t)stamp[0];
+    t.imageTime = stamp[1];
+    t.levels.clear();
+    vector<int> dims;
+    vector<uint64_t> offsets;
+    uint64_t offset = headerBytes;
+    for (int w = width, h = height; ; w = std::max(w / 2, 1), h = std::max(h / 2, 1)){
+        level l = { w, h, (w + TileSize - 1) / TileSize, (h + TileSize - 1) / TileSize, offset };
+        t.levels.push_back(l);
+        dims.push_back(w);
+        dims.push_back(h);
+        offsets.push_back(offset);
+        offset += (uint64_t)l.tilesX * l.tilesY * tileBytes;
+        if (w == 1 && h == 1)
+            break;
+    }
+
+    /*
+        made under another name and moved over the old one when complete, so a half written mip
+        file is never used; textures still open on the old one keep reading it (they hold the
+        file, not the name)
+    */
+    string mipFile = filename + ".mip";
+    if (!mipsUpToDate(mipFile, width, height, stamp, (int)offsets.size(), offset)){
+        string building = mipFile + ".tmp";
+        FILE *f = fopen(building.c_str(), "w+b");
+        bool built = f && buildMips(image, f, width, height, stamp, dims, offsets);
+        if (f)
+            built = fclose(f) == 0 && built;
+#ifndef _WIN32
+        built = built && rename(building.c_str(), mipFile.c_str()) == 0;
+#else
+        built = built && MoveFileExA(building.c_str(), mipFile.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#endif
+        if (!built){
+            printf("can't make the mip file %s\n", mipFile.c_str());
+            remove(building.c_str());
+            fclose(image);
+            return -1;
+        }
+    }
+    fclose(image);
+
+#ifdef _WIN32
+    HANDLE mips = CreateFileA(mipFile.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, 0);
+    t.mips = mips;
+    if (mips == INVALID_HANDLE_VALUE){
+#else
+    t.mips = ::open(mipFile.c_str(), O_RDONLY);
+    if (t.mips < 0){
+#endif
+        printf("can't open the mip file %s\n", mipFile.c_str());
+        return -1;
+    }
+    return count++;
+}
+
+int textureCache::tileLoads() const {
+    lock_guard<mutex> guard(lock);
+    return loads;
+}
+
+size_t textureCache::residentBytes() const {
+    lock_guard<mutex> guard(lock);
+    return resident;
+}
+
+uint64_t textureCache::tileKey(int texture, int level, int tileX, int tileY){
+    return (uint64_t)texture << 48 | (uint64_t)level << 42 | (uint64_t)tileY << 21 | (uint64_t)tileX;
+}
+
+shared_ptr<const textureCache::tile> textureCache::read(int texture, int level, int tileX, int tileY){
+    const textureCache::level &l = textures[texture].levels[level];
+    shared_ptr<tile> texels = make_shared<tile>(tileBytes);
+
+    //a tile that can't be read shows black rather than stopping the render
+    if (!readAt(textures[texture].mips, l.offset + ((uint64_t)tileY * l.tilesX + tileX) * tileBytes,
+                texels->data(), tileBytes))
+        fill(texels->begin(), texels->end(), 0);
+    return texels;
+}
+
+//the tiles this thread looked at last, by key, whichever cache they came from
+struct recentTile{
+    uint64_t cache, key;
+    shared_ptr<const vector<unsigned char> > texels;
+};
+static thread_local recentTile recentTiles[64];
+
+const unsigned char *textureCache::fetch(int texture, int level, int tileX, int tileY){
+    uint64_t key = tileKey(texture, level, tileX, tileY);
+    recentTile &recent = recentTiles[(key ^ key >> 21 ^ key >> 42) & 63];
+    if (recent.texels && recent.cache == serial && recent.key == key)
+        return recent.texels->data();
+
+    shared_ptr<const tile> texels;
+    {
+        lock_guard<mutex> guard(lock);
+        unordered_map<uint64_t, entry>::iterator it = entries.find(key);
+        if (it != entries.end()){
+            lru.splice(lru.begin(), lru, it->second.lru);
+            texels = it->second.texels;
+        }
+    }
+
+    //read without holding the lock, if another thread read it meanwhile its copy is kept
+    if (!texels){
+        shared_ptr<const tile> loaded = read(texture, level, tileX, tileY);
+        lock_guard<mutex> guard(lock);
+        unordered_map<uint64_t, entry>::iterator it = entries.find(key);
+        if (it != entries.end())
+            texels = it->second.texels;
+        else {
+            texels = loaded;
+            lru.push_front(key);
+            entry e = { texels, lru.begin() };
+            entries[key] = e;
+            resident += tileBytes;
+            loads++;
+            while (resident > budget && lru.size() > 1){
+                entries.erase(lru.back());
+                lru.pop_back();
+                resident -= tileBytes;
+            }
+        }
+    }
+
+    recent.cache = serial;
+    recent.key = key;
+    recent.texels = texels;
+    return recent.texels->data();
+}
+
+vec3 textureCache::texel(int texture, int level, int x, int y){
+    const textureCache::level &l = textures[texture].levels[level];
+    x %= l.width;
+    y %= l.height;
+    x += x < 0 ? l.width : 0;
+    y += y < 0 ? l.height : 0;
+    const unsigned char *t = fetch(texture, level, x / TileSize, y / TileSize)
+                             + ((y % TileSize) * TileSize + x % TileSize) * 3;
+    return vec3(t[0], t[1], t[2]) * (1.f / 255.f);
+}
+
+vec3 textureCache::bilinear(int texture, int level, vec2 uv){
+    const textureCache::level &l = textures[texture].levels[level];
+    float x = uv.x * l.width - 0.5f, y = (1.f - uv.y) * l.height - 0.5f;
+    float fx = floor(x), fy = floor(y);
+    int x0 = (int)fx, y0 = (int)fy;
+    fx = x - fx;
+    fy = y - fy;
+    return mix(mix(texel(texture, level, x0, y0), texel(texture, level, x0 + 1, y0), fx),
+               mix(texel(texture, level, x0, y0 + 1), texel(texture, level, x0 + 1, y0 + 1), fx), fy);
+}
+
+vec3 textureCache::sample(int texture, vec2 uv, float footprint){
+    const textureCache::texture &t = textures[texture];
+    uv = fract(uv);
+
+    //level 0 until a pixel covers more than a texel
+    const level &top = t.levels[0];
+    float lod = log2(std::max(footprint * std::max(top.width, top.height), 1.f));
+    lod = std::min(lod, (float)(t.levels.size() - 1));
+    int finer = (int)lod;
+    vec3 c = bilinear(texture, finer, uv);
+    if (lod > finer)
+        c = mix(c, bilinear(texture, finer + 1, uv), lod - finer);
+    return c;
+}
+
+// --------------------------------------------------------------------------
+
+int attachTextures(parser &p, textureCache &cache){
+    int loaded = 0;
+    p.textureIds.clear();
+    for (const string &filename : p.textureFiles){
+        p.textureIds.push_back(cache.load(filename));
+        loaded += p.textureIds.back() >= 0;
+    }
+    p.textures = p.textureFiles.empty() ? 0 : &cache;
+    return loaded;
+}
+
+float texturePixelAngle(float fieldOfView, int width){
+    return 2.f * tan(radians(fieldOfView) / 2.f) / width;
+}
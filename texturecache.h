@@ -0,0 +1,117 @@
+
+#pragma once
+#include <vector>
+#include <list>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#include "parser.h"
+
+using namespace std;
+using namespace glm;
+
+/*
+    image textures read a tile at a time: each image is converted once into a mip file next to
+    it (<image>.mip) holding all of its mip levels cut into square tiles, and only the most
+    recently used tiles of all the textures stay in memory, up to a budget, so scenes can use
+    far more texture than fits
+    safe to use from any number of threads; each thread also keeps the last few tiles it looked
+    at, so most lookups take no lock (those few can outlive their eviction, so the budget can be
+    overrun by a handful of tiles a thread)
+*/
+class textureCache{
+public:
+    static const int TileSize = 32;     //texels across a tile, RGB at a byte each
+    static const int MaxTextures = 4096;
+
+    explicit textureCache(size_t budgetBytes);
+    ~textureCache();
+
+    /*
+        the id of the texture in filename (a binary PPM), -1 if it can't be read
+        a texture is the file as it was: loading it again gives the same id while its size and
+        modification time stay the same, and once either changes it is loaded afresh under a new
+        id (renders still sampling the old one keep seeing the old image); its mip file is made
+        when it doesn't match the image, a band of rows at a time so even huge images need little
+        memory
+    */
+    int load(const string &filename);
+
+    int width(int texture) const { return textures[texture].levels[0].width; }
+    int height(int texture) const { return textures[texture].levels[0].height; }
+    int levels(int texture) const { return (int)textures[texture].levels.size(); }
+
+    /*
+        trilinear lookup at uv, (0,0) being the bottom left corner of the image and (1,1) the top
+        right, repeating outside; footprint is how much of uv the lookup covers, which picks
+        the mip levels
+    */
+    vec3 sample(int texture, vec2 uv, float footprint);
+
+    //tiles read from mip files so far, and how much memory the resident ones take
+    int tileLoads() const;
+    size_t residentBytes() const;
+
+private:
+    typedef vector<unsigned char> tile;
+
+    struct level{
+        int width, height;
+        int tilesX, tilesY;
+        uint64_t offset;                //of its first tile in the mip file
+    };
+
+    struct texture{
+        string filename;
+        uint64_t imageSize;             //of the image the texture was made from, which identify it
+        int64_t imageTime;
+#ifdef _WIN32
+        void *mips;                     //file handle, read at an offset so the threads share no position
+#else
+        int mips;                       //file descriptor, read with pread for the same reason
+#endif
+        vector<level> levels;
+    };
+
+    struct entry{
+        shared_ptr<const tile> texels;
+        list<uint64_t>::iterator lru;
+    };
+
+    static uint64_t tileKey(int texture, int level, int tileX, int tileY);
+    vec3 bilinear(int texture, int level, vec2 uv);
+    vec3 texel(int texture, int level, int x, int y);
+
+    //the texels of a tile, valid until the calling thread fetches another
+    const unsigned char *fetch(int texture, int level, int tileX, int tileY);
+    shared_ptr<const tile> read(int texture, int level, int tileX, int tileY);
+
+    //a fixed array, so lookups never race with a texture being added; ids below count are complete
+    unique_ptr<texture[]> textures;
+    atomic<int> count;
+    mutex loadLock;                     //one load at a time, mip files can take a while to make
+
+    mutable mutex lock;                 //entries, lru, resident and loads
+    unordered_map<uint64_t, entry> entries;
+    list<uint64_t> lru;                 //resident tiles, most recently used first
+    size_t budget, resident;
+    int loads;
+
+    uint64_t serial;                    //tells this cache's tiles apart in the threads' own caches
+};
+
+/*
+    loads the textures the scene's primitives name into cache and has the scene sample them from
+    it, the ones that can't be read are left off (their primitives keep their plain colours)
+    returns how many could be loaded
+*/
+int attachTextures(parser &p, textureCache &cache);
+
+//the angle between neighbouring pixels' rays for a horizontal field of view (in degrees) across
+//width pixels, which is what a scene's pixelAngle should be set to before it is rendered
+float texturePixelAngle(float fieldOfView, int width);
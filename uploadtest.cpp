@@ -0,0 +1,118 @@
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <algorithm>
+#include <vector>
+
+#include "uploadtest.h"
+#include "imagebuffer.h"
+
+using namespace std;
+using namespace glm;
+
+//pixels of image whose texel is more than a step off what DisplayColour says
+static int mismatches(ImageBuffer &image, bool &readable){
+    vector<unsigned char> rgba;
+    readable = image.ReadTexture(rgba);
+    if (!readable)
+        return image.Width() * image.Height();
+
+    int wrong = 0;
+    for (int y = 0; y < image.Height(); y++)
+        for (int x = 0; x < image.Width(); x++){
+            vec3 c = image.DisplayColour(x, y);
+            const unsigned char *texel = &rgba[4 * ((size_t)y * image.Width() + x)];
+            bool off = false;
+            for (int k = 0; k < 3; k++)
+                off |= abs((int)texel[k] - (int)(c[k] * 255.f + 0.5f)) > 1;
+            wrong += off;
+        }
+    return wrong;
+}
+
+int runUploadTest(int width, int height){
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glViewport(0, 0, width, height);
+
+    ImageBuffer image;
+    bool ready = image.Initialize();
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (!ready){
+        printf("FAIL upload test: can't make a %dx%d image buffer\n", width, height);
+        return width * height;
+    }
+
+    mt19937 random(29);
+    uniform_real_distribution<float> unit(0.f, 1.f), bright(0.f, 4.f);
+    auto colour = [&](){ return vec3(unit(random), unit(random), unit(random)); };
+    auto tile = [&](bool hdr){
+        vector<vec3> colours(ImageBuffer::TilePixels);
+        for (vec3 &c : colours)
+            c = hdr ? vec3(bright(random), bright(random), bright(random)) : colour();
+        return colours;
+    };
+    int lastX = image.TilesX() - 1, lastY = image.TilesY() - 1;
+
+    const int frames = 10;
+    const char *changes[frames] = {
+        "initial image", "a band of rows by SetPixel", "edge and corner tiles", "samples added",
+        "reinhard tone mapping", "the top row alone", "cleared, then one tile", "filmic over bright tiles",
+        "the bottom row alone", "back to clamping"
+    };
+    int failures = 0;
+    for (int frame = 0; frame < frames; frame++){
+        switch (frame){
+        case 1:
+            for (int y = height / 4; y < height / 4 + 11 && y < height; y++)
+                for (int x = 0; x < width; x++)
+                    image.SetPixel(x, y, colour());
+            break;
+        case 2:
+            image.SetTile(lastX, 0, &tile(false)[0]);
+            image.SetTile(0, lastY, &tile(false)[0]);
+            image.SetTile(lastX, lastY, &tile(false)[0]);
+            break;
+        case 3:
+            for (int i = 0; i < 3; i++)
+                image.AccumulateTile(lastX / 2, lastY / 2, &tile(false)[0]);
+            image.AccumulatePixel(width - 1, height / 2, colour());
+            break;
+        case 4:
+            image.SetToneMapping(ImageBuffer::TONEMAP_REINHARD, 1.f);
+            break;
+        case 5:
+            for (int x = 0; x < width; x += 3)
+                image.SetPixel(x, height - 1, colour());
+            break;
+        case 6:
+            image.ClearSamples();
+            image.AccumulateTile(1 % (lastX + 1), 1 % (lastY + 1), &tile(false)[0]);
+            break;
+        case 7:
+            image.SetToneMapping(ImageBuffer::TONEMAP_FILMIC, -0.5f);
+            for (int tx = 0; tx <= lastX; tx += 2)
+                image.SetTile(tx, lastY / 3, &tile(true)[0]);
+            break;
+        case 8:
+            for (int x = 0; x < width; x++)
+                image.SetPixel(x, 0, colour());
+            break;
+        case 9:
+            image.SetToneMapping(ImageBuffer::TONEMAP_CLAMP);
+            break;
+        }
+
+        image.Render();
+        bool readable;
+        int wrong = mismatches(image, readable);
+        if (readable)
+            printf("%s frame %d, %s: %d of %d pixels differ\n", wrong ? "FAIL" : "ok  ", frame, changes[frame],
+                   wrong, width * height);
+        else
+            printf("FAIL frame %d, %s: the texture can't be read back\n", frame, changes[frame]);
+        failures += wrong;
+    }
+    image.Destroy();
+    return failures;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+    checks the ImageBuffer's upload path (pixel buffers in turn, only the changed rows packed into
+    them) on the OpenGL context that is current, so it can run on any driver, Mesa's llvmpipe
+    included, without anyone looking at a window
+
+    an image width x height, sizes that leave the edge tiles hanging over are best, is changed
+    over a series of frames through SetPixel, SetTile, AccumulatePixel, AccumulateTile,
+    ClearSamples and SetToneMapping, the changed rows moving about so both pixel buffers get
+    partial and whole uploads; after each Render the texture is read back and every pixel compared
+    with what DisplayColour says it should show
+    prints a line a frame and returns how many pixels were off by more than one step in all
+*/
+int runUploadTest(int width, int height);